@@ -33,31 +33,422 @@ enum MODULE_INDEX {
 
 #define V4L2_CID_CAMERA_INPUT_ROTATION	(V4L2_CID_PRIVATE_BASE + 0)
 
+/* capture contexts, MODULE_RGB and MODULE_3DDEPTH included */
+#define MAX_VIDEO_CONTEXTS	16
+
+/* Error values of the capture api, returned as is (all under zero) */
+enum video_error {
+	VIDEO_ERR_INVALID = -1,		/* bad module or argument, not streaming */
+	VIDEO_ERR_IO = -2,		/* ioctl failed, stream restarted */
+	VIDEO_ERR_NOMEM = -3,
+	VIDEO_ERR_NODEV = -4,		/* device missing or unplugged */
+	VIDEO_ERR_TIMEOUT = -5,		/* no frame even after restarting */
+	VIDEO_ERR_UNSUPPORTED = -6,	/* io method or format not supported */
+};
+
+/* Frame counters of a capture context, see get_video_stats */
+struct video_stats {
+	unsigned long long frames;
+	unsigned long long bytes;
+	unsigned int sequence_gaps;	/* frames dropped by the driver */
+	unsigned int last_sequence;
+	struct timeval last_timestamp;
+	unsigned int stalls;		/* watchdog expired */
+	unsigned int io_errors;		/* failed dequeues */
+	unsigned int corrupt_frames;	/* V4L2_BUF_FLAG_ERROR, requeued */
+	unsigned int recoveries;	/* stream restarts */
+	unsigned long long recovery_us_max;
+};
+
+/* Who reads or writes frame pixels with the cpu, see set_video_cpu_access */
+enum video_cpu_access {
+	VIDEO_CPU_NONE = 0,		/* pass-through, e.g. capture to usb */
+	VIDEO_CPU_READ = 1,
+	VIDEO_CPU_WRITE = 2,
+	VIDEO_CPU_RW = 3,		/* default */
+};
+
+#define VIDEO_TIMELINE_STEPS	12
+
+/* Time per init step of a capture context, see get_video_timeline */
+struct video_timeline {
+	int count;
+	struct {
+		const char *step;	/* "open", "querycap", "probe", ... */
+		unsigned int us;
+	} steps[VIDEO_TIMELINE_STEPS];
+	unsigned int total_us;
+	int cached;			/* probing skipped, see set_video_probe_cache */
+};
+
+struct video_plane {
+	const void *start;
+	unsigned int bytesused;
+};
+
+/* Borrowed view of a capture buffer, see dequeue_video_lease */
+struct video_lease {
+	int module;
+	int index;			/* driver buffer index, -1 when released */
+	const void *start;		/* plane 0 */
+	unsigned int bytesused;		/* sum of all planes */
+	struct timeval timestamp;
+	unsigned int sequence;
+	int num_planes;
+	struct video_plane planes[VIDEO_MAX_PLANES];
+};
+
 /* for video capture */
+int  create_video_context(const char *dev_name, int kind);
+void destroy_video_context(int module);
+int  set_video_device_name(int module, const char *dev_name);
+const char *get_video_device_name(int module);
+int  get_video_frame_size(int module);
+int  get_video_format(int module, unsigned int *width, unsigned int *height,
+		      unsigned int *bytesperline);
+int  get_video_stats(int module, struct video_stats *stats);
+int  get_video_timeline(int module, struct video_timeline *tl);
+int  set_video_probe_cache(const char *path);
 int  open_video_device(int module);//, int fd);
 int get_fd(int module);
+int  set_video_wait(int module, int wait);
+int  set_video_watchdog(int module, int ms);
+int  check_video_stall(int module);
+int  set_video_io_method(int io);
+int  set_video_userptr_pool(int module, void **start, unsigned int length, int count);
+int  set_video_pixel_format(int module, unsigned int fourcc);
 int  vidioc_set_ctrl(int module, int ctrl_id, int value);
 void gain_ctrl(int module, int val);
 void exposure_ctrl(int module, int val);
 int  init_video_device(int module, int width, int height, int num_of_driverbuf);
-void start_video_capture(int module);
+int  start_video_capture(int module);
 int  dequeue_and_capture(int module, struct v4l2_buffer *buf, void *data);
 int  queue_capture(int module, struct v4l2_buffer *buf);
-void stop_video_capture(int module);
+int  dequeue_video_lease(int module, struct video_lease *lease);
+int  release_video_lease(struct video_lease *lease);
+int  requeue_video_buffer(int module, int index);
+int  get_video_buffer(int module, int index, void **start, unsigned int *length);
+int  get_video_dmabuf(int module, int index, int *fd, unsigned int *length);
+int  set_video_cpu_access(int module, int access);
+int  begin_video_cpu_access(int module, int index);
+int  end_video_cpu_access(int module, int index);
+int  stop_video_capture(int module);
 int  uninit_video_device(int module);
 int close_video_device(int module);
 
+/* memfd backed dma-buf, for boards or hosts without an exporter */
+int  alloc_dmabuf(unsigned int size, void **start);
+void free_dmabuf(int fd, void *start, unsigned int size);
+
 /* for uvc gadget */
 typedef void (* UVC_BUFFER_FILL_FUNC)(void *, int, void *, int);
 typedef void (* UVC_BUFFER_RELEASE_FUNC)(void **, void *);
 
+/* data_mode argument of UVC_BUFFER_FILL_FUNC */
+enum uvc_data_mode {
+	UVC_DATA_MODE_COPY = 0,		/* data is gadget buffer, copy len bytes into it */
+	UVC_DATA_MODE_DMABUF = 1,	/* data is struct uvc_buffer_desc to hand over */
+	UVC_DATA_MODE_USERPTR = 2,	/* same, with start of a page aligned buffer */
+};
+
+/* Buffer handed to the gadget without copy. The descriptor comes in holding
+   the buffer the gadget slot had before, leave it as is to send it again.
+   The release func gets &priv when the gadget drops a buffer. */
+struct uvc_buffer_desc {
+	int fd;				/* dma-buf fd, -1 for none */
+	void *start;			/* USERPTR buffer, NULL for none */
+	unsigned int length;		/* size of the dma-buf */
+	unsigned int bytesused;
+	void *priv;			/* owner cookie for release func */
+};
+
+/* Buffer counters of the gadget, see get_uvc_gadget_stats */
+struct uvc_gadget_stats {
+	unsigned long long qbuf;
+	unsigned long long dqbuf;
+	unsigned long long qbuf_errors;	/* buffer filled but not queued */
+};
+
 int  open_uvc_gadget_device(char *name);
+int  set_uvc_gadget_io_method(int io);
+int  set_uvc_gadget_zero_copy(int enable);
 int  init_uvc_gadget_device(void *fdata, UVC_BUFFER_FILL_FUNC fill_buf_func, UVC_BUFFER_RELEASE_FUNC release_buf_func);
 int  process_uvc_gadget_device(int useconds);
+int  get_uvc_gadget_fd(void);
+int  service_uvc_gadget_device(unsigned int events);
+int  get_uvc_gadget_stats(struct uvc_gadget_stats *stats);
 void close_uvc_gadget_device();
 
+/* for media controller, subdev pipeline in front of a video node */
+int  open_media_device(const char *dev_name);
+int  print_media_graph(int media);
+int  setup_media_pipeline(int media, int module, int width, int height);
+void close_media_device(int media);
+
+/* for reactor, one epoll loop over capture and uvc gadget fds */
+#define REACTOR_MAX_SOURCES	16
+
+typedef void (* REACTOR_VIDEO_FUNC)(int, void *);
+
+/* Dispatch counters of a reactor source, times in micro seconds */
+struct reactor_stats {
+	unsigned long long dispatches;
+	unsigned long long errors;		/* EPOLLERR, e.g. capture not streaming */
+	unsigned long long wait_us_sum;		/* epoll wake up to handler start */
+	unsigned long long wait_us_max;
+	unsigned long long busy_us_sum;		/* time in handler */
+	unsigned long long latency_count;	/* capture only: */
+	unsigned long long latency_us_sum;	/* frame timestamp to handler start */
+	unsigned long long latency_us_max;
+};
+
+int  reactor_init(void);
+int  reactor_add_video(int module, REACTOR_VIDEO_FUNC func, void *arg);
+int  reactor_add_uvc_gadget(void);
+void reactor_remove(int id);
+int  reactor_run(void);
+void reactor_stop(void);
+int  reactor_get_stats(int id, struct reactor_stats *stats);
+void reactor_close(void);
+
+/* for frame pool, reference counted frames shared by pipeline stages */
+struct frame_pool;
+
+/* A plane of a pool frame, a view into its data */
+struct frame_plane {
+	unsigned int offset;		/* from data */
+	unsigned int bytesused;
+};
+
+/* One frame of a pool, every stage keeping it holds a reference */
+struct pool_frame {
+	void *data;
+	unsigned int length;		/* buffer size */
+	unsigned int bytesused;		/* sum of all planes */
+	int num_planes;			/* zero until filled */
+	struct frame_plane planes[VIDEO_MAX_PLANES];
+	struct timeval timestamp;
+	unsigned int sequence;
+	int index;			/* in the pool */
+	int refs;
+	struct frame_pool *pool;
+};
+
+/* Memory of a frame pool, see create_frame_pool */
+enum frame_pool_flags {
+	FRAME_POOL_HUGEPAGE = 1,	/* MAP_HUGETLB, else transparent huge pages */
+	FRAME_POOL_LOCK = 2,		/* mlock, no page faults after startup */
+};
+
+enum frame_pool_backing {
+	FRAME_POOL_PAGES = 0,		/* base pages */
+	FRAME_POOL_THP = 1,		/* MADV_HUGEPAGE given, the kernel may still split */
+	FRAME_POOL_HUGETLB = 2,
+};
+
+struct frame_pool_stats {
+	int count;
+	int in_use;
+	int max_in_use;
+	unsigned long long gets;
+	unsigned long long exhausted;	/* no free frame, the caller dropped one */
+	unsigned long long bytes;	/* arena size */
+	int backing;			/* FRAME_POOL_PAGES, THP or HUGETLB */
+	int locked;
+	unsigned int prefault_us;	/* page faults taken in create_frame_pool */
+};
+
+struct frame_pool *create_frame_pool(int count, unsigned int length, int flags);
+void destroy_frame_pool(struct frame_pool *pool);
+struct pool_frame *get_pool_frame(struct frame_pool *pool);
+struct pool_frame *ref_pool_frame(struct pool_frame *frame);
+void unref_pool_frame(struct pool_frame *frame);
+int  get_frame_pool_stats(struct frame_pool *pool, struct frame_pool_stats *stats);
+long long frame_age_us(const struct timeval *ts);
+
+/* for pairing, depth frames matched to the nearest rgb frame by timestamp */
+#define PAIR_SKEW_BINS			16
+#define PAIR_DEFAULT_TOLERANCE_US	16667	/* half a frame at 30 fps */
+
+struct frame_pairer;
+
+/* Pairing counters, skews are depth - rgb in micro seconds */
+struct pair_stats {
+	unsigned long long paired;
+	unsigned long long unpaired_depth;	/* no rgb frame within the tolerance */
+	unsigned long long unpaired_rgb;	/* left the history never paired */
+	unsigned long long matches;		/* depth frames with any rgb to compare */
+	unsigned int tolerance_us;
+	unsigned int skew_bin_us;
+	/* nearest skew of every match, bin i from -2 * tolerance + i * skew_bin_us */
+	unsigned long long skew_hist[PAIR_SKEW_BINS];
+	long long skew_us_min;
+	long long skew_us_max;
+	long long skew_us_sum;			/* of paired frames */
+};
+
+struct frame_pairer *pairer_create(int history, unsigned int tolerance_us);
+void pairer_destroy(struct frame_pairer *pr);
+void pairer_set_tolerance(struct frame_pairer *pr, unsigned int tolerance_us);
+void pairer_add_rgb(struct frame_pairer *pr, struct pool_frame *frame);
+struct pool_frame *pairer_match(struct frame_pairer *pr, const struct timeval *ts);
+int  pairer_get_stats(struct frame_pairer *pr, struct pair_stats *stats);
+
+/* for depth frames, SBGGR12P phase images stacked top to bottom */
+#define DEPTH_PHASES		9
+#define DEPTH_PHASE_WIDTH	224
+#define DEPTH_PHASE_HEIGHT	173
+
+enum depth_unpack_kernel {
+	DEPTH_UNPACK_AUTO = 0,		/* the widest this cpu has */
+	DEPTH_UNPACK_SCALAR,
+	DEPTH_UNPACK_SSSE3,
+	DEPTH_UNPACK_AVX2,
+	DEPTH_UNPACK_NEON,
+};
+
+int  set_depth_unpack_kernel(int kernel);
+int  get_depth_unpack_kernel(const char **name);
+int  unpack_sbggr12p(const void *src, unsigned int stride, unsigned int width,
+		     unsigned int height, unsigned short *dst, unsigned int dst_stride);
+int  unpack_depth_phases(const void *src, unsigned int stride, unsigned int width,
+			 unsigned int height, unsigned short *planes[], int phases);
+
+/* for the ToF depth engine, depth, amplitude and confidence from phases */
+#define TOF_MAX_THREADS		8
+#define TOF_DEFAULT_THREADS	4		/* the four A53 cores */
+#define TOF_DEFAULT_FREQ1_HZ	80320000
+#define TOF_DEFAULT_FREQ2_HZ	60240000	/* with FREQ1, 7.46 m unwrapped */
+
+/* Phase images of a frame in the sensor modes, see tof_layout_of_height */
+enum tof_layout {
+	TOF_LAYOUT_4 = 0,	/* 4 phases at freq_hz[0] */
+	TOF_LAYOUT_2X4,		/* 4 at freq_hz[0], then 4 at freq_hz[1] */
+	TOF_LAYOUT_9,		/* a gray image, then as TOF_LAYOUT_2X4 */
+	TOF_LAYOUTS,
+};
+
+struct tof_engine;
+
+struct tof_config {
+	int layout;			/* TOF_LAYOUT_xxx */
+	unsigned int width;		/* pixels of a phase row, a multiple of 4 */
+	unsigned int height;		/* rows of one phase */
+	unsigned int stride;		/* bytes of a packed row */
+	unsigned int freq_hz[2];	/* of phases 1 - 4 and 5 - 8 */
+	unsigned int min_amplitude;	/* below it no depth */
+	unsigned int full_amplitude;	/* confidence 255 from it up */
+	unsigned int budget_us;		/* time a frame may take */
+	int threads;			/* the caller and threads - 1 workers */
+	int first_cpu;			/* worker i on first_cpu + i, -1 for any */
+};
+
+/* The maps of a frame, width x height each, zero depth for no depth */
+struct tof_output {
+	unsigned short *depth;		/* mm */
+	unsigned short *amplitude;
+	unsigned char *confidence;
+};
+
+/* Time taken per frame against the budget */
+struct tof_stats {
+	unsigned long long frames;
+	unsigned long long over_budget;
+	unsigned long long us_sum;
+	unsigned long long us_max;
+	unsigned int last_us;
+	unsigned int budget_us;
+	int threads;
+	unsigned long long busy_us[TOF_MAX_THREADS];	/* [0] is the caller */
+	unsigned long long tiles[TOF_MAX_THREADS];
+};
+
+/* Calibration blob, the header then its tables at their offsets, each a
+   multiple of 64 bytes. Tables are per pixel, row by row:
+     phase_offset  u16 [2][width * height], subtracted, 65536 a turn
+     ray_z         u16 [width * height], cosine of the pixel's ray to the
+                   optical axis, 32768 = 1 (depth along the axis)
+     wiggle        s16 [2][TOF_WIGGLE_BINS], added to the phase, indexed
+                   by phase / (65536 / TOF_WIGGLE_BINS)
+   [2] is for freq_hz[0] and freq_hz[1]. Byte order of the target. */
+#define TOF_CALIB_MAGIC		0x43464f54	/* "TOFC" */
+#define TOF_CALIB_VERSION	1
+#define TOF_WIGGLE_BINS		256
+
+struct tof_calib_header {
+	unsigned int magic;
+	unsigned int version;
+	unsigned int width;
+	unsigned int height;
+	unsigned int freq_hz[2];
+	unsigned int wiggle_bins;
+	unsigned int phase_offset;	/* byte offsets from the header */
+	unsigned int ray_z;
+	unsigned int wiggle;
+	unsigned int size;		/* of the header and tables */
+	unsigned int reserved[5];	/* zero */
+};
+
+int  tof_layout_phases(int layout);
+int  tof_layout_of_height(unsigned int height, unsigned int phase_height);
+void tof_default_config(struct tof_config *cfg, int layout);
+struct tof_engine *tof_create(const struct tof_config *cfg);
+void tof_destroy(struct tof_engine *e);
+unsigned int tof_output_size(const struct tof_engine *e);
+void tof_output_planes(const struct tof_engine *e, void *data, struct tof_output *out);
+int  tof_load_calibration(struct tof_engine *e, const char *path);
+int  tof_save_calibration(struct tof_engine *e, const char *path);
+int  tof_process(struct tof_engine *e, const void *raw, unsigned int length, struct tof_output *out);
+int  tof_get_stats(struct tof_engine *e, struct tof_stats *stats);
+
+/* for depth maps, filters run in place in the order set */
+#define DEPTH_FILTER_MAX_CHAIN	8
+
+enum depth_filter {
+	DEPTH_FILTER_AMPLITUDE = 0,	/* no depth under min_amplitude */
+	DEPTH_FILTER_FLYING,		/* no depth between two surfaces */
+	DEPTH_FILTER_MEDIAN3,
+	DEPTH_FILTER_MEDIAN5,
+	DEPTH_FILTER_TEMPORAL,		/* IIR with the frames before */
+	DEPTH_FILTER_HOLES,		/* small holes from their neighbours */
+	DEPTH_FILTERS,
+};
+
+struct depth_filters;
+
+struct depth_filter_config {
+	unsigned int min_amplitude;
+	unsigned int flying_mm;		/* a jump to both neighbours over it */
+	unsigned int temporal_alpha;	/* weight of the new frame, 256 = all */
+	unsigned int temporal_reset_mm;	/* a change over it starts again */
+	unsigned int hole_neighbours;	/* of the 8 with depth to fill a hole */
+};
+
+/* Time of the filters, by DEPTH_FILTER_xxx, nano seconds */
+struct depth_filter_stats {
+	unsigned long long frames;
+	unsigned long long ns_total;			/* the whole chain */
+	unsigned long long runs[DEPTH_FILTERS];		/* frames it ran on */
+	unsigned long long ns_sum[DEPTH_FILTERS];
+	unsigned long long ns_max[DEPTH_FILTERS];	/* of one frame */
+};
+
+void depth_filters_default_config(struct depth_filter_config *cfg);
+struct depth_filters *depth_filters_create(unsigned int width, unsigned int height,
+					   const struct depth_filter_config *cfg);
+void depth_filters_destroy(struct depth_filters *f);
+int  depth_filters_set_chain(struct depth_filters *f, const int *order, int count);
+int  depth_filters_set_config(struct depth_filters *f, const struct depth_filter_config *cfg);
+const char *depth_filter_name(int filter);
+int  depth_filters_run(struct depth_filters *f, unsigned short *depth, const unsigned short *amplitude,
+		       unsigned char *confidence);
+int  depth_filters_get_stats(struct depth_filters *f, struct depth_filter_stats *stats);
+
 /* for utills */
 void timer_init();
+int  alloc_userptr_buffers(void **start, int count, unsigned int length);
+void free_userptr_buffers(void **start, int count);
+int  set_thread_cpu(int cpu);
 
 extern FILE *dfp;
 extern int debug_level;
@@ -86,6 +477,7 @@ enum {
 	ERROR_CREATE_DEPTH_THREAD = -1006,
 	ERROR_CREATE_USB_DEVICE_THREAD = -1007,
 	ERROR_INIT_DEPTH = -1007,
+	ERROR_ALLOC_POOL = -1008,
 };
 
 #ifdef __cplusplus
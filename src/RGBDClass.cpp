@@ -59,15 +59,59 @@ void signal_handler(int sig)
 
 /**
  *  @brief Constructor of RGBDSensor class
+ *  @param[in] num_buf  number of capture driver buffers, up to
+ *                      RGBD_MAX_BUFFERS (Init fails over it)
+ *  @param[in] io       IO_METHOD_MMAP, IO_METHOD_USERPTR or IO_METHOD_DMABUF.
+ *                      USERPTR and DMABUF send rgb buffers to uvc without copy,
+ *                      two of them sit in the gadget so use 6 buffers or more.
+ *                      they send rgb only: depth is captured but not paired
+ *                      and no callback is called, see RegisterCallback.
+ *  @param[in] rgb_dev    rgb video node, NULL for /dev/video0
+ *  @param[in] depth_dev  depth video node, NULL for /dev/video1
+ *  @param[in] uvc_dev    uvc gadget node, NULL for a head without gadget.
+ *                        only one object in a process may own the gadget.
+ *  @param[in] cpu      core for the capture thread, -1 for any. it runs
+ *                      the reactor of rgb, depth (runner) and uvc.
  *  @return none
 */
 
-TRGBDClass::TRGBDClass(int num_buf) 
+TRGBDClass::TRGBDClass(int num_buf, int io, const char *rgb_dev, const char *depth_dev,
+		       const char *uvc_dev, int cpu) 
 {
+	this->rgb_dev = rgb_dev;
+	this->depth_dev = depth_dev;
+	this->uvc_dev = uvc_dev;
+	media_dev = NULL;
+	thr_data.rgb_module = MODULE_RGB;
+	thr_data.depth_module = MODULE_DEPTH;
+	thr_data.cpu = cpu;
+	thr_data.rgb_frames = NULL;
+	thr_data.depth_frames = NULL;
+	thr_data.frame_flags = FRAME_POOL_HUGEPAGE | FRAME_POOL_LOCK;
+	thr_data.pairer = NULL;
+	thr_data.pair_tolerance_us = 0;
+	thr_data.tof = NULL;
+	thr_data.tof_threads = 0;
+	thr_data.tof_budget_us = 0;
+	thr_data.tof_calib = NULL;
+	thr_data.depth_layout = TOF_LAYOUT_9;
+	thr_data.filters = NULL;
+	thr_data.filter_count = 0;
+	thr_data.rgbd_data_q = NULL;
+	thr_data.rgbd_mailbox = NULL;
+	thr_data.delivery = RGBD_DELIVERY_FIFO;
+	memset(&thr_data.gaps, 0, sizeof(thr_data.gaps));
+	thr_data.sent_sequence = -1;
+	thr_data.max_age_us = 0;
+	memset(thr_data.stages, 0, sizeof(thr_data.stages));
 	thr_data.num_of_buffer = num_buf;
 	thr_data.g_video_done = 0;
 	thr_data.g_depth_done = 0;
 	thr_data.g_uvc_done = 0;		
+	thr_data.io_method = io;
+	thr_data.rgb_latest = -1;
+	memset(thr_data.rgb_userptr, 0, sizeof(thr_data.rgb_userptr));
+	thr_data.owner = this;
 	exit_requested = 0;
 	CB_Func = NULL;
 }
@@ -85,16 +129,355 @@ TRGBDClass::~TRGBDClass()
 /**
  *  @brief Register callback functions
  *  @param[in] func    callback function, must be func(void *data) type.
- *  @return none
+ *                     data is the struct fifo_mem_t of the pair uvc sends,
+ *                     its rgb and depth frames (planes, see struct
+ *                     pool_frame) are valid during the call, ref_pool_frame
+ *                     keeps one longer.
+ *  @return \b zero for success
+ *          \b VIDEO_ERR_UNSUPPORTED with IO_METHOD_USERPTR or DMABUF, which
+ *          make no pairs to call it with
  *  @see   CALLBACK Function definition.
 */
 int TRGBDClass::RegisterCallback(void *func)
 {
+	if (thr_data.io_method != IO_METHOD_MMAP) {
+		DBGERROR("callbacks need IO_METHOD_MMAP, rgb goes to uvc uncopied\n");
+		return VIDEO_ERR_UNSUPPORTED;
+	}
 	CB_Func = (cb_func_type)func;
 
 	return 0;
 }
 
+/**
+ *  @brief Set the media device of the rgb sensor
+ *  @param[in] dev    media node, e.g. "/dev/media0". NULL (default) for
+ *                    a video node without subdevs
+ *  @return none
+ *  @note  call before Init. Init then picks the sensor mode closest to
+ *         the uvc frame, see setup_media_pipeline.
+*/
+void TRGBDClass::SetMediaDevice(const char *dev)
+{
+	media_dev = dev;
+}
+
+/**
+ *  @brief Set the memory of the rgb and depth frame pools
+ *  @param[in] flags  FRAME_POOL_HUGEPAGE and FRAME_POOL_LOCK (default),
+ *                    zero for plain prefaulted pages
+ *  @return none
+ *  @note  call before Init. used with IO_METHOD_MMAP only, the other
+ *         methods hand driver buffers to uvc.
+*/
+void TRGBDClass::SetFrameMemory(int flags)
+{
+	thr_data.frame_flags = flags;
+}
+
+/**
+ *  @brief Set how paired frames reach uvc
+ *  @param[in] mode   RGBD_DELIVERY_FIFO (default) sends every pair in
+ *                    order, a host may see them up to the ring depth late.
+ *                    RGBD_DELIVERY_LATEST sends the newest pair, pairs
+ *                    replaced before uvc asked are dropped without a copy.
+ *  @return none
+ *  @note  call before Init. IO_METHOD_USERPTR and DMABUF always send the
+ *         newest rgb buffer.
+*/
+void TRGBDClass::SetDelivery(int mode)
+{
+	thr_data.delivery = mode;
+}
+
+/**
+ *  @brief Set the largest rgb to depth timestamp skew of a pair
+ *  @param[in] us     micro seconds, zero for PAIR_DEFAULT_TOLERANCE_US.
+ *                    a depth frame with no rgb frame this close is not sent.
+ *  @return none
+ *  @note  may be called while running, the skew histogram restarts.
+*/
+void TRGBDClass::SetPairTolerance(unsigned int us)
+{
+	thr_data.pair_tolerance_us = us;
+	if (thr_data.pairer)
+		pairer_set_tolerance(thr_data.pairer, us);
+}
+
+/**
+ *  @brief Get the pairing counters and skew histogram
+ *  @param[out] stats  see struct pair_stats
+ *  @return \b zero for success
+ *          \b under zero value when not pairing (IO_METHOD_MMAP only)
+*/
+int TRGBDClass::GetPairStats(struct pair_stats *stats)
+{
+	return pairer_get_stats(thr_data.pairer, stats);
+}
+
+/**
+ *  @brief Set the deadline of a frame, counted from its capture
+ *  @param[in] us     micro seconds, zero (default) to never drop for age
+ *  @return none
+ *  @note  each stage checks the age before its copy or callback and drops
+ *         a frame already past it, see GetStageStats. the gadget's own
+ *         queue is not checked, uvc may add its buffers' time on top.
+*/
+void TRGBDClass::SetMaxFrameAge(unsigned int us)
+{
+	thr_data.max_age_us = us;
+}
+
+/**
+ *  @brief Compute depth, amplitude and confidence maps from the raw phases
+ *  @param[in] threads    of the depth engine, the capture thread is one of
+ *                        them. zero (default) keeps the raw frame (copied)
+ *  @param[in] budget_us  time a frame may take in the engine, zero for
+ *                        a 30 fps frame time. only reported, see
+ *                        GetDepthStats
+ *  @return none
+ *  @note  call before Init, used with IO_METHOD_MMAP only. the depth
+ *         frame of each pair given to the callback then has the three
+ *         DEPTH_PHASE_WIDTH x HEIGHT maps as planes 0, 1 and 2, see
+ *         tof_output_planes. uvc sends rgb either way.
+*/
+void TRGBDClass::SetDepthEngine(int threads, unsigned int budget_us)
+{
+	thr_data.tof_threads = threads;
+	thr_data.tof_budget_us = budget_us;
+}
+
+/**
+ *  @brief Set the depth sensor mode by its phase layout
+ *  @param[in] layout   TOF_LAYOUT_xxx, TOF_LAYOUT_9 by default. the
+ *                      capture height asked for is its images times
+ *                      DEPTH_PHASE_HEIGHT
+ *  @return none
+ *  @note  call before Init. the depth engine follows the height the
+ *         driver negotiates, which may be another layout's.
+*/
+void TRGBDClass::SetDepthLayout(int layout)
+{
+	if (tof_layout_phases(layout) > 0)
+		thr_data.depth_layout = layout;
+}
+
+/**
+ *  @brief Set the calibration blob of the depth engine
+ *  @param[in] path   file of struct tof_calib_header and its tables,
+ *                    NULL (default) for an uncalibrated engine
+ *  @return none
+ *  @note  call before Init, which fails when the blob does not load. the
+ *         blob is mapped, see tof_load_calibration.
+*/
+void TRGBDClass::SetDepthCalibration(const char *path)
+{
+	thr_data.tof_calib = path;
+}
+
+/**
+ *  @brief Get the time the depth engine takes against its budget
+ *  @param[out] stats  see struct tof_stats
+ *  @return \b zero for success
+ *          \b under zero value when the engine is not running
+*/
+int TRGBDClass::GetDepthStats(struct tof_stats *stats)
+{
+	return tof_get_stats(thr_data.tof, stats);
+}
+
+/**
+ *  @brief Set the filters run on each depth map after the depth engine
+ *  @param[in] order   DEPTH_FILTER_xxx, first to last, e.g.
+ *                     DEPTH_FILTER_FLYING, MEDIAN3 and HOLES
+ *  @param[in] count   up to DEPTH_FILTER_MAX_CHAIN, zero for none
+ *  @return \b zero for success
+ *          \b under zero value when the order is bad, or after Init
+ *          without a chain
+ *  @note  none by default. call before Init to run them with the engine
+ *         (SetDepthEngine), the callback's depth frame then has the
+ *         filtered maps. after Init it changes that chain, the next frame
+ *         uses it.
+*/
+int TRGBDClass::SetDepthFilters(const int *order, int count)
+{
+	if (count < 0 || count > DEPTH_FILTER_MAX_CHAIN || (count && !order))
+		return VIDEO_ERR_INVALID;
+	if (thr_data.filters)
+		return depth_filters_set_chain(thr_data.filters, order, count);
+	/* running, the chain can not be made under the depth handler */
+	if (thr_data.tof)
+		return VIDEO_ERR_INVALID;
+	if (count)
+		memcpy(thr_data.filter_order, order, count * sizeof(int));
+	thr_data.filter_count = count;
+
+	return 0;
+}
+
+/**
+ *  @brief Get the time each depth filter takes
+ *  @param[out] stats  see struct depth_filter_stats
+ *  @return \b zero for success
+ *          \b under zero value when the engine is not running
+*/
+int TRGBDClass::GetDepthFilterStats(struct depth_filter_stats *stats)
+{
+	return depth_filters_get_stats(thr_data.filters, stats);
+}
+
+/**
+ *  @brief Get the frame and drop counters of the stages
+ *  @param[out] stats  RGBD_STAGES entries, indexed by enum rgbd_stage
+ *  @return none
+*/
+void TRGBDClass::GetStageStats(struct rgbd_stage_stats *stats)
+{
+	memcpy(stats, thr_data.stages, sizeof(thr_data.stages));
+}
+
+/**
+ *  @brief Get the frames lost per stage, from the sensors to the gadget
+ *  @param[out] stats  see struct rgbd_gap_stats
+ *  @return none
+ *  @note  the gadget count is read while it is open, call before Uninit
+ *         for the final numbers.
+*/
+void TRGBDClass::GetGapStats(struct rgbd_gap_stats *stats)
+{
+	struct video_stats vs;
+	struct uvc_gadget_stats us;
+	struct mailbox_stats ms;
+
+	*stats = thr_data.gaps;
+	if (get_video_stats(thr_data.rgb_module, &vs) == 0)
+		stats->sensor_rgb = vs.sequence_gaps;
+	if (get_video_stats(thr_data.depth_module, &vs) == 0)
+		stats->sensor_depth = vs.sequence_gaps;
+	if (thr_data.rgbd_mailbox) {
+		thr_data.rgbd_mailbox->getStats(&ms);
+		stats->uvc += ms.superseded;
+	}
+	if (uvc_dev && get_uvc_gadget_stats(&us) == 0)
+		stats->gadget = us.qbuf_errors;
+}
+
+/**
+ *  @brief   Note the sequence of a frame given to uvc, count what it skipped
+ *  @param[in]  thd     struct thread_data_t
+ *  @param[in]  seq     v4l2 sequence of the frame
+ *  @return none
+*/
+static void sent_sequence(struct thread_data_t *thd, unsigned int seq)
+{
+	int skipped = (int)(seq - (unsigned int)thd->sent_sequence) - 1;
+
+	if (thd->sent_sequence >= 0 && skipped > 0)
+		thd->gaps.output_gaps += skipped;
+	thd->sent_sequence = seq;
+	thd->gaps.sent++;
+}
+
+/**
+ *  @brief   Count a frame at a stage and check its deadline
+ *  @param[in]  thd     struct thread_data_t
+ *  @param[in]  stage   RGBD_STAGE_xxx, each is run by one thread
+ *  @param[in]  ts      capture timestamp of the frame
+ *  @return 1 when the frame is past its deadline and dropped here, 0 otherwise
+*/
+static int stage_late(struct thread_data_t *thd, int stage, const struct timeval *ts)
+{
+	struct rgbd_stage_stats *st = &thd->stages[stage];
+	long long age = frame_age_us(ts);
+
+	st->frames++;
+	if (age > (long long)st->age_us_max)
+		st->age_us_max = age;
+	if (!thd->max_age_us || age <= (long long)thd->max_age_us)
+		return 0;
+	st->late++;
+
+	return 1;
+}
+
+/* a pair is as old as its older frame */
+static const struct timeval *pair_stamp(struct fifo_mem_t *fmem)
+{
+	return timercmp(&fmem->rgb->timestamp, &fmem->depth->timestamp, <) ?
+	       &fmem->rgb->timestamp : &fmem->depth->timestamp;
+}
+
+/**
+ *  @brief   Copy a leased frame out, planes back to back
+ *  @param[in]  lease   leased driver buffer
+ *  @param[out] frame   pool frame, its planes say where each one went.
+ *                      planes that do not fit are left out
+ *  @return none
+*/
+static void copy_lease(struct video_lease *lease, struct pool_frame *frame)
+{
+	unsigned int off = 0;
+	int i;
+
+	begin_video_cpu_access(lease->module, lease->index);
+	for (i = 0; i < lease->num_planes && off + lease->planes[i].bytesused <= frame->length; i++) {
+		memcpy((char *)frame->data + off, lease->planes[i].start, lease->planes[i].bytesused);
+		frame->planes[i].offset = off;
+		frame->planes[i].bytesused = lease->planes[i].bytesused;
+		off += lease->planes[i].bytesused;
+	}
+	end_video_cpu_access(lease->module, lease->index);
+	frame->num_planes = i;
+	frame->bytesused = off;
+}
+
+/**
+ *  @brief   Fill a depth frame from a leased one, a copy or the engine's maps
+ *  @param[in]  thd     struct thread_data_t
+ *  @param[in]  lease   leased depth buffer
+ *  @param[out] depth   pool frame
+ *  @return 0 when filled, 1 when dropped at RGBD_STAGE_DEPTH (counted),
+ *          under zero when the frame does not fit
+*/
+static int fill_depth(struct thread_data_t *thd, struct video_lease *lease, struct pool_frame *depth)
+{
+	struct tof_output out;
+	int ret;
+
+	if (!thd->tof) {
+		if (lease->bytesused > depth->length)
+			return -1;
+		copy_lease(lease, depth);
+		return 0;
+	}
+	/* the engine reads the driver buffer in place, the raw frame is not kept */
+	if (stage_late(thd, RGBD_STAGE_DEPTH, &lease->timestamp)) {
+		thd->gaps.depth++;
+		return 1;
+	}
+	tof_output_planes(thd->tof, depth->data, &out);
+	begin_video_cpu_access(lease->module, lease->index);
+	ret = tof_process(thd->tof, lease->planes[0].start, lease->planes[0].bytesused, &out);
+	end_video_cpu_access(lease->module, lease->index);
+	if (ret) {
+		thd->gaps.depth++;
+		return 1;
+	}
+	/* filter the maps while they are still in cache */
+	if (thd->filters)
+		depth_filters_run(thd->filters, out.depth, out.amplitude, out.confidence);
+	depth->bytesused = tof_output_size(thd->tof);
+	depth->num_planes = 3;
+	depth->planes[0].offset = 0;
+	depth->planes[0].bytesused = (char *)out.amplitude - (char *)out.depth;
+	depth->planes[1].offset = depth->planes[0].bytesused;
+	depth->planes[1].bytesused = (char *)out.confidence - (char *)out.amplitude;
+	depth->planes[2].offset = depth->planes[1].offset + depth->planes[1].bytesused;
+	depth->planes[2].bytesused = depth->bytesused - depth->planes[2].offset;
+
+	return 0;
+}
+
 
 
 /**
@@ -113,36 +496,99 @@ void TRGBDClass::preRun(void *data)
 
 /**
  *  @brief actual work functions for do something
- *         
+ *         takes one depth frame, pairs it and hands the pair on
+ *  @param[out] data   struct v4l2_buffer, what was dequeued
  *  @return none
+ *  @note  the reactor of the capture thread calls it when the depth fd is
+ *         readable, see depth_capture_frame. applications do not call it.
 */
 void TRGBDClass::runner(void *data)
 {
-	int idx;
 	struct v4l2_buffer *buf = (struct v4l2_buffer *)data;		
-	dequeue_and_capture(MODULE_DEPTH, buf, &thr_data.depth[0]);
-	/* Copy data into some where */
-	idx = (thr_data.rgb_index - 1) & 31;
-	if (!FIFO_FULL(thr_data.rgbd_data_q)) {
-		struct fifo_mem_t *fmem;
+	struct video_lease lease;
 
-		fmem = DQUE_FIFO_HEAD(thr_data.rgbd_data_q);
-		fmem->rgb_stamp = thr_data.rgb_stamps[idx];
-		fmem->depth_stamp = buf->timestamp;
-		memcpy(&fmem->rgb[0], &thr_data.rgb[idx][0], thr_data.rgb_size);
-		memcpy(&fmem->depth[0], &thr_data.depth[0], buf->bytesused);
-		
-		if (CB_Func) {
-			CB_Func(&fmem->rgb[0]);
+	/* depth is read in place, the driver buffer goes back after use */
+	if (dequeue_video_lease(thr_data.depth_module, &lease))
+		return;
+	buf->index = lease.index;
+	buf->bytesused = lease.bytesused;
+	buf->timestamp = lease.timestamp;
+	buf->sequence = lease.sequence;
+
+	/* rgb goes to uvc without copy, nothing to pair it with here. the
+	   callback is MMAP only, RegisterCallback refuses it */
+	if (thr_data.io_method != IO_METHOD_MMAP) {
+		release_video_lease(&lease);
+		return;
+	}
+	/* too old already, not worth the copy */
+	if (stage_late(&thr_data, RGBD_STAGE_PAIR, &lease.timestamp)) {
+		thr_data.gaps.pair++;
+		release_video_lease(&lease);
+		return;
+	}
+	/* a full ring drops the pair, the uvc side sends its last frame again.
+	   the mailbox always has a slot */
+	struct fifo_mem_t *fmem = thr_data.rgbd_mailbox ? thr_data.rgbd_mailbox->producerSlot() :
+				  thr_data.rgbd_data_q->producerSlot();
+	if (fmem) {
+		struct pool_frame *rgb, *depth;
+		int ret = -1;
+
+		/* the rgb frame taken nearest in time is shared, not copied.
+		   none close enough: the pair is not sent */
+		rgb = pairer_match(thr_data.pairer, &lease.timestamp);
+		/* depth is copied or computed once, the driver buffer goes back
+		   below. only for a pair that is sent */
+		depth = get_pool_frame(thr_data.depth_frames);
+		if (rgb && depth && (ret = fill_depth(&thr_data, &lease, depth)) == 0) {
+			depth->timestamp = lease.timestamp;
+			depth->sequence = lease.sequence;
+			fmem->rgb = rgb;
+			fmem->depth = depth;
+		} else {
+			if (!rgb)
+				thr_data.gaps.unpaired++;
+			else if (ret < 0)
+				thr_data.gaps.pair++;
+			unref_pool_frame(rgb);
+			unref_pool_frame(depth);
+			fmem = NULL;
+		}
+		/* too late for the callback is too late for uvc */
+		if (fmem && CB_Func && stage_late(&thr_data, RGBD_STAGE_CALLBACK, pair_stamp(fmem))) {
+			thr_data.gaps.callback++;
+			unref_pool_frame(fmem->rgb);
+			unref_pool_frame(fmem->depth);
+			fmem->rgb = fmem->depth = NULL;
+			fmem = NULL;
+		}
+		if (fmem) {
+			/* the callback reads the pair uvc sends */
+			if (CB_Func) {
+				CB_Func(fmem);
+			}
+			if (thr_data.rgbd_mailbox) {
+				/* uvc never took the one this replaces, drop it */
+				struct fifo_mem_t *old = thr_data.rgbd_mailbox->publish();
+
+				if (old) {
+					unref_pool_frame(old->rgb);
+					unref_pool_frame(old->depth);
+					old->rgb = old->depth = NULL;
+				}
+			} else {
+				thr_data.rgbd_data_q->commit();
+			}
 		}
-		/* The we need to call the callback func */
-		QUE_FIFO_HEAD(thr_data.rgbd_data_q);
-		//DBGINFO("fifo que head=%d tail=%d\n", thr_data.rgbd_data_q->head, thr_data.rgbd_data_q->tail);
+	} else {
+		/* ring full */
+		thr_data.gaps.pair++;
 	}
 	/* call calback User calc functions */
 	/* thd->callback((void *)thd); */
 	/* We need synchronize with RGB */
-	queue_capture(MODULE_DEPTH, buf);		
+	release_video_lease(&lease);
 
 
 }
@@ -153,58 +599,171 @@ void TRGBDClass::runner(void *data)
 
 
 /**
- *  @brief   Capture thread start_routine. Fill the video buffer
- *  @param[in]  data     struct thread_data_t 
- *  @return NULL
- *  @see    main
+ *  @brief   Reactor handler of the depth fd, one frame through runner
+ *  @param[in]  module   depth video module
+ *  @param[in]  data     struct thread_data_t
+ *  @return none
 */
-void * rgb_capture_func(void *data)
+static void depth_capture_frame(int module, void *data)
 {
+	struct thread_data_t *thd = (struct thread_data_t *)data;
 	struct v4l2_buffer buf;
+
+	((TRGBDClass *)thd->owner)->runner(&buf);
+}
+
+/**
+ *  @brief   Print the dispatch counters of a reactor source
+ *  @param[in]  name     of the source
+ *  @param[in]  src      source id
+ *  @param[in]  module   its video module
+ *  @return none
+*/
+static void print_source_stats(const char *name, int src, int module)
+{
+	struct reactor_stats st;
+	struct video_stats vs;
+
+	if (reactor_get_stats(src, &st) == 0 && st.latency_count)
+		DBGPRINT("%s dispatch: %llu frames, latency avg %llu max %llu us\n", name,
+			 st.latency_count, st.latency_us_sum / st.latency_count,
+			 st.latency_us_max);
+	if (get_video_stats(module, &vs) == 0)
+		DBGPRINT("%s capture: %llu frames, %u dropped\n", name, vs.frames, vs.sequence_gaps);
+}
+
+/**
+ *  @brief   Take one rgb frame, copied or kept as lease for uvc
+ *  @param[in]  module   rgb video module
+ *  @param[in]  data     struct thread_data_t 
+ *  @return none
+ *  @see    rgb_capture_func, io_reactor_func
+*/
+static void rgb_capture_frame(int module, void *data)
+{
 	struct thread_data_t *thd = (struct thread_data_t *)data;	
-	int ret, idx;
+	struct video_lease lease;
+	struct pool_frame *frame;
 
-	ret = init_video_device(MODULE_RGB, thd->rgb_width, thd->rgb_height, thd->num_of_buffer);
-	if (ret) return NULL;
-	start_video_capture(MODULE_RGB);
-	thd->rgb_index = 0;
-	
-	while (!thd->g_video_done) {
-		idx = thd->rgb_index;
-		dequeue_and_capture(MODULE_RGB, &buf, &thd->rgb[idx][0]);
-		
-		thd->rgb_stamps[idx] = buf.timestamp;
-		idx++;
-		idx &= 31;
-		thd->rgb_index = idx;
-	
-		/* Copy data into some where */
-		queue_capture(MODULE_RGB, &buf);
-		DBGVERBOSE("rgb capture\n");
+	if (thd->io_method != IO_METHOD_MMAP) {
+		int old;
+
+		if (dequeue_video_lease(module, &lease))
+			return;
+		/* DMABUF import takes as many buffers as the driver asks for */
+		if (lease.index >= RGBD_MAX_BUFFERS) {
+			thd->gaps.capture++;
+			release_video_lease(&lease);
+			return;
+		}
+		thd->rgb_leases[lease.index] = lease;
+		/* newest frame wins, an unsent older one goes back to capture */
+		old = __atomic_exchange_n(&thd->rgb_latest, lease.index, __ATOMIC_ACQ_REL);
+		if (old >= 0) {
+			/* uvc runs in this thread, the count has one writer */
+			thd->gaps.uvc++;
+			release_video_lease(&thd->rgb_leases[old]);
+		}
+		return;
+	}
+	/* the stream restarted or is gone, nothing was dequeued */
+	if (dequeue_video_lease(module, &lease))
+		return;
+	/* late already, or every frame held downstream: back to the driver unread */
+	frame = NULL;
+	if (!stage_late(thd, RGBD_STAGE_CAPTURE, &lease.timestamp))
+		frame = get_pool_frame(thd->rgb_frames);
+	if (!frame)
+		thd->gaps.capture++;
+	if (frame) {
+		copy_lease(&lease, frame);
+		frame->timestamp = lease.timestamp;
+		frame->sequence = lease.sequence;
+	}
+	release_video_lease(&lease);
+	if (!frame)
+		return;
+
+	/* the pairer keeps its own reference */
+	pairer_add_rgb(thd->pairer, frame);
+	unref_pool_frame(frame);
+	DBGVERBOSE("rgb capture\n");
 #if 0
-		if (thd->rgb_index == 15) {
-			FILE *fp;
-			int j;
-			char str[128];
-
-			for (j=0; j<14; j++) {
-				sprintf(str, "testdrgb_%02d.yuv", j);
-				fp = fopen(str, "wb");
-				if (fp) {
-					fwrite(&thd->rgb[j][0], 1, thd->rgb_size, fp);
-					fclose(fp);
-				}
+	if (thd->rgb_index == 15) {
+		FILE *fp;
+		int j;
+		char str[128];
+
+		for (j=0; j<14; j++) {
+			sprintf(str, "testdrgb_%02d.yuv", j);
+			fp = fopen(str, "wb");
+			if (fp) {
+				fwrite(thd->rgb + j * thd->rgb_size, 1, thd->rgb_size, fp);
+				fclose(fp);
 			}
-			break;
 		}
+	}
 #endif
+}
 
-	}
+/**
+ *  @brief   Make the rgb frame pool once the format is known
+ *  @param[in]  thd      struct thread_data_t
+ *  @return zero for success, none zero for error.
+ *  @note    runs in the capture thread before streaming, the arena is
+ *           faulted in here and not on the first frames.
+*/
+static int init_rgb_frames(struct thread_data_t *thd)
+{
+	int size;
+
+	if (thd->io_method != IO_METHOD_MMAP)
+		return 0;
+	size = get_video_frame_size(thd->rgb_module);
+	if (size <= 0)
+		return ERROR_ALLOC_POOL;
+	/* one per ring slot, the pair history and the one being filled */
+	thd->rgb_frames = create_frame_pool(thd->num_of_buffer + RGBD_PAIR_HISTORY + 1, size,
+					    thd->frame_flags);
+
+	return thd->rgb_frames ? 0 : ERROR_ALLOC_POOL;
+}
+
+/**
+ *  @brief   Capture thread start_routine, for a head without gadget.
+ *           one epoll reactor serves rgb and depth frames.
+ *  @param[in]  data     struct thread_data_t 
+ *  @return NULL
+ *  @see    main, usb_device_func
+*/
+void * rgb_capture_func(void *data)
+{
+	struct thread_data_t *thd = (struct thread_data_t *)data;	
+	int ret, rgb_src, depth_src;
+
+	if (set_thread_cpu(thd->cpu))
+		DBGERROR("can not pin rgb capture to cpu %d\n", thd->cpu);
+	ret = init_video_device(thd->rgb_module, thd->rgb_width, thd->rgb_height, thd->num_of_buffer);
+	if (ret) return NULL;
+	if (init_rgb_frames(thd)) return NULL;
+	start_video_capture(thd->rgb_module);
+
+	rgb_src = reactor_add_video(thd->rgb_module, rgb_capture_frame, thd);
+	depth_src = reactor_add_video(thd->depth_module, depth_capture_frame, thd);
+	if (rgb_src < 0 || depth_src < 0)
+		return NULL;
+
+	/* Now process rgb and depth frames until reactor_stop */
+	reactor_run();
+	print_source_stats("rgb", rgb_src, thd->rgb_module);
+	print_source_stats("depth", depth_src, thd->depth_module);
+	reactor_close();
 
 //	uninit_video_device(MODULE_RGB);
 //	close_video_device(MODULE_RGB);
 //	g_all_done |= 1;
 
+	return NULL;
 }
 /** 
  *  @brief  Fill the uvc buffer with video data
@@ -218,14 +777,70 @@ void fill_buf_func(void *fdt, int data_mode, void *data, int len)
 {
 	struct thread_data_t *thd = (struct thread_data_t *)fdt;
 	struct fifo_mem_t *fmem;
+
+	if (data_mode != UVC_DATA_MODE_COPY) {
+		struct uvc_buffer_desc *desc = (struct uvc_buffer_desc *)data;
+		int idx, ret;
+
+		/* keep what the slot has if no new frame, uvc sends it again */
+		idx = __atomic_exchange_n(&thd->rgb_latest, -1, __ATOMIC_ACQ_REL);
+		if (idx < 0)
+			return;
+		if (data_mode == UVC_DATA_MODE_DMABUF)
+			ret = get_video_dmabuf(thd->rgb_module, idx, &desc->fd, &desc->length);
+		else
+			ret = get_video_buffer(thd->rgb_module, idx, &desc->start, &desc->length);
+		if (ret == 0) {
+			desc->bytesused = len;
+			desc->priv = (void *)(intptr_t)(idx + 1);
+			sent_sequence(thd, thd->rgb_leases[idx].sequence);
+		} else {
+			thd->gaps.uvc++;
+			release_video_lease(&thd->rgb_leases[idx]);
+		}
+		return;
+	}
+	if (thd->rgbd_mailbox) {
+		/* newest pair, its slot goes back to runner empty */
+		fmem = thd->rgbd_mailbox->take();
+		if (fmem && stage_late(thd, RGBD_STAGE_UVC, pair_stamp(fmem))) {
+			thd->gaps.uvc++;
+			unref_pool_frame(fmem->rgb);
+			unref_pool_frame(fmem->depth);
+			fmem->rgb = fmem->depth = NULL;
+			fmem = NULL;
+		}
+		if (fmem) {
+			memcpy(data, fmem->rgb->data, (unsigned int)len < fmem->rgb->length ? len : fmem->rgb->length);
+			sent_sequence(thd, fmem->depth->sequence);
+			unref_pool_frame(fmem->rgb);
+			unref_pool_frame(fmem->depth);
+			fmem->rgb = fmem->depth = NULL;
+		} else {
+			thd->gaps.repeats++;
+		}
+		return;
+	}
 	/* if 3d data available, put a data into data ptr*/
-	DBGINFO("buf_fuc empty=%d len=%d\n", FIFO_EMPTY(thd->rgbd_data_q), len);
-	DBGVERBOSE("fifo head=%d tail=%d\n", thd->rgbd_data_q->head, thd->rgbd_data_q->tail);
+	DBGINFO("buf_fuc empty=%d len=%d\n", thd->rgbd_data_q->empty(), len);
+	DBGVERBOSE("fifo size=%u\n", thd->rgbd_data_q->size());
 #if 1
-	if (!FIFO_EMPTY(thd->rgbd_data_q)) {
-		fmem = DQUE_FIFO_TAIL(thd->rgbd_data_q);
-		memcpy(data, &fmem->rgb[0], len);
-		QUE_FIFO_TAIL(thd->rgbd_data_q);
+	/* pairs past their deadline go uncopied, a newer one may still do */
+	while ((fmem = thd->rgbd_data_q->consumerSlot()) &&
+	       stage_late(thd, RGBD_STAGE_UVC, pair_stamp(fmem))) {
+		thd->gaps.uvc++;
+		unref_pool_frame(fmem->rgb);
+		unref_pool_frame(fmem->depth);
+		thd->rgbd_data_q->release();
+	}
+	if (fmem) {
+		memcpy(data, fmem->rgb->data, (unsigned int)len < fmem->rgb->length ? len : fmem->rgb->length);
+		sent_sequence(thd, fmem->depth->sequence);
+		unref_pool_frame(fmem->rgb);
+		unref_pool_frame(fmem->depth);
+		thd->rgbd_data_q->release();
+	} else {
+		thd->gaps.repeats++;
 	}
 #else
 	if (!flip) {
@@ -241,37 +856,59 @@ void fill_buf_func(void *fdt, int data_mode, void *data, int len)
 
 /** 
  *  @brief  Release the buffer
- *  @param[in] ptr   
- *  @param[out] data  ???????
+ *  @param[in] ptr   owner cookie given in fill_buf_func, rgb buffer index + 1
+ *  @param[in] data  struct thread_data_t
  *  @return none 
  *  @see   init_uvc_gadget_device.
 */
 void release_buf_func(void **ptr, void *data)
 {
-	/* we don't need release function now. */
+	struct thread_data_t *thd = (struct thread_data_t *)data;
+	intptr_t idx = (intptr_t)*ptr - 1;
+
+	/* gadget is done with the buffer, capture may fill it again */
+	if (idx >= 0 && idx < RGBD_MAX_BUFFERS)
+		release_video_lease(&thd->rgb_leases[idx]);
+	*ptr = NULL;
 }
 
 /** 
- *  @brief  UVC thread start_routine
+ *  @brief  UVC thread start_routine, also captures rgb and depth.
+ *          one epoll reactor serves rgb and depth frames and gadget events
+ *          and buffers, so a new pair reaches a waiting gadget slot at once.
  *  @param[in] data   struct thread_data_t 
  *  @return NULL
- *  @see   main
+ *  @see   main, reactor_run
 */
 void * usb_device_func(void *data)
 {
 	struct thread_data_t *thd = (struct thread_data_t *)data;
-	int ret;
+	int ret, rgb_src, depth_src;
 
+	if (set_thread_cpu(thd->cpu))
+		DBGERROR("can not pin uvc thread to cpu %d\n", thd->cpu);
+	/* leased rgb frames go to the gadget as they are, the cpu never reads them */
+	if (thd->io_method != IO_METHOD_MMAP)
+		set_video_cpu_access(thd->rgb_module, VIDEO_CPU_NONE);
+	ret = init_video_device(thd->rgb_module, thd->rgb_width, thd->rgb_height, thd->num_of_buffer);
+	if (ret) return NULL;
+	if (init_rgb_frames(thd)) return NULL;
+	start_video_capture(thd->rgb_module);
 
 	/* setup callback for uvc */
 	ret = init_uvc_gadget_device((void *)thd, fill_buf_func, release_buf_func);
 	if (ret) return NULL;
 
-	/* Now process the uvc event */
-	while (!thd->g_uvc_done) {
-		process_uvc_gadget_device(2000000);
-//		usleep(40000);
-	}
+	rgb_src = reactor_add_video(thd->rgb_module, rgb_capture_frame, thd);
+	depth_src = reactor_add_video(thd->depth_module, depth_capture_frame, thd);
+	if (rgb_src < 0 || depth_src < 0 || reactor_add_uvc_gadget() < 0)
+		return NULL;
+
+	/* Now process rgb and depth frames and the uvc event until reactor_stop */
+	reactor_run();
+	print_source_stats("rgb", rgb_src, thd->rgb_module);
+	print_source_stats("depth", depth_src, thd->depth_module);
+	reactor_close();
 
 //	close_uvc_gadget_device();
 
@@ -297,31 +934,124 @@ int TRGBDClass::Init()
 	thr_data.rgb_width = 640;
 	thr_data.rgb_height = 480;
 	thr_data.rgb_size = thr_data.rgb_width * thr_data.rgb_height * 2;
-	thr_data.rgbd_data_q = (struct fifo_t *)&thr_data.__fifo_data[0];
+	/* the USERPTR buffers and rgb leases are kept in arrays of this size */
+	if (thr_data.num_of_buffer < 1 || thr_data.num_of_buffer > RGBD_MAX_BUFFERS)
+		return ERROR_ALLOC_POOL;
+	if (thr_data.io_method == IO_METHOD_MMAP) {
+		thr_data.pairer = pairer_create(RGBD_PAIR_HISTORY, thr_data.pair_tolerance_us);
+		if (!thr_data.pairer) return ERROR_ALLOC_POOL;
+	}
+	if (thr_data.delivery == RGBD_DELIVERY_LATEST) {
+		thr_data.rgbd_mailbox = new rgbd_mailbox_t();
+	} else {
+		/* any depth works, it needs no power of two */
+		thr_data.rgbd_data_q = new rgbd_ring_t(thr_data.num_of_buffer);
+		if (!thr_data.rgbd_data_q->valid()) return ERROR_ALLOC_POOL;
+	}
 
-	INIT_FIFO(thr_data.rgbd_data_q, thr_data.num_of_buffer);
+	/* extra heads get their own capture contexts */
+	if (rgb_dev) {
+		thr_data.rgb_module = create_video_context(rgb_dev, MODULE_RGB);
+		if (thr_data.rgb_module < 0) return ERROR_OPEN_RGB;
+	}
+	if (depth_dev) {
+		thr_data.depth_module = create_video_context(depth_dev, MODULE_DEPTH);
+		if (thr_data.depth_module < 0) return ERROR_OPEN_DEPTH;
+	}
+	if (thr_data.io_method == IO_METHOD_USERPTR) {
+		/* capture DMAs into our pool, the same buffers go to uvc. depth
+		   is only requeued, its buffers are the capture's own */
+		if (alloc_userptr_buffers(thr_data.rgb_userptr, thr_data.num_of_buffer, thr_data.rgb_size))
+			return ERROR_ALLOC_POOL;
+		set_video_userptr_pool(thr_data.rgb_module, thr_data.rgb_userptr, thr_data.rgb_size, thr_data.num_of_buffer);
+		set_uvc_gadget_zero_copy(1);
+	}
+	if (thr_data.io_method != IO_METHOD_MMAP) {
+		/* multi planar capture is MMAP only */
+		if (set_video_io_method(thr_data.io_method))
+			return ERROR_OPEN_RGB;
+		set_uvc_gadget_io_method(thr_data.io_method);
+	}
 	
+	/* sensor mode matching the uvc frame, so the isp does not scale */
+	if (media_dev) {
+		int media = open_media_device(media_dev);
+
+		if (media < 0) return ERROR_OPEN_RGB;
+		ret = setup_media_pipeline(media, thr_data.rgb_module, thr_data.rgb_width, thr_data.rgb_height);
+		close_media_device(media);
+		if (ret) return ERROR_OPEN_RGB;
+	}
+
 	/* 1. open video devices. if error, return ERROR CODE */
-	ret = open_video_device(MODULE_RGB);
+	ret = open_video_device(thr_data.rgb_module);
 	if (ret) return ERROR_OPEN_RGB;
-	ret = open_video_device(MODULE_DEPTH);
+	ret = open_video_device(thr_data.depth_module);
 	if (ret) return ERROR_OPEN_DEPTH;
 
-	ret = open_uvc_gadget_device("/dev/video2");
-	if (ret) return ERROR_OPEN_UVC;
+	if (uvc_dev) {
+		ret = open_uvc_gadget_device((char *)uvc_dev);
+		if (ret) return ERROR_OPEN_UVC;
+	}
 
-	/* 2. make a thread for get RGB camera */
-	ret = pthread_create(&rgb_capture_thr, NULL, rgb_capture_func, (void *)&thr_data);
-	if (ret != 0) return ERROR_CREATE_RGB_THREAD;
+	ret = init_video_device(thr_data.depth_module, DEPTH_PHASE_WIDTH,
+				DEPTH_PHASE_HEIGHT * tof_layout_phases(thr_data.depth_layout), 4);
+	if (ret) return ERROR_INIT_DEPTH;
+	/* frames are copied out of the driver only in MMAP mode. the rgb
+	   pool is made by the capture thread once its format is set */
+	if (thr_data.io_method == IO_METHOD_MMAP) {
+		unsigned int size = get_video_frame_size(thr_data.depth_module);
 
-	/* 3. make a thread for get uvc */
-	ret = pthread_create(&usb_device_thr, NULL, usb_device_func, (void *)&thr_data);
-	if (ret != 0) return ERROR_CREATE_DEPTH_THREAD;
+		if (thr_data.tof_threads > 0) {
+			struct tof_config cfg;
+			unsigned int height, bpl;
+			int layout;
 
-	ret = init_video_device(MODULE_DEPTH, 224, 173 * 9, 4);
-	if (ret) return ERROR_INIT_DEPTH;
+			/* the mode the driver gave, not the one asked for */
+			get_video_format(thr_data.depth_module, NULL, &height, &bpl);
+			layout = tof_layout_of_height(height, DEPTH_PHASE_HEIGHT);
+			if (layout < 0) {
+				DBGERROR("depth: no phase layout of %u rows\n", height);
+				return ERROR_INIT_DEPTH;
+			}
+			tof_default_config(&cfg, layout);
+			cfg.stride = bpl ? bpl : size / height;
+			cfg.threads = thr_data.tof_threads;
+			if (thr_data.tof_budget_us)
+				cfg.budget_us = thr_data.tof_budget_us;
+			thr_data.tof = tof_create(&cfg);
+			if (!thr_data.tof) return ERROR_INIT_DEPTH;
+			if (thr_data.tof_calib && tof_load_calibration(thr_data.tof, thr_data.tof_calib))
+				return ERROR_INIT_DEPTH;
+			if (thr_data.filter_count > 0) {
+				thr_data.filters = depth_filters_create(DEPTH_PHASE_WIDTH, DEPTH_PHASE_HEIGHT, NULL);
+				if (!thr_data.filters) return ERROR_ALLOC_POOL;
+				if (depth_filters_set_chain(thr_data.filters, thr_data.filter_order,
+							    thr_data.filter_count))
+					return ERROR_INIT_DEPTH;
+			}
+			size = tof_output_size(thr_data.tof);
+		}
+		thr_data.depth_frames = create_frame_pool(thr_data.num_of_buffer + 1, size,
+							  thr_data.frame_flags);
+		if (!thr_data.depth_frames) return ERROR_ALLOC_POOL;
+	}
 	
-	start_video_capture(MODULE_DEPTH);
+	ret = start_video_capture(thr_data.depth_module);
+	if (ret) return ERROR_INIT_DEPTH;
+
+	/* 2. the reactor thread, depth streams already: a stopped fd would
+	   wake it with EPOLLERR until then */
+	if (reactor_init()) return ERROR_CREATE_RGB_THREAD;
+	if (uvc_dev) {
+		/* uvc, it captures RGB camera and depth too */
+		ret = pthread_create(&usb_device_thr, NULL, usb_device_func, (void *)&thr_data);
+		if (ret != 0) return ERROR_CREATE_USB_DEVICE_THREAD;
+	} else {
+		/* RGB camera and depth */
+		ret = pthread_create(&rgb_capture_thr, NULL, rgb_capture_func, (void *)&thr_data);
+		if (ret != 0) return ERROR_CREATE_RGB_THREAD;
+	}
 
 	return ret;
 }
@@ -337,25 +1067,143 @@ int TRGBDClass::Init()
 void TRGBDClass::Uninit()
 {
 	/* stop RGB camera & depth sensor capture */	
-	stop_video_capture(MODULE_RGB);
-	stop_video_capture(MODULE_DEPTH);	
+	/* the reactor must be out of epoll before the capture fd errors */
+	reactor_stop();
+	if (uvc_dev)
+		pthread_join(usb_device_thr, (void**)&thread_ret1);	
+	else
+		pthread_join(rgb_capture_thr, (void**)&thread_ret);
+	stop_video_capture(thr_data.rgb_module);
+	stop_video_capture(thr_data.depth_module);	
 
 	/* destory RGB thread & uvc thread. */	
 	thr_data.g_video_done = 1;
 	thr_data.g_depth_done = 1;
 	thr_data.g_uvc_done = 1;	
-	pthread_join(rgb_capture_thr, (void**)&thread_ret);
-	pthread_join(usb_device_thr, (void**)&thread_ret1);	
+
+	/* where frames were lost, read while the devices are there */
+	{
+		struct rgbd_gap_stats gs;
+
+		GetGapStats(&gs);
+		DBGPRINT("lost: sensor rgb %llu depth %llu, capture %llu, unpaired %llu, pair %llu, "
+			 "depth %llu, callback %llu, uvc %llu, gadget %llu\n", gs.sensor_rgb,
+			 gs.sensor_depth, gs.capture, gs.unpaired, gs.pair, gs.depth, gs.callback,
+			 gs.uvc, gs.gadget);
+		DBGPRINT("uvc: %llu sent, %llu missing in sequence, %llu sent again\n",
+			 gs.sent, gs.output_gaps, gs.repeats);
+	}
 
 	/* unmap and close RGB camera & depth sensor */
-	uninit_video_device(MODULE_RGB);
-	close_video_device(MODULE_RGB);
+	uninit_video_device(thr_data.rgb_module);
+	close_video_device(thr_data.rgb_module);
 	
-	uninit_video_device(MODULE_DEPTH);
-	close_video_device(MODULE_DEPTH);	
+	uninit_video_device(thr_data.depth_module);
+	close_video_device(thr_data.depth_module);	
+	destroy_video_context(thr_data.rgb_module);
+	destroy_video_context(thr_data.depth_module);
 
 	/* close uvc */	
-	close_uvc_gadget_device();
+	if (uvc_dev)
+		close_uvc_gadget_device();
+
+	free_userptr_buffers(thr_data.rgb_userptr, thr_data.num_of_buffer);
+	if (thr_data.rgbd_data_q) {
+		struct spsc_ring_stats st;
+		struct fifo_mem_t *fmem;
+
+		thr_data.rgbd_data_q->getStats(&st);
+		DBGPRINT("rgbd ring: %llu pairs, %llu dropped on full, max %u of %u\n",
+			 st.pushed, st.overflows, st.max_occupancy, thr_data.rgbd_data_q->capacity());
+		/* pairs uvc did not send still hold their frames */
+		while ((fmem = thr_data.rgbd_data_q->consumerSlot())) {
+			unref_pool_frame(fmem->rgb);
+			unref_pool_frame(fmem->depth);
+			thr_data.rgbd_data_q->release();
+		}
+		delete thr_data.rgbd_data_q;
+		thr_data.rgbd_data_q = NULL;
+	}
+	if (thr_data.rgbd_mailbox) {
+		struct mailbox_stats st;
+		struct fifo_mem_t *fmem;
+
+		thr_data.rgbd_mailbox->getStats(&st);
+		DBGPRINT("rgbd mailbox: %llu pairs, %llu sent, %llu dropped as stale\n",
+			 st.published, st.taken, st.superseded);
+		/* only an untaken pair still holds frames */
+		if ((fmem = thr_data.rgbd_mailbox->take())) {
+			unref_pool_frame(fmem->rgb);
+			unref_pool_frame(fmem->depth);
+		}
+		delete thr_data.rgbd_mailbox;
+		thr_data.rgbd_mailbox = NULL;
+	}
+	if (thr_data.io_method == IO_METHOD_MMAP) {
+		static const char *names[RGBD_STAGES] = { "capture", "pair", "depth", "callback", "uvc" };
+
+		for (int i = 0; i < RGBD_STAGES; i++)
+			DBGPRINT("stage %-8s: %llu frames, %llu late, oldest %llu us\n", names[i],
+				 thr_data.stages[i].frames, thr_data.stages[i].late,
+				 thr_data.stages[i].age_us_max);
+	}
+	if (thr_data.tof) {
+		struct tof_stats ts;
+
+		tof_get_stats(thr_data.tof, &ts);
+		if (ts.frames)
+			DBGPRINT("depth engine: %llu frames, avg %llu us, max %llu us, %llu over %u us "
+				 "budget, %d threads\n", ts.frames, ts.us_sum / ts.frames, ts.us_max,
+				 ts.over_budget, ts.budget_us, ts.threads);
+		for (int i = 0; ts.frames && i < ts.threads; i++)
+			DBGPRINT("depth thread %d: busy %llu us per frame, %llu tiles\n", i,
+				 ts.busy_us[i] / ts.frames, ts.tiles[i]);
+		tof_destroy(thr_data.tof);
+		thr_data.tof = NULL;
+	}
+	if (thr_data.filters) {
+		struct depth_filter_stats fs;
+
+		depth_filters_get_stats(thr_data.filters, &fs);
+		if (fs.frames)
+			DBGPRINT("depth filters: %llu frames, avg %llu ns\n", fs.frames,
+				 fs.ns_total / fs.frames);
+		for (int i = 0; i < DEPTH_FILTERS; i++)
+			if (fs.runs[i])
+				DBGPRINT("depth filter %-9s: %llu frames, avg %llu ns, max %llu ns\n",
+					 depth_filter_name(i), fs.runs[i], fs.ns_sum[i] / fs.runs[i],
+					 fs.ns_max[i]);
+		depth_filters_destroy(thr_data.filters);
+		thr_data.filters = NULL;
+	}
+	if (thr_data.pairer) {
+		struct pair_stats ps;
+
+		pairer_get_stats(thr_data.pairer, &ps);
+		DBGPRINT("rgbd pairs: %llu paired, %llu depth and %llu rgb unpaired\n",
+			 ps.paired, ps.unpaired_depth, ps.unpaired_rgb);
+		if (ps.paired)
+			DBGPRINT("rgbd skew: avg %lld us, %lld .. %lld us, tolerance %u us\n",
+				 ps.skew_us_sum / (long long)ps.paired, ps.skew_us_min,
+				 ps.skew_us_max, ps.tolerance_us);
+		pairer_destroy(thr_data.pairer);
+		thr_data.pairer = NULL;
+	}
+	if (thr_data.rgb_frames) {
+		struct frame_pool_stats fs;
+
+		get_frame_pool_stats(thr_data.rgb_frames, &fs);
+		DBGPRINT("rgb frames: max %d of %d in use, %llu dropped on empty pool\n",
+			 fs.max_in_use, fs.count, fs.exhausted);
+		DBGPRINT("rgb frames: %llu KB, %s pages%s, prefault %u us\n", fs.bytes >> 10,
+			 fs.backing == FRAME_POOL_HUGETLB ? "hugetlb" :
+			 fs.backing == FRAME_POOL_THP ? "thp" : "base",
+			 fs.locked ? ", locked" : "", fs.prefault_us);
+	}
+	destroy_frame_pool(thr_data.rgb_frames);
+	destroy_frame_pool(thr_data.depth_frames);
+	thr_data.rgb_frames = NULL;
+	thr_data.depth_frames = NULL;
 	
 	printf("Closed rgbd & uvc device.\n");	
 
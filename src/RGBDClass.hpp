@@ -13,6 +13,10 @@
 #ifndef __RGBD_CLASS_HPP__
 #define __RGBD_CLASS_HPP__
 
+#include <pthread.h>
+#include <capis.h>
+#include "spsc_ring.hpp"
+#include "mailbox.hpp"
 
 
 #define DEF_RGB_WIDTH	1280
@@ -22,51 +26,105 @@
 #define DEPTH_DATA_SIZE	(224 * 173 * 2)
 #define DEPTH9_DATA_SIZE	(DEPTH_DATA_SIZE * 9)
 
+/* capture buffers of a head, see TRGBDClass num_buf */
+#define RGBD_MAX_BUFFERS	32
+
+/* recent rgb frames a depth frame is paired from */
+#define RGBD_PAIR_HISTORY	4
+
+/* a paired rgb and depth frame, each slot holds a reference on both */
 struct fifo_mem_t {
-	struct timeval rgb_stamp;
-	struct timeval depth_stamp;
+	struct pool_frame *rgb;
+	struct pool_frame *depth;
+};
 
-	char rgb[RGB_DATA_SIZE];
-	char depth[DEPTH9_DATA_SIZE];
+/* Where a frame past its deadline is dropped, see SetMaxFrameAge */
+enum rgbd_stage {
+	RGBD_STAGE_CAPTURE = 0,		/* rgb, before the copy out of the driver */
+	RGBD_STAGE_PAIR,		/* depth, before its copy and pairing */
+	RGBD_STAGE_DEPTH,		/* depth, before the depth engine, see SetDepthEngine */
+	RGBD_STAGE_CALLBACK,		/* pair, before the user callback */
+	RGBD_STAGE_UVC,			/* pair, before the copy to the gadget */
+	RGBD_STAGES,
 };
 
-struct fifo_t {
-	uint8_t head;
-	uint8_t tail;
-	uint8_t size;
-	uint8_t mask;
-	
-	struct fifo_mem_t fifo_mem[0];
-} __attribute__ ((packed));
-
-#define INIT_FIFO(t,s)	(t->head = t->tail = 0, t->size = s, t->mask = s-1)
-#define FIFO_EMPTY(t)	(t->head == t->tail)
-#define DQUE_FIFO_HEAD(t)	(&t->fifo_mem[t->head])
-#define QUE_FIFO_HEAD(t)	(t->head++, t->head &= t->mask)
-#define DQUE_FIFO_TAIL(t)	(&t->fifo_mem[t->tail])
-#define QUE_FIFO_TAIL(t)	(t->tail++, t->tail &= t->mask)
-#define FIFO_FULL(t)	(((t->head+1) & t->mask) == t->tail)
-#define DATA_IN_FIFO(t)	((t->head >= t->tail) ? (t->head - t->tail) : (t->head + t->size - t->tail))
+struct rgbd_stage_stats {
+	unsigned long long frames;	/* reached the stage */
+	unsigned long long late;	/* dropped there */
+	unsigned long long age_us_max;	/* oldest seen, dropped or not */
+};
+
+/* Frames lost between the sensors and the gadget, by the stage that lost
+   them, see GetGapStats. uvc output follows the depth sequence (the rgb one
+   in USERPTR/DMABUF), its gaps add up to the counts on that side give or
+   take the frames in flight. */
+struct rgbd_gap_stats {
+	unsigned long long sensor_rgb;	/* sequence numbers the rgb driver skipped */
+	unsigned long long sensor_depth;
+	unsigned long long capture;	/* rgb: late, no free frame or lease slot, not sent */
+	unsigned long long unpaired;	/* depth: no rgb frame within the tolerance */
+	unsigned long long pair;	/* depth: late, no free frame or ring full */
+	unsigned long long depth;	/* late for the depth engine or failed in it */
+	unsigned long long callback;	/* late for the callback */
+	unsigned long long uvc;		/* late at uvc, or replaced before uvc took it */
+	unsigned long long gadget;	/* filled, VIDIOC_QBUF failed */
+	unsigned long long sent;	/* frames given to the gadget */
+	unsigned long long output_gaps;	/* sequence numbers missing between sent frames */
+	unsigned long long repeats;	/* nothing new, uvc sent its last frame again */
+};
+
+/* paired frames, depth loop (runner) to the uvc thread (fill_buf_func) */
+typedef TSpscRing<struct fifo_mem_t> rgbd_ring_t;
+typedef TMailbox<struct fifo_mem_t> rgbd_mailbox_t;
+
+/* How paired frames reach uvc, see SetDelivery */
+enum rgbd_delivery {
+	RGBD_DELIVERY_FIFO = 0,		/* every pair in order, up to the ring depth late */
+	RGBD_DELIVERY_LATEST = 1,	/* newest pair only, older ones are dropped */
+};
 
 struct thread_data_t {
 	int rgb_width;
 	int rgb_height;
-	int rgb_index;
 	int rgb_size;
 	int num_of_buffer;	
 	int g_video_done;
 	int g_depth_done;
 	int g_uvc_done;		
-
-	struct timeval rgb_stamps[32];
-	char rgb[32][RGB_DATA_SIZE];
-
-	char depth[DEPTH9_DATA_SIZE];
-
-	struct fifo_t *rgbd_data_q;
-	char __fifo_data[sizeof(struct fifo_mem_t) * 4 + sizeof(struct fifo_t)];
+	int io_method;		/* IO_METHOD_MMAP copies, USERPTR/DMABUF lend rgb buffers to uvc */
+	int rgb_module;		/* capture contexts of this head */
+	int depth_module;
+	int cpu;		/* core of the capture (reactor) thread, -1 for any */
+	void *owner;		/* the TRGBDClass, the depth handler calls its runner */
+	int rgb_latest;		/* USERPTR/DMABUF: newest unsent rgb buffer index, -1 for none */
+	struct video_lease rgb_leases[RGBD_MAX_BUFFERS];	/* USERPTR/DMABUF: rgb buffers out of the driver */
+	void *rgb_userptr[RGBD_MAX_BUFFERS];	/* IO_METHOD_USERPTR capture buffers */
+
+	/* IO_METHOD_MMAP: frames copied out of the driver, shared by all stages */
+	struct frame_pool *rgb_frames;
+	struct frame_pool *depth_frames;
+	int frame_flags;	/* FRAME_POOL_xxx of both pools */
+	struct frame_pairer *pairer;	/* recent rgb frames by timestamp */
+	unsigned int pair_tolerance_us;	/* zero for PAIR_DEFAULT_TOLERANCE_US */
+	struct tof_engine *tof;		/* depth maps instead of the raw frame, NULL for raw */
+	int tof_threads;		/* of the engine made in Init, zero for none */
+	unsigned int tof_budget_us;	/* zero for the engine's default */
+	const char *tof_calib;		/* calibration blob, NULL for none */
+	int depth_layout;		/* TOF_LAYOUT_xxx asked of the depth node */
+	struct depth_filters *filters;	/* run on the engine's depth map, made with it */
+	int filter_order[DEPTH_FILTER_MAX_CHAIN];	/* chain Init makes, see SetDepthFilters */
+	int filter_count;		/* zero for no chain */
+
+	int delivery;		/* RGBD_DELIVERY_xxx */
+	rgbd_ring_t *rgbd_data_q;	/* RGBD_DELIVERY_FIFO */
+	rgbd_mailbox_t *rgbd_mailbox;	/* RGBD_DELIVERY_LATEST */
+	struct rgbd_gap_stats gaps;	/* each field written by one thread */
+	long long sent_sequence;	/* last one given to uvc, -1 for none */
+	unsigned int max_age_us;	/* deadline from capture, zero for none */
+	struct rgbd_stage_stats stages[RGBD_STAGES];
 };
 
+/* callback of a pair, its argument is the struct fifo_mem_t */
 typedef void (*cb_func_type)(void *);
 
 class TRGBDClass {
@@ -80,6 +138,10 @@ protected:
 	virtual void postRun(void *data);
 	virtual void do_delay();
 	*/
+	const char *rgb_dev;
+	const char *depth_dev;
+	const char *uvc_dev;
+	const char *media_dev;
 public:	
 	struct thread_data_t thr_data;
 
@@ -89,13 +151,29 @@ public:
 	int thread_ret;
 	int thread_ret1;
 	
-	TRGBDClass(int num_buf = 4);
+	TRGBDClass(int num_buf = 4, int io = IO_METHOD_MMAP,
+		   const char *rgb_dev = NULL, const char *depth_dev = NULL,
+		   const char *uvc_dev = "/dev/video2", int cpu = -1);
 	virtual ~TRGBDClass();
 
 	virtual void runner(void *data);		
 	virtual int  Init();	
 	virtual void Uninit();	
 	virtual int  RegisterCallback(void *func);	
+	virtual void SetMediaDevice(const char *dev);
+	virtual void SetFrameMemory(int flags);
+	virtual void SetDelivery(int mode);
+	virtual void SetPairTolerance(unsigned int us);
+	virtual int  GetPairStats(struct pair_stats *stats);
+	virtual void SetMaxFrameAge(unsigned int us);
+	virtual void GetStageStats(struct rgbd_stage_stats *stats);
+	virtual void GetGapStats(struct rgbd_gap_stats *stats);
+	virtual void SetDepthEngine(int threads, unsigned int budget_us = 0);
+	virtual int  GetDepthStats(struct tof_stats *stats);
+	virtual void SetDepthCalibration(const char *path);
+	virtual void SetDepthLayout(int layout);
+	virtual int  SetDepthFilters(const int *order, int count);
+	virtual int  GetDepthFilterStats(struct depth_filter_stats *stats);
 };
 
 
@@ -20,6 +20,7 @@
 
 #include <apis.hpp>
 #include <capis.h>
+#include "spsc_ring.hpp"
 
 #define DEF_RGB_WIDTH	1280
 #define DEF_RGB_HEIGHT	960
@@ -36,23 +37,8 @@ struct fifo_mem_t {
 	char depth[DEPTH9_DATA_SIZE];
 };
 
-struct fifo_t {
-	uint8_t head;
-	uint8_t tail;
-	uint8_t size;
-	uint8_t mask;
-	
-	struct fifo_mem_t fifo_mem[0];
-} __attribute__ ((packed));
-
-#define INIT_FIFO(t,s)	(t->head = t->tail = 0, t->size = s, t->mask = s-1)
-#define FIFO_EMPTY(t)	(t->head == t->tail)
-#define DQUE_FIFO_HEAD(t)	(&t->fifo_mem[t->head])
-#define QUE_FIFO_HEAD(t)	(t->head++, t->head &= t->mask)
-#define DQUE_FIFO_TAIL(t)	(&t->fifo_mem[t->tail])
-#define QUE_FIFO_TAIL(t)	(t->tail++, t->tail &= t->mask)
-#define FIFO_FULL(t)	(((t->head+1) & t->mask) == t->tail)
-#define DATA_IN_FIFO(t)	((t->head >= t->tail) ? (t->head - t->tail) : (t->head + t->size - t->tail))
+/* paired frames, capture side to the uvc side */
+typedef TSpscRing<struct fifo_mem_t> rgbd_ring_t;
 
 struct thread_data_t {
 	int rgb_width;
@@ -65,8 +51,7 @@ struct thread_data_t {
 
 	char depth[DEPTH9_DATA_SIZE];
 
-	struct fifo_t *rgbd_data_q;
-	char __fifo_data[sizeof(struct fifo_mem_t) * 4 + sizeof(struct fifo_t)];
+	rgbd_ring_t *rgbd_data_q;
 };
 
 struct thread_data_t thr_data;
@@ -270,7 +255,7 @@ void TRGBDSensor::Uninit()
  			\b actually this function blocked and wait for data, should always be true.
  *  @see   v4l2 dqbuf and internal rgb capture_func
 */
-bool TRGBDSensor::waitFor(void **data)
+bool TRGBDSensor::waitFor(Object &event)
 {
 
 
@@ -293,7 +278,7 @@ bool TRGBDSensor::waitFor(void **data)
 
  *  @see   Application::Run(), runner
 */
-void TRGBDSensor::preRun(void *data)
+void TRGBDSensor::preRun(Object &event)
 {
 	/* Do nothing for this implementation */
 }
@@ -305,12 +290,12 @@ void TRGBDSensor::preRun(void *data)
 
  *  @see   Application::Run()
 */
-void TRGBDSensor::runner(void *data)
+void TRGBDSensor::runner(Object &event)
 {
 	process_uvc_gadget_device(2000000);
 
-	if (CB_Func) {
-		CB_Func(data);
+	if (CB_Func && !!event) {
+		CB_Func((void *)&*event);
 		/* push data on internal queue for uvc interface. */
 	}
 }
@@ -322,7 +307,7 @@ void TRGBDSensor::runner(void *data)
 
  *  @see   Application::Run(), runner
 */
-void TRGBDSensor::postRun(void *data)
+void TRGBDSensor::postRun(Object &event)
 {
 	// Done do anything now.
 }
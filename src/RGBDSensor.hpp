@@ -47,10 +47,10 @@ private:
 protected:
 	virtual int  Init();
 	virtual void Uninit();
-	virtual bool waitFor(void **data);
-	virtual void preRun(void *data);
-	virtual void runner(void *data);
-	virtual void postRun(void *data);
+	virtual bool waitFor(Object &event);
+	virtual void preRun(Object &event);
+	virtual void runner(Object &event);
+	virtual void postRun(Object &event);
 	virtual void do_delay();
 public:
 	TRGBDSensor(int num_rgb_buf = 8, int num_depth_buf= 4);
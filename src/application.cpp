@@ -1,63 +1,538 @@
 /**
 
 */
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
 #include "application.hpp"
 #include "listener.hpp"
 #include "private_vector.hpp"
+#include "spsc_ring.hpp"
+
+static unsigned long long now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*
+ * A listener and its bounded queue of events. One worker at a time runs a
+ * listener, so it sees its events in order, and a slow one only fills its
+ * own queue.
+ */
+class TListenerSlot : public TObject {
+public:
+	Listener listener;
+	int policy;
+	int depth;
+	int head;			/* oldest queued event */
+	int count;
+	bool busy;			/* a worker is in eventFired */
+	bool removed;
+	unsigned long long seq;		/* last event queued or dropped */
+	Object *events;
+	unsigned long long *queued_us;
+	struct listener_stats stats;
+
+	TListenerSlot(Listener l, int p, int d) : TObject(), listener(l), policy(p), depth(d),
+		head(0), count(0), busy(false), removed(false), seq(0), stats()
+	{
+		events = new Object[d];
+		queued_us = new unsigned long long[d];
+	}
+	~TListenerSlot() { delete [] events; delete [] queued_us; }
+
+	void push(const Object &event)
+	{
+		int i = (head + count) % depth;
+
+		events[i] = event;
+		queued_us[i] = now_us();
+		if (++count > (int)stats.max_queued)
+			stats.max_queued = count;
+	}
+	Object pop(unsigned long long *us)
+	{
+		Object event = std::move(events[head]);
+
+		*us = queued_us[head];
+		head = (head + 1) % depth;
+		count--;
+		return event;
+	}
+};
+
+DECLARE_CTK_CLASS(ListenerSlot, Object)
 
 /* This basic application does not handle any error messages. */
 TApplication::TApplication() : TObject()
 {
 	Terminated = false;
-	Done = false;
+	Running = false;
 	Error_code = 0;
 	appListener = new TVector();
+	pthread_mutex_init(&runLock, NULL);
+	pthread_cond_init(&runDone, NULL);
+	pthread_mutex_init(&stageLock, NULL);
+	for (int i = 0; i < APP_STAGES; i++) {
+		stageArgs[i].app = this;
+		stageArgs[i].stage = i;
+	}
+	for (int i = 0; i < APP_STAGES - 1; i++)
+		stageQueue[i] = NULL;
+	stageDepth = APP_STAGE_DEPTH;
+	runningStages = 0;
+	memset(stageStats, 0, sizeof(stageStats));
+	runStart_us = runEnd_us = 0;
+	pthread_mutex_init(&listenerLock, NULL);
+	pthread_cond_init(&listenerWork, NULL);
+	pthread_cond_init(&listenerSpace, NULL);
+	listenerThreads = NULL;
+	numListenerWorkers = APP_LISTENER_WORKERS;
+	runningListenerWorkers = 0;
+	nextListener = 0;
+	listenerStopping = false;
+	eventSeq = 0;
 }
 
 /* Application may or maynot use thread for Run function */
 TApplication::~TApplication()
 {
-	if (!Terminated) {
-		Terminate();
-		while (!Done) ; /* wait for termination */
-	}
+	Terminate();
+	/* a Run on another thread ends with the waitFor it is in */
+	pthread_mutex_lock(&runLock);
+	while (Running)
+		pthread_cond_wait(&runDone, &runLock);
+	pthread_mutex_unlock(&runLock);
+	pthread_mutex_destroy(&stageLock);
+	pthread_cond_destroy(&runDone);
+	pthread_mutex_destroy(&runLock);
+	pthread_cond_destroy(&listenerSpace);
+	pthread_cond_destroy(&listenerWork);
+	pthread_mutex_destroy(&listenerLock);
 }
 
-void TApplication::addListener(Listener listener)
+/**
+ *  @brief  add a listener with its own queue
+ *  @param[in] listener  fired on a worker thread for every event
+ *  @param[in] policy    LISTENER_DROP_OLDEST, LISTENER_DROP_NEWEST or
+ *                       LISTENER_BLOCK, what a full queue does
+ *  @param[in] depth     events it may have queued
+ *  @return none
+*/
+void TApplication::addListener(Listener listener, int policy, int depth)
 {
-	appListener->addElement(listener);
+	ListenerSlot slot = new TListenerSlot(listener, policy, depth > 0 ? depth : 1);
+
+	pthread_mutex_lock(&listenerLock);
+	appListener->addElement(slot);
+	pthread_mutex_unlock(&listenerLock);
 }
 
+/**
+ *  @brief  remove a listener, the events it has queued are dropped
+ *  @return none
+ *  @note   a call of its eventFired may still be running.
+*/
 void TApplication::removeListener(Listener listener)
 {
+	ListenerSlot gone;	/* dropped after the unlock, with its events */
+	TListenerSlot *slot;
+
 	if (!appListener)	return;
-	appListener->removeElement(listener);
+	pthread_mutex_lock(&listenerLock);
+	for (int i = 0; i < appListener->size(); i++) {
+		slot = CASTTO(ListenerSlot, appListener->elementAt(i));
+		if (slot->listener == listener) {
+			gone = slot;
+			slot->removed = true;
+			appListener->removeElementAt(i);
+			break;
+		}
+	}
+	/* an application blocked on its queue goes on */
+	pthread_cond_broadcast(&listenerSpace);
+	pthread_mutex_unlock(&listenerLock);
+}
+
+/**
+ *  @brief  read the counters of a listener
+ *  @return \b zero for success
+ *          \b under zero when it is not a listener of this application
+*/
+int TApplication::getListenerStats(Listener listener, struct listener_stats *stats)
+{
+	TListenerSlot *slot;
+	int ret = -1;
+
+	pthread_mutex_lock(&listenerLock);
+	for (int i = 0; i < appListener->size(); i++) {
+		slot = CASTTO(ListenerSlot, appListener->elementAt(i));
+		if (slot->listener == listener) {
+			*stats = slot->stats;
+			stats->queued = slot->count;
+			ret = 0;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&listenerLock);
+
+	return ret;
+}
+
+/**
+ *  @brief  number of threads running listeners, from the next Run
+ *  @return none
+*/
+void TApplication::setListenerWorkers(int count)
+{
+	numListenerWorkers = count > 0 ? count : 1;
+}
+
+void *TApplication::listenerWorker(void *arg)
+{
+	TApplication *app = (TApplication *)arg;
+	TListenerSlot *slot;
+	ListenerSlot hold;
+	Object event;
+	unsigned long long queued, latency;
+	int i, n;
+
+	pthread_mutex_lock(&app->listenerLock);
+	for (;;) {
+		/* round robin over the listeners with work and no worker */
+		slot = NULL;
+		n = app->appListener->size();
+		for (i = 0; i < n; i++) {
+			TListenerSlot *s = CASTTO(ListenerSlot,
+				app->appListener->elementAt((app->nextListener + i) % n));
+			if (s->count && !s->busy) {
+				slot = s;
+				app->nextListener = (app->nextListener + i + 1) % n;
+				break;
+			}
+		}
+		if (!slot) {
+			if (app->listenerStopping)
+				break;
+			pthread_cond_wait(&app->listenerWork, &app->listenerLock);
+			continue;
+		}
+		hold = slot;	/* it may be removed while it runs */
+		slot->busy = true;
+		event = slot->pop(&queued);
+		if (slot->policy == LISTENER_BLOCK)
+			pthread_cond_broadcast(&app->listenerSpace);
+		pthread_mutex_unlock(&app->listenerLock);
+
+		slot->listener->eventFired(std::move(event));
+		latency = now_us() - queued;
+
+		pthread_mutex_lock(&app->listenerLock);
+		slot->busy = false;
+		slot->stats.fired++;
+		slot->stats.latency_us_sum += latency;
+		if (latency > slot->stats.latency_us_max)
+			slot->stats.latency_us_max = latency;
+		if (slot->count)
+			pthread_cond_signal(&app->listenerWork);
+		if (slot->removed) {
+			/* the last reference, free it unlocked */
+			pthread_mutex_unlock(&app->listenerLock);
+			hold = 0;
+			pthread_mutex_lock(&app->listenerLock);
+		}
+	}
+	pthread_mutex_unlock(&app->listenerLock);
+
+	return NULL;
+}
+
+void TApplication::startListenerWorkers()
+{
+	listenerStopping = false;
+	runningListenerWorkers = 0;
+	listenerThreads = new pthread_t[numListenerWorkers];
+	for (int i = 0; i < numListenerWorkers; i++) {
+		if (pthread_create(&listenerThreads[i], NULL, listenerWorker, this) != 0)
+			break;
+		runningListenerWorkers++;
+	}
+}
+
+/* the workers run the queued events out before they end */
+void TApplication::stopListenerWorkers()
+{
+	pthread_mutex_lock(&listenerLock);
+	listenerStopping = true;
+	pthread_cond_broadcast(&listenerWork);
+	pthread_mutex_unlock(&listenerLock);
+	for (int i = 0; i < runningListenerWorkers; i++)
+		pthread_join(listenerThreads[i], NULL);
+	delete [] listenerThreads;
+	listenerThreads = NULL;
+	runningListenerWorkers = 0;
+}
+
+/**
+ *  @brief  queue an event to every listener, by its policy when full
+ *  @return none
+ *  @note   only a LISTENER_BLOCK listener can make this wait.
+*/
+void TApplication::fireListeners(const Object &event)
+{
+	Object dropped;
+	TListenerSlot *slot;
+	unsigned long long seq, queued;
+
+	if (!runningListenerWorkers) {
+		/* no worker could start, fire them here as before */
+		for (int i = appListener->size() - 1; i >= 0; i--) {
+			Listener listener = CASTTO(ListenerSlot, appListener->elementAt(i))->listener;
+			listener->eventFired(event);
+		}
+		return;
+	}
+	pthread_mutex_lock(&listenerLock);
+	seq = ++eventSeq;
+	for (int i = 0; i < appListener->size(); i++) {
+		slot = CASTTO(ListenerSlot, appListener->elementAt(i));
+		if (slot->seq == seq)
+			continue;
+		if (slot->count == slot->depth) {
+			if (slot->policy == LISTENER_BLOCK && !Terminated) {
+				pthread_cond_wait(&listenerSpace, &listenerLock);
+				/* the listeners may have changed, skip the ones done */
+				i = -1;
+				continue;
+			}
+			slot->stats.dropped++;
+			if (slot->policy == LISTENER_DROP_NEWEST || slot->policy == LISTENER_BLOCK) {
+				slot->seq = seq;
+				continue;
+			}
+			/* freed after the unlock, or with the next one dropped */
+			dropped = slot->pop(&queued);
+		}
+		slot->push(event);
+		slot->seq = seq;
+	}
+	pthread_cond_broadcast(&listenerWork);
+	pthread_mutex_unlock(&listenerLock);
 }
 
 void TApplication::Terminate()
 {
 	Terminated = true;
+	/* a Run blocked on a full listener queue gives up on it */
+	pthread_mutex_lock(&listenerLock);
+	pthread_cond_broadcast(&listenerSpace);
+	pthread_mutex_unlock(&listenerLock);
+}
+
+/**
+ *  @brief  events queued between two stages, from the next Run
+ *  @param[in] depth   zero runs every hook on Run's thread in turn
+ *  @return none
+*/
+void TApplication::setStageDepth(int depth)
+{
+	stageDepth = depth > 0 ? depth : 0;
+}
+
+void TApplication::addStageTime(int stage, unsigned long long idle, unsigned long long busy,
+				unsigned long long stall)
+{
+	struct app_stage_stats *st = &stageStats[stage];
+
+	pthread_mutex_lock(&stageLock);
+	st->frames++;
+	st->idle_us += idle;
+	st->busy_us += busy;
+	if (busy > st->busy_us_max)
+		st->busy_us_max = busy;
+	st->stall_us += stall;
+	pthread_mutex_unlock(&stageLock);
+}
+
+/* the hook of a stage after waitFor, timed */
+void TApplication::runHook(int stage, Object &event)
+{
+	switch (stage) {
+	case APP_STAGE_PRE:
+		preRun(event);
+		break;
+	case APP_STAGE_RUN:
+		runner(event);
+		fireListeners(event);
+		break;
+	case APP_STAGE_POST:
+		postRun(event);
+		break;
+	}
+}
+
+void *TApplication::stageWorker(void *arg)
+{
+	struct stage_arg *sa = (struct stage_arg *)arg;
+
+	sa->app->runStage(sa->stage);
+	return NULL;
+}
+
+/* a stage thread, ends when the stage before closed its queue and it is empty */
+void TApplication::runStage(int stage)
+{
+	TSpscRing<Object> *in = stageQueue[stage - 1];
+	TSpscRing<Object> *out = stage < APP_STAGES - 1 ? stageQueue[stage] : NULL;
+	unsigned long long t, idle, busy, stall = 0;
+	Object event;
+
+	for (;;) {
+		t = now_us();
+		if (!in->pop(event))
+			break;
+		idle = now_us() - t;
+		t = now_us();
+		runHook(stage, event);
+		busy = now_us() - t;
+		if (out) {
+			t = now_us();
+			out->pushWait(std::move(event));
+			stall = now_us() - t;
+		}
+		event = 0;
+		addStageTime(stage, idle, busy, stall);
+	}
+	if (out)
+		out->close();
+}
+
+bool TApplication::startStages()
+{
+	runningStages = 0;
+	if (!stageDepth)
+		return false;
+	for (int i = 0; i < APP_STAGES - 1; i++) {
+		stageQueue[i] = new TSpscRing<Object>(stageDepth);
+		if (!stageQueue[i]->valid()) {
+			stopStages();
+			return false;
+		}
+	}
+	for (int i = APP_STAGE_WAIT + 1; i < APP_STAGES; i++) {
+		if (pthread_create(&stageThreads[i], NULL, stageWorker, &stageArgs[i]) != 0) {
+			stopStages();
+			return false;
+		}
+		runningStages = i;
+	}
+	return true;
+}
+
+/* closing the first queue drains the pipeline stage by stage */
+void TApplication::stopStages()
+{
+	if (stageQueue[0])
+		stageQueue[0]->close();
+	for (int i = APP_STAGE_WAIT + 1; i <= runningStages; i++)
+		pthread_join(stageThreads[i], NULL);
+	runningStages = 0;
+	for (int i = 0; i < APP_STAGES - 1; i++) {
+		delete stageQueue[i];
+		stageQueue[i] = NULL;
+	}
+}
+
+/**
+ *  @brief  read the counters of a stage
+ *  @param[in]  stage   APP_STAGE_WAIT .. APP_STAGE_POST
+ *  @param[out] stats   counters
+ *  @return \b zero for success
+ *          \b under zero for no such stage
+*/
+int TApplication::getStageStats(int stage, struct app_stage_stats *stats)
+{
+	if (stage < 0 || stage >= APP_STAGES)
+		return -1;
+	pthread_mutex_lock(&stageLock);
+	*stats = stageStats[stage];
+	pthread_mutex_unlock(&stageLock);
+
+	return 0;
+}
+
+/**
+ *  @brief  print the throughput of every stage over the last or current Run
+ *  @return none
+ *  @note   the busiest stage bounds the frame rate, a stage stalled on
+ *          the next one says that one is too slow.
+*/
+void TApplication::printStageStats()
+{
+	static const char *name[APP_STAGES] = { "waitFor", "preRun", "runner", "postRun" };
+	struct app_stage_stats st;
+	unsigned long long run = (runEnd_us ? runEnd_us : now_us()) - runStart_us;
+
+	if (!runStart_us || !run)
+		return;
+	printf("stage      frames      fps   avg us   max us   busy%%  idle%%  stall%%\n");
+	for (int i = 0; i < APP_STAGES; i++) {
+		getStageStats(i, &st);
+		printf("%-8s %8llu %8.1f %8llu %8llu %7.1f %6.1f %7.1f\n", name[i], st.frames,
+		       st.frames * 1e6 / run, st.frames ? st.busy_us / st.frames : 0,
+		       st.busy_us_max, st.busy_us * 100.0 / run, st.idle_us * 100.0 / run,
+		       st.stall_us * 100.0 / run);
+	}
 }
 
 void TApplication::Run()
 {
-	void *data;
+	unsigned long long t, busy, stall;
+	bool staged;
+	Object event;
 
+	pthread_mutex_lock(&runLock);
+	Running = true;
+	pthread_mutex_unlock(&runLock);
 	Error_code = Init();
-	if (Error_code != 0)
-		return;
-	while (!Terminated) {
-		if (waitFor(&data)) {
-			preRun(data);
-			runner(data);
-			for(int i = appListener->size()-1; i >= 0; i--) {
-				Listener listener = CASTTO(Listener, appListener->elementAt(i));
-				listener->eventFired(data);
-			};
-			postRun(data);
-		}
-		do_delay();
-	}
-	Uninit();
-	Done = true;
+	if (Error_code == 0) {
+		memset(stageStats, 0, sizeof(stageStats));
+		runStart_us = now_us();
+		runEnd_us = 0;
+		startListenerWorkers();
+		staged = startStages();
+		while (!Terminated) {
+			t = now_us();
+			if (waitFor(event)) {
+				busy = now_us() - t;
+				stall = 0;
+				if (staged) {
+					t = now_us();
+					stageQueue[0]->pushWait(std::move(event));
+					stall = now_us() - t;
+				} else {
+					for (int i = APP_STAGE_WAIT + 1; i < APP_STAGES; i++) {
+						t = now_us();
+						runHook(i, event);
+						addStageTime(i, 0, now_us() - t, 0);
+					}
+				}
+				event = 0;
+				addStageTime(APP_STAGE_WAIT, 0, busy, stall);
+			}
+			do_delay();
+		}
+		/* every event waitFor gave goes through the pipeline first */
+		stopStages();
+		stopListenerWorkers();
+		runEnd_us = now_us();
+		Uninit();
+	}
+	pthread_mutex_lock(&runLock);
+	Running = false;
+	pthread_cond_broadcast(&runDone);
+	pthread_mutex_unlock(&runLock);
 }
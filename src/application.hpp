@@ -4,30 +4,110 @@
 #ifndef __CAPTURE_VIDEO__
 #define __CAPTURE_VIDEO__
 
+#include <pthread.h>
+#include <atomic>
 #include <object.hpp>
 #include <private_vector.h>
 #include <listener.hpp>
 
+#define APP_LISTENER_WORKERS	2
+#define APP_LISTENER_DEPTH	4
+/* events queued between two stages, zero runs the hooks in turn on Run's thread */
+#define APP_STAGE_DEPTH		2
+
+template <class T> class TSpscRing;
+
+/*
+ * The hooks are the stages of a pipeline, each on a thread of its own:
+ * waitFor gets event N+2 while preRun and runner work on N+1 and postRun
+ * sends N. A hook sees the events in order and only one at a time, but
+ * the hooks of one application run at once, so they should share nothing
+ * but the event.
+ */
+enum app_stage {
+	APP_STAGE_WAIT,			/* waitFor and do_delay, on Run's thread */
+	APP_STAGE_PRE,
+	APP_STAGE_RUN,			/* runner, then the listeners are queued */
+	APP_STAGE_POST,
+	APP_STAGES,
+};
+
+/* Counters of one stage */
+struct app_stage_stats {
+	unsigned long long frames;
+	unsigned long long busy_us;	/* in the hook */
+	unsigned long long busy_us_max;
+	unsigned long long idle_us;	/* waiting for the stage before */
+	unsigned long long stall_us;	/* waiting for room in the stage after */
+};
+
 class TApplication : public TObject {
 private:
-	bool   Terminated;
-	bool   Done;
+	std::atomic<bool> Terminated;
+	bool   Running;
+	pthread_mutex_t runLock;
+	pthread_cond_t  runDone;
+
+	/* pipeline, stageQueue[i] feeds stage i + 1 */
+	struct stage_arg {
+		TApplication *app;
+		int stage;
+	} stageArgs[APP_STAGES];
+	TSpscRing<Object> *stageQueue[APP_STAGES - 1];
+	pthread_t       stageThreads[APP_STAGES];
+	int             stageDepth;
+	int             runningStages;
+	pthread_mutex_t stageLock;
+	struct app_stage_stats stageStats[APP_STAGES];
+	unsigned long long runStart_us;
+	unsigned long long runEnd_us;
+
+	static void *stageWorker(void *arg);
+	void runStage(int stage);
+	void runHook(int stage, Object &event);
+	void addStageTime(int stage, unsigned long long idle, unsigned long long busy,
+			  unsigned long long stall);
+	bool startStages();
+	void stopStages();
+
+	/* listener fan-out, appListener holds one queue per listener */
+	pthread_mutex_t listenerLock;
+	pthread_cond_t  listenerWork;
+	pthread_cond_t  listenerSpace;
+	pthread_t      *listenerThreads;
+	int             numListenerWorkers;
+	int             runningListenerWorkers;
+	int             nextListener;
+	bool            listenerStopping;
+	unsigned long long eventSeq;
+
+	static void *listenerWorker(void *arg);
+	void fireListeners(const Object &event);
+	void startListenerWorkers();
+	void stopListenerWorkers();
 protected:
 	int    Error_code;
 	Vector appListener;
 
-	virtual bool waitFor(void **data) = 0;
-	virtual void preRun(void *data) = 0;
-	virtual void runner(void *data) = 0;
-	virtual void postRun(void *data) = 0;
+	/* the event of a frame is a handle, listeners may hold it past postRun */
+	virtual bool waitFor(Object &event) = 0;
+	virtual void preRun(Object &event) = 0;
+	virtual void runner(Object &event) = 0;
+	virtual void postRun(Object &event) = 0;
 	virtual int  Init() = 0;
 	virtual void Uninit() = 0;
 	virtual void do_delay() = 0;
 public:
 	TApplication();
 	~TApplication();
-	virtual void addListener(Listener listener);
+	virtual void addListener(Listener listener, int policy = LISTENER_DROP_OLDEST,
+				 int depth = APP_LISTENER_DEPTH);
 	virtual void removeListener(Listener listener);
+	virtual int  getListenerStats(Listener listener, struct listener_stats *stats);
+	virtual void setListenerWorkers(int count);
+	virtual void setStageDepth(int depth);
+	virtual int  getStageStats(int stage, struct app_stage_stats *stats);
+	virtual void printStageStats();
 	virtual void Terminate();
 	virtual void Run();
 };
@@ -0,0 +1,212 @@
+/**
+ * Copyright(c) 2020 I4VINE Inc.,
+ *
+ *  @file  bench_arena.cpp
+ *  @brief frame memory: lazy malloc against the prefaulted frame arena.
+ *
+ * bench_arena [frame bytes [frames]]
+ *
+ * For each kind of frame memory it reports the resident size, the time
+ * of the first copy into every frame (page faults land here when the
+ * memory was not prefaulted), a steady copy pass, and random cache line
+ * reads over all frames with the data TLB misses they took. TLB misses
+ * need perf events (kernel.perf_event_paranoid <= 2); huge pages need
+ * vm.nr_hugepages or thp enabled ("madvise" or "always").
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include <linux/videodev2.h>
+
+#include <capis.h>
+
+#define RANDOM_READS	(1 << 22)
+
+/* the old fixed layout: 32 frames of 1280x960x2 */
+#define FIXED_RGB_BYTES	(32ULL * 1280 * 960 * 2)
+
+static unsigned long long now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static unsigned long long rss_kb(void)
+{
+	unsigned long long size = 0, resident = 0;
+	FILE *fp = fopen("/proc/self/statm", "r");
+
+	if (fp) {
+		if (fscanf(fp, "%llu %llu", &size, &resident) != 2)
+			resident = 0;
+		fclose(fp);
+	}
+	return resident * (sysconf(_SC_PAGESIZE) >> 10);
+}
+
+static int open_dtlb_counter(void)
+{
+	struct perf_event_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = PERF_TYPE_HW_CACHE;
+	attr.config = PERF_COUNT_HW_CACHE_DTLB |
+		      (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+		      (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+	attr.disabled = 1;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+
+	return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+struct result {
+	unsigned long long rss_kb;
+	unsigned long long first_us;
+	unsigned long long first_max_us;
+	unsigned long long steady_us;
+	unsigned long long random_us;
+	long long dtlb_misses;		/* under zero when not counted */
+};
+
+static void run(char **frames, int count, unsigned int size, const char *src, struct result *r)
+{
+	unsigned long long t, t0, rss = rss_kb();
+	unsigned int x = 12345, lines = size / 64;
+	volatile char sink = 0;
+	long long misses = -1;
+	int i, fd;
+
+	r->first_max_us = 0;
+	t0 = now_us();
+	for (i = 0; i < count; i++) {
+		t = now_us();
+		memcpy(frames[i], src, size);
+		t = now_us() - t;
+		if (t > r->first_max_us)
+			r->first_max_us = t;
+	}
+	r->first_us = now_us() - t0;
+	r->rss_kb = rss_kb() - rss;
+
+	t = now_us();
+	for (i = 0; i < count; i++)
+		memcpy(frames[i], src, size);
+	r->steady_us = now_us() - t;
+
+	fd = open_dtlb_counter();
+	if (fd >= 0) {
+		ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+		ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+	}
+	t = now_us();
+	for (i = 0; i < RANDOM_READS; i++) {
+		x = x * 1103515245 + 12345;
+		sink += frames[(x >> 8) % count][((x >> 4) % lines) * 64];
+	}
+	r->random_us = now_us() - t;
+	if (fd >= 0) {
+		ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+		if (read(fd, &misses, sizeof(misses)) != sizeof(misses))
+			misses = -1;
+		close(fd);
+	}
+	r->dtlb_misses = misses;
+	(void)sink;
+}
+
+static void report(const char *name, const struct result *r, int count)
+{
+	printf("%-22s %8llu KB %8.1f %8llu %8.1f %8llu ", name, r->rss_kb,
+	       (double)r->first_us / count, r->first_max_us,
+	       (double)r->steady_us / count, r->random_us);
+	if (r->dtlb_misses >= 0)
+		printf("%10lld\n", r->dtlb_misses);
+	else
+		printf("%10s\n", "n/a");
+}
+
+static void bench_malloc(int count, unsigned int size, const char *src)
+{
+	struct result r;
+	char *frames[64];
+
+	/* allocated at startup, faulted in by the first frames */
+	if (alloc_userptr_buffers((void **)frames, count, size))
+		return;
+	run(frames, count, size, src, &r);
+	report("malloc, lazy", &r, count);
+	free_userptr_buffers((void **)frames, count);
+}
+
+static void bench_pool(const char *name, int flags, int count, unsigned int size, const char *src)
+{
+	static const char *backing[] = { "base", "thp", "hugetlb" };
+	struct pool_frame *held[64];
+	struct frame_pool_stats st;
+	struct frame_pool *pool;
+	struct result r;
+	char *frames[64];
+	unsigned long long rss = rss_kb();
+	int i;
+
+	pool = create_frame_pool(count, size, flags);
+	if (!pool)
+		return;
+	for (i = 0; i < count; i++) {
+		held[i] = get_pool_frame(pool);
+		frames[i] = (char *)held[i]->data;
+	}
+	run(frames, count, size, src, &r);
+	/* the arena is resident before the first frame */
+	r.rss_kb = rss_kb() - rss;
+	report(name, &r, count);
+	get_frame_pool_stats(pool, &st);
+	printf("%-22s %s pages%s, prefault %u us\n", "", backing[st.backing],
+	       st.locked ? ", locked" : "", st.prefault_us);
+	for (i = 0; i < count; i++)
+		unref_pool_frame(held[i]);
+	destroy_frame_pool(pool);
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned int size = 640 * 480 * 2;
+	int count = 8;
+	char *src;
+
+	dfp = stdout;
+	if (argc > 1)
+		size = strtoul(argv[1], NULL, 0);
+	if (argc > 2)
+		count = atoi(argv[2]);
+	if (count < 1 || count > 64)
+		count = 8;
+	src = (char *)malloc(size);
+	if (!src)
+		return 1;
+	memset(src, 0x5a, size);
+
+	printf("%d frames of %u bytes, %llu KB (fixed layout %llu KB)\n", count, size,
+	       (unsigned long long)count * size >> 10, FIXED_RGB_BYTES >> 10);
+	printf("%-22s %11s %8s %8s %8s %8s %10s\n", "", "rss", "first", "max",
+	       "steady", "random", "dtlb miss");
+	printf("%-22s %11s %8s %8s %8s %8s %10s\n", "", "", "us/frm", "us",
+	       "us/frm", "us", "");
+	bench_malloc(count, size, src);
+	bench_pool("arena", 0, count, size, src);
+	bench_pool("arena, huge", FRAME_POOL_HUGEPAGE, count, size, src);
+	bench_pool("arena, huge, locked", FRAME_POOL_HUGEPAGE | FRAME_POOL_LOCK, count, size, src);
+	free(src);
+
+	return 0;
+}
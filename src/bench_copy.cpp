@@ -0,0 +1,162 @@
+/**
+ * Copyright(c) 2020 I4VINE Inc.,
+ *
+ *  @file  bench_copy.cpp
+ *  @brief frame copy throughput for the cache access modes.
+ *
+ * bench_copy [frame bytes] [/dev/videoN width height [frames]]
+ *
+ * Without a device it copies from cached memory and from a udmabuf
+ * mapping with and without DMA_BUF_IOCTL_SYNC around every copy. With a
+ * device it captures with VIDEO_CPU_RW, VIDEO_CPU_READ (both copy each
+ * frame out) and VIDEO_CPU_NONE (no copy) and reports the time per
+ * dequeue.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <linux/videodev2.h>
+#include <linux/dma-buf.h>
+
+#include <capis.h>
+
+#define COPY_LOOPS	200
+
+static unsigned long long now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void report(const char *name, unsigned long long us, unsigned int size, int loops)
+{
+	printf("%-24s %8.1f MB/s %8.1f us/frame\n", name,
+	       (double)size * loops / (us ? us : 1), (double)us / loops);
+}
+
+static void sync_dmabuf(int fd, unsigned long long flags)
+{
+	struct dma_buf_sync sync;
+
+	sync.flags = flags;
+	if (ioctl(fd, DMA_BUF_IOCTL_SYNC, &sync) < 0)
+		perror("DMA_BUF_IOCTL_SYNC");
+}
+
+static void bench_memory(unsigned int size)
+{
+	unsigned long long t;
+	char *src, *dst;
+	void *dma;
+	int i, fd;
+
+	src = (char *)malloc(size);
+	dst = (char *)malloc(size);
+	if (!src || !dst)
+		return;
+	memset(src, 0x5a, size);
+	memset(dst, 0, size);
+
+	t = now_us();
+	for (i = 0; i < COPY_LOOPS; i++)
+		memcpy(dst, src, size);
+	report("cached memory", now_us() - t, size, COPY_LOOPS);
+
+	fd = alloc_dmabuf(size, &dma);
+	if (fd < 0) {
+		printf("%-24s no /dev/udmabuf\n", "dma-buf");
+	} else {
+		memset(dma, 0x5a, size);
+		t = now_us();
+		for (i = 0; i < COPY_LOOPS; i++) {
+			sync_dmabuf(fd, DMA_BUF_SYNC_START | DMA_BUF_SYNC_READ);
+			memcpy(dst, dma, size);
+			sync_dmabuf(fd, DMA_BUF_SYNC_END | DMA_BUF_SYNC_READ);
+		}
+		report("dma-buf, synced", now_us() - t, size, COPY_LOOPS);
+
+		t = now_us();
+		for (i = 0; i < COPY_LOOPS; i++)
+			memcpy(dst, dma, size);
+		report("dma-buf, no sync", now_us() - t, size, COPY_LOOPS);
+		free_dmabuf(fd, dma, size);
+	}
+	free(src);
+	free(dst);
+}
+
+static void bench_device(const char *dev, int width, int height, int frames)
+{
+	static const struct {
+		int access;
+		const char *name;
+	} modes[] = {
+		{ VIDEO_CPU_RW, "capture, cpu rw" },
+		{ VIDEO_CPU_READ, "capture, cpu read" },
+		{ VIDEO_CPU_NONE, "capture, pass-through" },
+	};
+	struct v4l2_buffer buf;
+	unsigned long long t, bytes;
+	unsigned int size = width * height * 4;
+	char *data;
+	int m, i, n;
+
+	data = (char *)malloc(size);
+	if (!data)
+		return;
+	set_video_device_name(MODULE_RGB, dev);
+	for (m = 0; m < (int)(sizeof(modes) / sizeof(modes[0])); m++) {
+		if (open_video_device(MODULE_RGB) < 0)
+			break;
+		set_video_cpu_access(MODULE_RGB, modes[m].access);
+		if (init_video_device(MODULE_RGB, width, height, 4) ||
+		    start_video_capture(MODULE_RGB)) {
+			close_video_device(MODULE_RGB);
+			break;
+		}
+		/* let the stream settle before timing */
+		for (i = 0; i < 4; i++) {
+			if (dequeue_and_capture(MODULE_RGB, &buf, NULL) >= 0)
+				queue_capture(MODULE_RGB, &buf);
+		}
+		bytes = 0;
+		n = 0;
+		t = now_us();
+		for (i = 0; i < frames; i++) {
+			if (dequeue_and_capture(MODULE_RGB, &buf,
+						modes[m].access & VIDEO_CPU_READ ? data : NULL) < 0)
+				continue;
+			bytes += buf.bytesused;
+			n++;
+			queue_capture(MODULE_RGB, &buf);
+		}
+		t = now_us() - t;
+		if (n)
+			report(modes[m].name, t, bytes / n, n);
+		stop_video_capture(MODULE_RGB);
+		uninit_video_device(MODULE_RGB);
+		close_video_device(MODULE_RGB);
+	}
+	free(data);
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned int size = 640 * 480 * 2;
+
+	dfp = stdout;
+	if (argc > 1)
+		size = strtoul(argv[1], NULL, 0);
+	printf("frame %u bytes\n", size);
+	bench_memory(size);
+	if (argc > 4)
+		bench_device(argv[2], atoi(argv[3]), atoi(argv[4]), argc > 5 ? atoi(argv[5]) : 100);
+
+	return 0;
+}
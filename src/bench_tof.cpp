@@ -0,0 +1,144 @@
+/**
+ * Copyright(c) 2020 I4VINE Inc.,
+ *
+ *  @file  bench_tof.cpp
+ *  @brief depth engine: time per frame against the frame budget.
+ *
+ * bench_tof [frames] [max threads]
+ *
+ * For each phase layout, makes a 224 x (173 * images) SBGGR12P frame of a
+ * scene ramping from 0.2 m to 7.4 m, checks the engine gives that depth
+ * back (modulo the layout's unambiguous range), then runs it with 1 up to
+ * max threads (4 by default) and reports the time per frame, the share
+ * of a 30 fps frame time it takes and each thread's busy time.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <linux/videodev2.h>
+
+#include <capis.h>
+
+#define PACKED_STRIDE	(DEPTH_PHASE_WIDTH / 2 * 3)
+#define PACKED_BYTES	(PACKED_STRIDE * DEPTH_PHASE_HEIGHT * DEPTH_PHASES)
+#define PHASE_PIXELS	(DEPTH_PHASE_WIDTH * DEPTH_PHASE_HEIGHT)
+#define LIGHT_SPEED	299792458.0
+
+static void put_pixel(unsigned char *raw, int phase, int y, int x, int v)
+{
+	unsigned char *p = raw + ((size_t)phase * DEPTH_PHASE_HEIGHT + y) * PACKED_STRIDE + x / 2 * 3;
+
+	if (x & 1) {
+		p[1] = v >> 4;
+		p[2] = (p[2] & 0x0f) | ((v & 0x0f) << 4);
+	} else {
+		p[0] = v >> 4;
+		p[2] = (p[2] & 0xf0) | (v & 0x0f);
+	}
+}
+
+static double scene_mm(int y, int x)
+{
+	return 200 + 7200.0 * (y * DEPTH_PHASE_WIDTH + x) / PHASE_PIXELS;
+}
+
+static unsigned int gcd(unsigned int a, unsigned int b)
+{
+	return b ? gcd(b, a % b) : a;
+}
+
+/* 4 samples per frequency of a sine at the pixel's phase, amplitude 400,
+   after a gray image in TOF_LAYOUT_9 */
+static void make_frame(unsigned char *raw, const struct tof_config *cfg)
+{
+	int gray = cfg->layout == TOF_LAYOUT_9;
+	int freqs = cfg->layout == TOF_LAYOUT_4 ? 1 : 2;
+
+	for (int y = 0; y < DEPTH_PHASE_HEIGHT; y++) {
+		for (int x = 0; x < DEPTH_PHASE_WIDTH; x++) {
+			if (gray)
+				put_pixel(raw, 0, y, x, 1000);
+			for (int f = 0; f < freqs; f++) {
+				double range = LIGHT_SPEED / (2.0 * cfg->freq_hz[f]) * 1000;
+				double phase = 2 * M_PI * fmod(scene_mm(y, x), range) / range;
+
+				for (int k = 0; k < 4; k++)
+					put_pixel(raw, gray + f * 4 + k, y, x,
+						  (int)lround(1500 + 400 * cos(phase - k * M_PI / 2)));
+			}
+		}
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	static const char *names[TOF_LAYOUTS] = { "4", "2x4", "9" };
+	struct tof_config cfg;
+	struct tof_engine *e;
+	struct tof_output out;
+	struct tof_stats st;
+	unsigned char *raw;
+	void *maps;
+	double range, err, max_err = 0;
+	int frames = 1000, max_threads = TOF_DEFAULT_THREADS;
+
+	dfp = stdout;
+	if (argc > 1)
+		frames = atoi(argv[1]);
+	if (argc > 2)
+		max_threads = atoi(argv[2]);
+	if (frames < 1)
+		frames = 1000;
+	if (max_threads < 1 || max_threads > TOF_MAX_THREADS)
+		max_threads = TOF_DEFAULT_THREADS;
+	raw = (unsigned char *)malloc(PACKED_BYTES);
+	if (!raw)
+		return 1;
+
+	for (int layout = 0; layout < TOF_LAYOUTS; layout++) {
+		tof_default_config(&cfg, layout);
+		memset(raw, 0, PACKED_BYTES);
+		make_frame(raw, &cfg);
+		range = LIGHT_SPEED / (2.0 * gcd(cfg.freq_hz[0], cfg.freq_hz[1])) * 1000;
+		printf("layout %s: %d frames, %d phases of %dx%d, budget %u us\n", names[layout],
+		       frames, tof_layout_phases(layout), DEPTH_PHASE_WIDTH, DEPTH_PHASE_HEIGHT,
+		       cfg.budget_us);
+		for (int threads = 1; threads <= max_threads; threads++) {
+			cfg.threads = threads;
+			e = tof_create(&cfg);
+			if (!e)
+				return 1;
+			maps = malloc(tof_output_size(e));
+			if (!maps)
+				return 1;
+			tof_output_planes(e, maps, &out);
+			if (tof_process(e, raw, PACKED_BYTES, &out))
+				return 1;
+			for (int i = 0; i < PHASE_PIXELS; i++) {
+				err = fabs(out.depth[i] - fmod(scene_mm(i / DEPTH_PHASE_WIDTH,
+									i % DEPTH_PHASE_WIDTH), range));
+				/* at the wrap either end is right */
+				err = fmin(err, range - err);
+				if (err > max_err)
+					max_err = err;
+			}
+			for (int i = 0; i < frames; i++)
+				tof_process(e, raw, PACKED_BYTES, &out);
+			tof_get_stats(e, &st);
+			printf("%d threads: %7.1f us/frame, max %llu us, %5.2f%% of budget, %llu over\n",
+			       st.threads, (double)st.us_sum / st.frames, st.us_max,
+			       (double)st.us_sum / st.frames * 100 / st.budget_us, st.over_budget);
+			for (int i = 0; i < st.threads; i++)
+				printf("  thread %d busy %7.1f us/frame, %llu tiles\n", i,
+				       (double)st.busy_us[i] / st.frames, st.tiles[i]);
+			tof_destroy(e);
+			free(maps);
+		}
+	}
+	printf("largest depth error %.1f mm\n", max_err);
+	free(raw);
+
+	return max_err > 20;
+}
@@ -0,0 +1,117 @@
+/**
+ * Copyright(c) 2020 I4VINE Inc.,
+ *
+ *  @file  bench_unpack.cpp
+ *  @brief depth phase frame unpacking: every kernel against the scalar one.
+ *
+ * bench_unpack [frames]
+ *
+ * Unpacks a 224 x (173 * 9) SBGGR12P frame of random data into its 9
+ * phase planes with each kernel this cpu has, checks the planes match the
+ * scalar kernel's, and reports the time per frame, the packed bytes and
+ * pixels per second, and the share of a 30 fps frame time it takes. A
+ * plain copy of the packed frame, what the pipeline does with it now, is
+ * the first line.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <linux/videodev2.h>
+
+#include <capis.h>
+
+#define PACKED_STRIDE	(DEPTH_PHASE_WIDTH / 2 * 3)
+#define PACKED_BYTES	(PACKED_STRIDE * DEPTH_PHASE_HEIGHT * DEPTH_PHASES)
+#define PHASE_PIXELS	(DEPTH_PHASE_WIDTH * DEPTH_PHASE_HEIGHT)
+#define FRAME_US_30FPS	33333.0
+
+static unsigned long long now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void report(const char *name, unsigned long long us, int frames)
+{
+	double per = (double)us / frames;
+
+	printf("%-8s %9.1f %9.1f %9.1f %8.2f%%\n", name, per, PACKED_BYTES / per,
+	       (double)PHASE_PIXELS * DEPTH_PHASES / per, per * 100 / FRAME_US_30FPS);
+}
+
+static void set_planes(unsigned short *block, unsigned short *planes[])
+{
+	for (int p = 0; p < DEPTH_PHASES; p++)
+		planes[p] = block + (size_t)p * PHASE_PIXELS;
+}
+
+int main(int argc, char *argv[])
+{
+	static const int kernels[] = { DEPTH_UNPACK_SCALAR, DEPTH_UNPACK_SSSE3,
+				       DEPTH_UNPACK_AVX2, DEPTH_UNPACK_NEON };
+	unsigned short *ref, *out, *ref_planes[DEPTH_PHASES], *out_planes[DEPTH_PHASES];
+	unsigned char *src, *copy;
+	unsigned long long t;
+	const char *name;
+	int frames = 2000;
+	size_t plane_bytes = sizeof(unsigned short) * PHASE_PIXELS * DEPTH_PHASES;
+
+	dfp = stdout;
+	if (argc > 1)
+		frames = atoi(argv[1]);
+	if (frames < 1)
+		frames = 2000;
+	src = (unsigned char *)malloc(PACKED_BYTES);
+	copy = (unsigned char *)malloc(PACKED_BYTES);
+	if (!src || !copy || posix_memalign((void **)&ref, 64, plane_bytes) ||
+	    posix_memalign((void **)&out, 64, plane_bytes))
+		return 1;
+	srand(1);
+	for (int i = 0; i < PACKED_BYTES; i++)
+		src[i] = rand();
+	set_planes(ref, ref_planes);
+	set_planes(out, out_planes);
+
+	set_depth_unpack_kernel(DEPTH_UNPACK_SCALAR);
+	unpack_depth_phases(src, PACKED_STRIDE, DEPTH_PHASE_WIDTH, DEPTH_PHASE_HEIGHT,
+			    ref_planes, DEPTH_PHASES);
+
+	printf("%d frames of %d bytes, %d phases of %dx%d\n", frames, PACKED_BYTES,
+	       DEPTH_PHASES, DEPTH_PHASE_WIDTH, DEPTH_PHASE_HEIGHT);
+	printf("%-8s %9s %9s %9s %9s\n", "", "us/frame", "MB/s in", "Mpix/s", "at 30fps");
+	t = now_us();
+	for (int i = 0; i < frames; i++)
+		memcpy(copy, src, PACKED_BYTES);
+	report("memcpy", now_us() - t, frames);
+
+	for (unsigned int k = 0; k < sizeof(kernels) / sizeof(kernels[0]); k++) {
+		if (set_depth_unpack_kernel(kernels[k]))
+			continue;
+		get_depth_unpack_kernel(&name);
+		memset(out, 0xff, plane_bytes);
+		unpack_depth_phases(src, PACKED_STRIDE, DEPTH_PHASE_WIDTH, DEPTH_PHASE_HEIGHT,
+				    out_planes, DEPTH_PHASES);
+		if (memcmp(out, ref, plane_bytes)) {
+			printf("%-8s planes differ from the scalar kernel\n", name);
+			return 1;
+		}
+		t = now_us();
+		for (int i = 0; i < frames; i++)
+			unpack_depth_phases(src, PACKED_STRIDE, DEPTH_PHASE_WIDTH, DEPTH_PHASE_HEIGHT,
+					    out_planes, DEPTH_PHASES);
+		report(name, now_us() - t, frames);
+	}
+	set_depth_unpack_kernel(DEPTH_UNPACK_AUTO);
+	get_depth_unpack_kernel(&name);
+	printf("auto picks %s\n", name);
+	free(src);
+	free(copy);
+	free(ref);
+	free(out);
+
+	return 0;
+}
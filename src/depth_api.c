@@ -0,0 +1,272 @@
+/**
+ * Copyright(c) 2020 I4VINE Inc.,
+ *
+ *  @file  depth_api.c
+ *  @brief unpacking of the 12 bit packed depth phase frames.
+ *
+ * The depth node gives SBGGR12P: two pixels in three bytes, the high 8
+ * bits of each pixel first and their low nibbles packed in the third byte
+ * (pixel 1 in the high nibble). A frame is the 9 phase images of the ToF
+ * sensor stacked, 224 x 173 each. Unpacking writes each phase to a plane
+ * of its own, one uint16 per pixel with the 12 bits in the low bits.
+ *
+ * A row is unpacked by the widest kernel the cpu has: NEON on arm, AVX2
+ * or SSSE3 on x86 (picked at run time, the build needs no -m flags), a
+ * scalar one otherwise. The scalar one is the reference the others are
+ * checked against and also does the odd pixels at the end of a row.
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <linux/videodev2.h>
+
+#include <capis.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define DEPTH_X86
+#endif
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define DEPTH_NEON
+#endif
+
+typedef void (*unpack_row_fn)(const uint8_t *src, uint16_t *dst, unsigned int width);
+
+static void unpack_row_scalar(const uint8_t *src, uint16_t *dst, unsigned int width)
+{
+	unsigned int i;
+
+	for (i = 0; i + 1 < width; i += 2, src += 3) {
+		dst[i] = (src[0] << 4) | (src[2] & 0x0f);
+		dst[i + 1] = (src[1] << 4) | (src[2] >> 4);
+	}
+}
+
+#if defined(DEPTH_X86)
+/*
+ * The shuffle makes a word (high byte, byte 2) of each pixel. Shifted
+ * right by 4 that is pixel 1 as it is, pixel 0 still needs the low nibble
+ * of byte 2 in place of the high one.
+ */
+__attribute__((target("ssse3")))
+static void unpack_row_ssse3(const uint8_t *src, uint16_t *dst, unsigned int width)
+{
+	const __m128i shuf = _mm_setr_epi8(2, 0, 2, 1, 5, 3, 5, 4, 8, 6, 8, 7, 11, 9, 11, 10);
+	const __m128i hi = _mm_set1_epi32(0x0fff0ff0);
+	const __m128i lo = _mm_set1_epi32(0x0000000f);
+	unsigned int i = 0;
+	__m128i w;
+
+	/* 12 bytes to 8 pixels, the 16 byte load stays inside the row */
+	for (; i + 8 <= width && (i / 2) * 3 + 16 <= width / 2 * 3; i += 8, src += 12) {
+		w = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)src), shuf);
+		w = _mm_or_si128(_mm_and_si128(_mm_srli_epi16(w, 4), hi), _mm_and_si128(w, lo));
+		_mm_storeu_si128((__m128i *)(dst + i), w);
+	}
+	unpack_row_scalar(src, dst + i, width - i);
+}
+
+__attribute__((target("avx2")))
+static void unpack_row_avx2(const uint8_t *src, uint16_t *dst, unsigned int width)
+{
+	const __m256i shuf = _mm256_setr_epi8(2, 0, 2, 1, 5, 3, 5, 4, 8, 6, 8, 7, 11, 9, 11, 10,
+					      2, 0, 2, 1, 5, 3, 5, 4, 8, 6, 8, 7, 11, 9, 11, 10);
+	const __m256i hi = _mm256_set1_epi32(0x0fff0ff0);
+	const __m256i lo = _mm256_set1_epi32(0x0000000f);
+	unsigned int i = 0;
+	__m256i w;
+	__m128i x;
+
+	/* 24 bytes to 16 pixels, each lane gets 12 of them */
+	for (; i + 16 <= width && (i / 2) * 3 + 28 <= width / 2 * 3; i += 16, src += 24) {
+		w = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i *)src)),
+					    _mm_loadu_si128((const __m128i *)(src + 12)), 1);
+		w = _mm256_shuffle_epi8(w, shuf);
+		w = _mm256_or_si256(_mm256_and_si256(_mm256_srli_epi16(w, 4), hi), _mm256_and_si256(w, lo));
+		_mm256_storeu_si256((__m256i *)(dst + i), w);
+	}
+	/* the rest here, not in unpack_row_ssse3: legacy SSE code after AVX
+	   code stalls on the upper halves */
+	for (; i + 8 <= width && (i / 2) * 3 + 16 <= width / 2 * 3; i += 8, src += 12) {
+		x = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)src), _mm256_castsi256_si128(shuf));
+		x = _mm_or_si128(_mm_and_si128(_mm_srli_epi16(x, 4), _mm256_castsi256_si128(hi)),
+				 _mm_and_si128(x, _mm256_castsi256_si128(lo)));
+		_mm_storeu_si128((__m128i *)(dst + i), x);
+	}
+	unpack_row_scalar(src, dst + i, width - i);
+}
+#endif
+
+#if defined(DEPTH_NEON)
+static void unpack_row_neon(const uint8_t *src, uint16_t *dst, unsigned int width)
+{
+	const uint8x16_t nibble = vdupq_n_u8(0x0f);
+	unsigned int i = 0;
+	uint8x16x3_t b;
+	uint16x8x2_t lo, hi;
+
+	/* the load splits byte 0, 1 and 2 of 16 pairs, the store interleaves */
+	for (; i + 32 <= width; i += 32, src += 48) {
+		b = vld3q_u8(src);
+		lo.val[0] = vorrq_u16(vshll_n_u8(vget_low_u8(b.val[0]), 4),
+				      vmovl_u8(vget_low_u8(vandq_u8(b.val[2], nibble))));
+		lo.val[1] = vorrq_u16(vshll_n_u8(vget_low_u8(b.val[1]), 4),
+				      vmovl_u8(vget_low_u8(vshrq_n_u8(b.val[2], 4))));
+		hi.val[0] = vorrq_u16(vshll_n_u8(vget_high_u8(b.val[0]), 4),
+				      vmovl_u8(vget_high_u8(vandq_u8(b.val[2], nibble))));
+		hi.val[1] = vorrq_u16(vshll_n_u8(vget_high_u8(b.val[1]), 4),
+				      vmovl_u8(vget_high_u8(vshrq_n_u8(b.val[2], 4))));
+		vst2q_u16(dst + i, lo);
+		vst2q_u16(dst + i + 16, hi);
+	}
+	unpack_row_scalar(src, dst + i, width - i);
+}
+#endif
+
+static const char *kernel_names[] = {
+	[DEPTH_UNPACK_AUTO] = "auto",
+	[DEPTH_UNPACK_SCALAR] = "scalar",
+	[DEPTH_UNPACK_SSSE3] = "ssse3",
+	[DEPTH_UNPACK_AVX2] = "avx2",
+	[DEPTH_UNPACK_NEON] = "neon",
+};
+
+static unpack_row_fn kernel_fn(int kernel)
+{
+	switch (kernel) {
+	case DEPTH_UNPACK_SCALAR:
+		return unpack_row_scalar;
+#if defined(DEPTH_X86)
+	case DEPTH_UNPACK_SSSE3:
+		__builtin_cpu_init();
+		return __builtin_cpu_supports("ssse3") ? unpack_row_ssse3 : NULL;
+	case DEPTH_UNPACK_AVX2:
+		__builtin_cpu_init();
+		return __builtin_cpu_supports("avx2") ? unpack_row_avx2 : NULL;
+#endif
+#if defined(DEPTH_NEON)
+	case DEPTH_UNPACK_NEON:
+		return unpack_row_neon;
+#endif
+	}
+	return NULL;
+}
+
+static int best_kernel(void)
+{
+	int k;
+
+	for (k = DEPTH_UNPACK_NEON; k > DEPTH_UNPACK_SCALAR; k--)
+		if (kernel_fn(k))
+			return k;
+	return DEPTH_UNPACK_SCALAR;
+}
+
+static pthread_once_t kernel_once = PTHREAD_ONCE_INIT;
+static int cur_kernel = DEPTH_UNPACK_AUTO;
+static unpack_row_fn unpack_row = unpack_row_scalar;
+
+static void init_kernel(void)
+{
+	if (cur_kernel == DEPTH_UNPACK_AUTO) {
+		cur_kernel = best_kernel();
+		unpack_row = kernel_fn(cur_kernel);
+	}
+}
+
+/**
+ *  @brief  "C" Pick the unpack kernel
+ *  @param[in] kernel   DEPTH_UNPACK_xxx, DEPTH_UNPACK_AUTO for the fastest
+ *  @return \b zero for success
+ *          \b VIDEO_ERR_UNSUPPORTED when this cpu or build has not got it
+ *  @note   meant for tests and benchmarks, set it before unpacking starts.
+*/
+int set_depth_unpack_kernel(int kernel)
+{
+	unpack_row_fn fn;
+
+	if (kernel == DEPTH_UNPACK_AUTO)
+		kernel = best_kernel();
+	fn = kernel_fn(kernel);
+	if (!fn)
+		return VIDEO_ERR_UNSUPPORTED;
+	pthread_once(&kernel_once, init_kernel);
+	cur_kernel = kernel;
+	unpack_row = fn;
+
+	return 0;
+}
+
+/**
+ *  @brief  "C" The unpack kernel in use
+ *  @param[out] name   its name, may be NULL
+ *  @return \b DEPTH_UNPACK_xxx
+*/
+int get_depth_unpack_kernel(const char **name)
+{
+	pthread_once(&kernel_once, init_kernel);
+	if (name)
+		*name = kernel_names[cur_kernel];
+
+	return cur_kernel;
+}
+
+/**
+ *  @brief  "C" Unpack a SBGGR12P image
+ *  @param[in]  src         packed image
+ *  @param[in]  stride      bytes of a packed row, at least width * 3 / 2
+ *  @param[in]  width       pixels of a row, even
+ *  @param[in]  height      rows
+ *  @param[out] dst         width * height pixels, 12 bits in the low bits
+ *  @param[in]  dst_stride  pixels of a dst row, at least width
+ *  @return \b zero for success
+ *          \b under zero value indicated the error
+*/
+int unpack_sbggr12p(const void *src, unsigned int stride, unsigned int width,
+		    unsigned int height, unsigned short *dst, unsigned int dst_stride)
+{
+	const uint8_t *s = (const uint8_t *)src;
+	unsigned int y;
+
+	if (!src || !dst || (width & 1) || stride < width / 2 * 3 || dst_stride < width)
+		return VIDEO_ERR_INVALID;
+	pthread_once(&kernel_once, init_kernel);
+	for (y = 0; y < height; y++)
+		unpack_row(s + (size_t)y * stride, dst + (size_t)y * dst_stride, width);
+
+	return 0;
+}
+
+/**
+ *  @brief  "C" Unpack a depth frame into its phase images
+ *  @param[in]  src      packed frame, the phases stacked top to bottom
+ *  @param[in]  stride   bytes of a packed row
+ *  @param[in]  width    pixels of a row, DEPTH_PHASE_WIDTH
+ *  @param[in]  height   rows of one phase, DEPTH_PHASE_HEIGHT
+ *  @param[out] planes   one width * height plane per phase
+ *  @param[in]  phases   number of planes, DEPTH_PHASES
+ *  @return \b zero for success
+ *          \b under zero value indicated the error
+ *  @note   a plane is any uint16 buffer, e.g. one of a single block of
+ *          DEPTH_PHASES planes back to back.
+*/
+int unpack_depth_phases(const void *src, unsigned int stride, unsigned int width,
+			unsigned int height, unsigned short *planes[], int phases)
+{
+	const uint8_t *s = (const uint8_t *)src;
+	int p, ret;
+
+	if (!planes || phases <= 0)
+		return VIDEO_ERR_INVALID;
+	for (p = 0; p < phases; p++) {
+		ret = unpack_sbggr12p(s + (size_t)p * height * stride, stride, width, height,
+				      planes[p], width);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
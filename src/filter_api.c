@@ -0,0 +1,558 @@
+/**
+ * Copyright(c) 2020 I4VINE Inc.,
+ *
+ *  @file  filter_api.c
+ *  @brief post processing of depth maps: a chain of filters run in place.
+ *
+ * The filters are amplitude threshold, flying pixel removal, 3x3 and 5x5
+ * median, temporal IIR and small hole filling, in any order the caller
+ * sets, see depth_filters_set_chain. Zero depth is no depth throughout.
+ *
+ * The chain works on the depth plane in place and in strips of rows: each
+ * filter runs a strip as soon as the one before it has written the rows
+ * it needs, so the whole chain passes over the plane once, a few rows
+ * apart, with those rows in cache. A filter that reads neighbours keeps
+ * its own copy of the 2 * radius + 1 input rows around the row it writes,
+ * edges repeated, so writing the plane does not change what it reads.
+ *
+ * Kernels do 8 pixels at a time with GCC vector types, NEON on arm and
+ * SSE on x86. The medians are selection networks of min and max (the one
+ * place with intrinsics, GCC does not make min / max of the selects), the
+ * rest selects; no branch depends on a pixel.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <linux/videodev2.h>
+
+#include <capis.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#endif
+
+#define FILTER_STRIP_ROWS	8
+#define FILTER_MAX_RADIUS	2
+
+typedef unsigned short v8hu __attribute__((vector_size(16)));
+typedef short v8hi __attribute__((vector_size(16)));
+typedef int v8si __attribute__((vector_size(32)));
+typedef unsigned int v8su __attribute__((vector_size(32)));
+
+#define V8(x)	((v8hu){ (x), (x), (x), (x), (x), (x), (x), (x) })
+
+typedef void (*filter_row_fn)(const struct depth_filter_config *c, const unsigned short *const *rows,
+			      unsigned short *out, const unsigned short *amp, unsigned short *state,
+			      unsigned int w);
+
+struct depth_filters {
+	pthread_mutex_t lock;
+	unsigned int width;
+	unsigned int height;
+	struct depth_filter_config cfg;
+	int chain[DEPTH_FILTER_MAX_CHAIN];
+	int count;
+	unsigned short *ring[DEPTH_FILTER_MAX_CHAIN];	/* input rows of each stage */
+	unsigned short *state;		/* temporal: its last output */
+	struct depth_filter_stats stats;
+};
+
+/* a filter of the chain while a frame runs */
+struct filter_stage {
+	filter_row_fn row;
+	int filter;
+	int radius;
+	int next_row;			/* the next row it writes */
+	int loaded;			/* the next input row to copy to its ring */
+	unsigned long long ns;
+};
+
+static unsigned long long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static inline v8hu vload(const unsigned short *p)
+{
+	v8hu v;
+
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline void vstore(unsigned short *p, v8hu v)
+{
+	memcpy(p, &v, sizeof(v));
+}
+
+static inline v8hu vsel(v8hu m, v8hu a, v8hu b)
+{
+	return (a & m) | (b & ~m);
+}
+
+static inline v8hu vabsdiff(v8hu a, v8hu b)
+{
+	v8hu m = (v8hu)(a > b);
+
+	return vsel(m, a - b, b - a);
+}
+
+/* a the smaller, b the larger. signed: sse2 has signed 16 bit min and
+   max only, so the median works on values biased by 0x8000 */
+static inline void vsort2(v8hi *a, v8hi *b)
+{
+#if defined(__SSE2__)
+	v8hi lo = (v8hi)_mm_min_epi16((__m128i)*a, (__m128i)*b);
+
+	*b = (v8hi)_mm_max_epi16((__m128i)*a, (__m128i)*b);
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+	v8hi lo = (v8hi)vminq_s16((int16x8_t)*a, (int16x8_t)*b);
+
+	*b = (v8hi)vmaxq_s16((int16x8_t)*a, (int16x8_t)*b);
+#else
+	v8hi m = *a < *b, lo = (*a & m) | (*b & ~m);
+
+	*b = (*b & m) | (*a & ~m);
+#endif
+	*a = lo;
+}
+
+/**
+ *  @brief  median of n values, forgetful selection
+ *  @note   of n / 2 + 2 values the smallest and largest cannot be the
+ *          median; drop them, take the next value, repeat down to 3.
+ *          v is n long and is overwritten
+*/
+static inline __attribute__((always_inline)) v8hi vmedian(v8hi *v, const int n)
+{
+	int lo = 0, hi = n / 2 + 1, next, i;
+
+#pragma GCC unroll 16
+	for (next = n / 2 + 2; next <= n; next++) {
+#pragma GCC unroll 16
+		for (i = lo + 1; i <= hi; i++)
+			vsort2(&v[lo], &v[i]);
+#pragma GCC unroll 16
+		for (i = lo + 1; i < hi; i++)
+			vsort2(&v[i], &v[hi]);
+		if (next < n) {
+			v[hi] = v[next];
+			lo++;
+		}
+	}
+	/* lo and hi are out, the median of the 3 left is v[lo + 1] */
+	return v[lo + 1];
+}
+
+static void row_amplitude(const struct depth_filter_config *c, const unsigned short *const *rows,
+			  unsigned short *out, const unsigned short *amp, unsigned short *state,
+			  unsigned int w)
+{
+	const v8hu min = V8(c->min_amplitude);
+	unsigned int x;
+
+	if (!amp)
+		return;
+	for (x = 0; x < w; x += 8)
+		vstore(out + x, vload(rows[0] + x) & (v8hu)(vload(amp + x) >= min));
+}
+
+/* a pixel far from both neighbours across it, in x or in y, is between
+   two surfaces. missing neighbours do not count */
+static void row_flying(const struct depth_filter_config *c, const unsigned short *const *rows,
+		       unsigned short *out, const unsigned short *amp, unsigned short *state,
+		       unsigned int w)
+{
+	const v8hu t = V8(c->flying_mm), zero = V8(0);
+	unsigned int x;
+
+	for (x = 0; x < w; x += 8) {
+		v8hu d = vload(rows[1] + x);
+		v8hu l = vload(rows[1] + x - 1), r = vload(rows[1] + x + 1);
+		v8hu u = vload(rows[0] + x), b = vload(rows[2] + x);
+		v8hu jl = (v8hu)(vabsdiff(d, l) > t) & (v8hu)(l != zero);
+		v8hu jr = (v8hu)(vabsdiff(d, r) > t) & (v8hu)(r != zero);
+		v8hu ju = (v8hu)(vabsdiff(d, u) > t) & (v8hu)(u != zero);
+		v8hu jb = (v8hu)(vabsdiff(d, b) > t) & (v8hu)(b != zero);
+
+		vstore(out + x, d & ~((jl & jr) | (ju & jb)));
+	}
+}
+
+/* no depth stays no depth, holes are filled by DEPTH_FILTER_HOLES */
+static inline __attribute__((always_inline))
+void row_median(const unsigned short *const *rows, unsigned short *out, unsigned int w, const int r)
+{
+	const int n = (2 * r + 1) * (2 * r + 1);
+	const v8hu bias = V8(0x8000);
+	v8hi v[25];
+	v8hu d;
+	unsigned int x;
+	int i, j, k;
+
+	for (x = 0; x < w; x += 8) {
+		k = 0;
+		for (i = 0; i <= 2 * r; i++)
+			for (j = -r; j <= r; j++)
+				v[k++] = (v8hi)(vload(rows[i] + x + j) ^ bias);
+		d = vload(rows[r] + x);
+		vstore(out + x, ((v8hu)vmedian(v, n) ^ bias) & (v8hu)(d != V8(0)));
+	}
+}
+
+static void row_median3(const struct depth_filter_config *c, const unsigned short *const *rows,
+			unsigned short *out, const unsigned short *amp, unsigned short *state,
+			unsigned int w)
+{
+	row_median(rows, out, w, 1);
+}
+
+static void row_median5(const struct depth_filter_config *c, const unsigned short *const *rows,
+			unsigned short *out, const unsigned short *amp, unsigned short *state,
+			unsigned int w)
+{
+	row_median(rows, out, w, 2);
+}
+
+/* s += (d - s) * alpha, restarted where either has no depth or they are
+   too far apart to be the same surface */
+static void row_temporal(const struct depth_filter_config *c, const unsigned short *const *rows,
+			 unsigned short *out, const unsigned short *amp, unsigned short *state,
+			 unsigned int w)
+{
+	const v8hu reset = V8(c->temporal_reset_mm), zero = V8(0);
+	const int alpha = c->temporal_alpha;
+	unsigned int x;
+
+	for (x = 0; x < w; x += 8) {
+		v8hu d = vload(rows[0] + x), s = vload(state + x), m;
+		v8si di = __builtin_convertvector(d, v8si), si = __builtin_convertvector(s, v8si);
+
+		si += ((di - si) * alpha + 128) >> 8;
+		m = (v8hu)(d == zero) | (v8hu)(s == zero) | (v8hu)(vabsdiff(d, s) > reset);
+		s = vsel(m, d, __builtin_convertvector(si, v8hu));
+		vstore(state + x, s);
+		vstore(out + x, s);
+	}
+}
+
+/* no depth with enough of its 8 neighbours: their mean */
+static void row_holes(const struct depth_filter_config *c, const unsigned short *const *rows,
+		      unsigned short *out, const unsigned short *amp, unsigned short *state,
+		      unsigned int w)
+{
+	const v8hu need = V8(c->hole_neighbours);
+	unsigned int x;
+	int i, j, k;
+
+	/* only the sum needs 32 bits, counts and masks stay 8 x 16 bits */
+	for (x = 0; x < w; x += 8) {
+		v8si sum = { 0 };
+		v8hu cnt = { 0 }, recip = { 0 }, n;
+		v8su mean;
+		v8hu d = vload(rows[1] + x);
+
+		for (i = 0; i < 3; i++) {
+			for (j = -1; j <= 1; j++) {
+				if (i == 1 && j == 0)
+					continue;
+				n = vload(rows[i] + x + j);
+				sum += __builtin_convertvector(n, v8si);
+				cnt -= (v8hu)(n != 0);
+			}
+		}
+		/* sum / cnt as sum * 8192 / cnt, 8 * 65535 * 8192 fits 32 bits */
+#pragma GCC unroll 8
+		for (k = 1; k <= 8; k++)
+			recip = vsel((v8hu)(cnt == V8(k)), V8((8192 + k / 2) / k), recip);
+		mean = ((v8su)sum * __builtin_convertvector(recip, v8su) + 4096) >> 13;
+		vstore(out + x, vsel((v8hu)((d == 0) & (cnt >= need)),
+				     __builtin_convertvector(mean, v8hu), d));
+	}
+}
+
+static const struct {
+	const char *name;
+	int radius;
+	filter_row_fn row;
+} filters[DEPTH_FILTERS] = {
+	[DEPTH_FILTER_AMPLITUDE] = { "amplitude", 0, row_amplitude },
+	[DEPTH_FILTER_FLYING] = { "flying", 1, row_flying },
+	[DEPTH_FILTER_MEDIAN3] = { "median3", 1, row_median3 },
+	[DEPTH_FILTER_MEDIAN5] = { "median5", 2, row_median5 },
+	[DEPTH_FILTER_TEMPORAL] = { "temporal", 0, row_temporal },
+	[DEPTH_FILTER_HOLES] = { "holes", 1, row_holes },
+};
+
+/* copy input row y of a stage to its ring, rows and columns past the
+   edges repeat the edge */
+static void ring_load(struct depth_filters *f, int s, struct filter_stage *st,
+		      const unsigned short *plane, int y)
+{
+	int r = st->radius, pw = f->width + 2 * r, src = y, i;
+	unsigned short *row = f->ring[s] + ((y + r) % (2 * r + 1)) * pw;
+
+	if (src < 0)
+		src = 0;
+	if (src > (int)f->height - 1)
+		src = f->height - 1;
+	memcpy(row + r, plane + (size_t)src * f->width, f->width * sizeof(unsigned short));
+	for (i = 0; i < r; i++) {
+		row[i] = row[r];
+		row[r + f->width + i] = row[r + f->width - 1];
+	}
+}
+
+/**
+ *  @brief  "C" Defaults of the filters
+ *  @param[out] cfg   configuration to change and give to depth_filters_create
+ *  @return none
+*/
+void depth_filters_default_config(struct depth_filter_config *cfg)
+{
+	memset(cfg, 0, sizeof(*cfg));
+	cfg->min_amplitude = 32;
+	cfg->flying_mm = 100;
+	cfg->temporal_alpha = 96;
+	cfg->temporal_reset_mm = 150;
+	cfg->hole_neighbours = 5;
+}
+
+/**
+ *  @brief  "C" Make a filter chain for depth planes of one size
+ *  @param[in] width    pixels, a multiple of 8
+ *  @param[in] height   rows
+ *  @param[in] cfg      thresholds, NULL for the defaults
+ *  @return \b chain, running DEPTH_FILTER_FLYING, MEDIAN3 and HOLES
+ *          \b NULL for a bad size or out of memory
+ *  @see    depth_filters_set_chain, depth_filters_destroy
+*/
+struct depth_filters *depth_filters_create(unsigned int width, unsigned int height,
+					   const struct depth_filter_config *cfg)
+{
+	static const int chain[] = { DEPTH_FILTER_FLYING, DEPTH_FILTER_MEDIAN3, DEPTH_FILTER_HOLES };
+	struct depth_filters *f;
+	int i;
+
+	if (!width || (width & 7) || !height)
+		return NULL;
+	f = (struct depth_filters *)calloc(1, sizeof(*f));
+	if (!f)
+		return NULL;
+	f->width = width;
+	f->height = height;
+	if (cfg)
+		f->cfg = *cfg;
+	else
+		depth_filters_default_config(&f->cfg);
+	f->state = (unsigned short *)calloc((size_t)width * height, sizeof(unsigned short));
+	for (i = 0; f->state && i < DEPTH_FILTER_MAX_CHAIN; i++) {
+		f->ring[i] = (unsigned short *)malloc(sizeof(unsigned short) * (2 * FILTER_MAX_RADIUS + 1) *
+						      (width + 2 * FILTER_MAX_RADIUS));
+		if (!f->ring[i])
+			break;
+	}
+	if (i < DEPTH_FILTER_MAX_CHAIN) {
+		depth_filters_destroy(f);
+		return NULL;
+	}
+	pthread_mutex_init(&f->lock, NULL);
+	memcpy(f->chain, chain, sizeof(chain));
+	f->count = sizeof(chain) / sizeof(chain[0]);
+
+	return f;
+}
+
+/**
+ *  @brief  "C" Free a filter chain
+ *  @param[in] f   chain, NULL is ignored
+ *  @return none
+*/
+void depth_filters_destroy(struct depth_filters *f)
+{
+	int i;
+
+	if (!f)
+		return;
+	for (i = 0; i < DEPTH_FILTER_MAX_CHAIN; i++)
+		free(f->ring[i]);
+	free(f->state);
+	pthread_mutex_destroy(&f->lock);
+	free(f);
+}
+
+/**
+ *  @brief  "C" Set the filters and their order
+ *  @param[in] f       chain
+ *  @param[in] order   DEPTH_FILTER_xxx, first to last. a filter may be
+ *                     in it more than once
+ *  @param[in] count   up to DEPTH_FILTER_MAX_CHAIN, zero for none
+ *  @return \b zero for success
+ *          \b under zero value indicated the error
+ *  @note   may be called while frames run, the next frame uses it.
+*/
+int depth_filters_set_chain(struct depth_filters *f, const int *order, int count)
+{
+	int i;
+
+	if (!f || count < 0 || count > DEPTH_FILTER_MAX_CHAIN || (count && !order))
+		return VIDEO_ERR_INVALID;
+	for (i = 0; i < count; i++)
+		if (order[i] < 0 || order[i] >= DEPTH_FILTERS)
+			return VIDEO_ERR_INVALID;
+	pthread_mutex_lock(&f->lock);
+	memcpy(f->chain, order, count * sizeof(int));
+	f->count = count;
+	pthread_mutex_unlock(&f->lock);
+
+	return 0;
+}
+
+/**
+ *  @brief  "C" Set the thresholds
+ *  @param[in] f     chain
+ *  @param[in] cfg   thresholds
+ *  @return \b zero for success
+ *          \b under zero value indicated the error
+ *  @note   may be called while frames run, the next frame uses them.
+*/
+int depth_filters_set_config(struct depth_filters *f, const struct depth_filter_config *cfg)
+{
+	if (!f || !cfg)
+		return VIDEO_ERR_INVALID;
+	pthread_mutex_lock(&f->lock);
+	f->cfg = *cfg;
+	pthread_mutex_unlock(&f->lock);
+
+	return 0;
+}
+
+/**
+ *  @brief  "C" Name of a filter
+ *  @param[in] filter   DEPTH_FILTER_xxx
+ *  @return \b name, NULL for an unknown filter
+*/
+const char *depth_filter_name(int filter)
+{
+	if (filter < 0 || filter >= DEPTH_FILTERS)
+		return NULL;
+
+	return filters[filter].name;
+}
+
+/**
+ *  @brief  "C" Run the chain on a depth map, in place
+ *  @param[in]     f            chain
+ *  @param[in,out] depth        width x height, mm, zero for no depth
+ *  @param[in]     amplitude    for DEPTH_FILTER_AMPLITUDE, NULL skips it
+ *  @param[in,out] confidence   zeroed where the chain removed depth, may
+ *                              be NULL. a filled hole keeps its zero
+ *  @return \b zero for success
+ *          \b under zero value indicated the error
+ *  @note   one frame at a time per chain, DEPTH_FILTER_TEMPORAL keeps the
+ *          last frame's output.
+*/
+int depth_filters_run(struct depth_filters *f, unsigned short *depth, const unsigned short *amplitude,
+		      unsigned char *confidence)
+{
+	struct filter_stage stages[DEPTH_FILTER_MAX_CHAIN], *st;
+	struct depth_filter_config cfg;
+	const unsigned short *rows[2 * FILTER_MAX_RADIUS + 1];
+	const int h = f ? f->height : 0, w = f ? f->width : 0;
+	unsigned long long t, total = 0;
+	int count, s, y, end, limit, i;
+
+	if (!f || !depth)
+		return VIDEO_ERR_INVALID;
+	pthread_mutex_lock(&f->lock);
+	cfg = f->cfg;
+	count = f->count;
+	for (s = 0; s < count; s++) {
+		stages[s].filter = f->chain[s];
+		stages[s].row = filters[f->chain[s]].row;
+		stages[s].radius = filters[f->chain[s]].radius;
+		stages[s].next_row = 0;
+		stages[s].loaded = -stages[s].radius;
+		stages[s].ns = 0;
+	}
+	pthread_mutex_unlock(&f->lock);
+
+	/* every pass over the stages moves each one a strip on, as far as
+	   the rows written by the one before allow */
+	while (count && stages[count - 1].next_row < h) {
+		for (s = 0; s < count; s++) {
+			st = &stages[s];
+			limit = s ? stages[s - 1].next_row : h;
+			if (limit < h)
+				limit -= st->radius;
+			end = st->next_row + FILTER_STRIP_ROWS;
+			if (end > limit)
+				end = limit;
+			if (end <= st->next_row)
+				continue;
+			t = now_ns();
+			for (y = st->next_row; y < end; y++) {
+				if (st->radius) {
+					while (st->loaded <= y + st->radius)
+						ring_load(f, s, st, depth, st->loaded++);
+					/* row y + i - radius is in slot (y + i) % (2 * radius + 1) */
+					for (i = 0; i <= 2 * st->radius; i++)
+						rows[i] = f->ring[s] + ((y + i) % (2 * st->radius + 1)) *
+							  (w + 2 * st->radius) + st->radius;
+				} else {
+					rows[0] = depth + (size_t)y * w;
+				}
+				st->row(&cfg, rows, depth + (size_t)y * w,
+					amplitude ? amplitude + (size_t)y * w : NULL,
+					f->state + (size_t)y * w, w);
+			}
+			st->next_row = end;
+			st->ns += now_ns() - t;
+		}
+	}
+	if (confidence)
+		for (i = 0; i < w * h; i++)
+			confidence[i] = depth[i] ? confidence[i] : 0;
+
+	pthread_mutex_lock(&f->lock);
+	for (s = 0; s < count; s++) {
+		struct depth_filter_stats *ds = &f->stats;
+
+		ds->runs[stages[s].filter]++;
+		ds->ns_sum[stages[s].filter] += stages[s].ns;
+		if (stages[s].ns > ds->ns_max[stages[s].filter])
+			ds->ns_max[stages[s].filter] = stages[s].ns;
+		total += stages[s].ns;
+	}
+	f->stats.frames++;
+	f->stats.ns_total += total;
+	pthread_mutex_unlock(&f->lock);
+
+	return 0;
+}
+
+/**
+ *  @brief  "C" Read the time each filter takes
+ *  @param[in]  f       chain
+ *  @param[out] stats   counters, by DEPTH_FILTER_xxx
+ *  @return \b zero for success
+ *          \b under zero value indicated the error
+*/
+int depth_filters_get_stats(struct depth_filters *f, struct depth_filter_stats *stats)
+{
+	if (!f || !stats)
+		return VIDEO_ERR_INVALID;
+	pthread_mutex_lock(&f->lock);
+	*stats = f->stats;
+	pthread_mutex_unlock(&f->lock);
+
+	return 0;
+}
@@ -0,0 +1,273 @@
+/**
+ * Copyright(c) 2020 I4VINE Inc.,
+ *
+ *  @file  frame_api.c
+ *  @brief reference counted frames shared by the pipeline stages.
+ *
+ * A pool owns count page aligned buffers of one size. A stage takes a
+ * free frame, fills it and passes the pointer on; every stage that keeps
+ * the frame holds a reference. The frame goes back to the pool when the
+ * last reference drops, so capture, pairing, uvc fill and callbacks all
+ * read the one copy.
+ *
+ * The buffers are cut from one arena mapped at startup, sized by the
+ * caller from the negotiated format. It can sit on huge pages, so a frame
+ * costs one or two TLB entries instead of hundreds, and it is faulted in
+ * (and optionally locked) before streaming instead of on the first frames.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <sys/mman.h>
+#include <linux/videodev2.h>
+
+#include <capis.h>
+
+struct frame_pool {
+	pthread_mutex_t lock;
+	int count;
+	int num_free;
+	int *free_list;			/* stack of free frame indexes */
+	void *arena;
+	size_t arena_size;
+	struct pool_frame *frames;
+	struct frame_pool_stats stats;
+};
+
+/* huge page size of arm64 (4K granule) and x86 */
+#define FRAME_HUGE_PAGE	(2UL << 20)
+
+static unsigned long long now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/**
+ *  @brief  map the arena, huge pages first when asked
+ *  @return \b mapping, backing set
+ *          \b MAP_FAILED when out of memory
+*/
+static void *map_arena(size_t *size, int flags, int *backing)
+{
+	size_t huge = (*size + FRAME_HUGE_PAGE - 1) & ~(FRAME_HUGE_PAGE - 1);
+	void *p;
+
+	*backing = FRAME_POOL_PAGES;
+	if (flags & FRAME_POOL_HUGEPAGE) {
+		/* needs reserved pages, vm.nr_hugepages */
+		p = mmap(NULL, huge, PROT_READ | PROT_WRITE,
+			 MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (p != MAP_FAILED) {
+			*size = huge;
+			*backing = FRAME_POOL_HUGETLB;
+			return p;
+		}
+		DBGINFO("no hugetlb pages for %zu bytes, trying thp\n", huge);
+	}
+	p = mmap(NULL, *size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED)
+		return p;
+#ifdef MADV_HUGEPAGE
+	if ((flags & FRAME_POOL_HUGEPAGE) && madvise(p, *size, MADV_HUGEPAGE) == 0)
+		*backing = FRAME_POOL_THP;
+#endif
+
+	return p;
+}
+
+/**
+ *  @brief  "C" Make a pool of frames
+ *  @param[in] count   number of frames
+ *  @param[in] length  bytes of each frame, get_video_frame_size of the
+ *                     stream it holds
+ *  @param[in] flags   FRAME_POOL_HUGEPAGE, FRAME_POOL_LOCK or zero
+ *  @return \b pool
+ *          \b NULL when out of memory
+ *  @note   the arena is prefaulted here either way. huge pages fall back
+ *          to transparent huge pages, then to base pages, and a failed
+ *          mlock (RLIMIT_MEMLOCK) only leaves the arena unlocked; see
+ *          get_frame_pool_stats for what was given.
+ *  @see    destroy_frame_pool
+*/
+struct frame_pool *create_frame_pool(int count, unsigned int length, int flags)
+{
+	struct frame_pool *pool;
+	long page = sysconf(_SC_PAGESIZE);
+	unsigned int stride;
+	unsigned long long t;
+	size_t off;
+	int i;
+
+	if (count <= 0 || !length)
+		return NULL;
+	pool = (struct frame_pool *)calloc(1, sizeof(*pool));
+	if (!pool)
+		return NULL;
+	pool->free_list = (int *)calloc(count, sizeof(int));
+	pool->frames = (struct pool_frame *)calloc(count, sizeof(struct pool_frame));
+	/* page aligned frames, they may be given to a driver as USERPTR */
+	stride = (length + page - 1) & ~(page - 1);
+	pool->arena_size = (size_t)stride * count;
+	pool->arena = MAP_FAILED;
+	if (pool->free_list && pool->frames)
+		pool->arena = map_arena(&pool->arena_size, flags, &pool->stats.backing);
+	if (pool->arena == MAP_FAILED) {
+		free(pool->free_list);
+		free(pool->frames);
+		free(pool);
+		return NULL;
+	}
+
+	/* fault every page now, not on the first frames */
+	t = now_us();
+	for (off = 0; off < pool->arena_size; off += page)
+		((volatile char *)pool->arena)[off] = 0;
+	if ((flags & FRAME_POOL_LOCK) && mlock(pool->arena, pool->arena_size) == 0)
+		pool->stats.locked = 1;
+	else if (flags & FRAME_POOL_LOCK)
+		DBGERROR("frame pool not locked, %zu bytes over RLIMIT_MEMLOCK?\n", pool->arena_size);
+	pool->stats.prefault_us = now_us() - t;
+
+	pthread_mutex_init(&pool->lock, NULL);
+	pool->count = count;
+	for (i = 0; i < count; i++) {
+		pool->frames[i].data = (char *)pool->arena + (size_t)stride * i;
+		pool->frames[i].length = length;
+		pool->frames[i].index = i;
+		pool->frames[i].pool = pool;
+		/* lowest index on top, the same few frames stay warm in cache */
+		pool->free_list[i] = count - 1 - i;
+	}
+	pool->num_free = count;
+	pool->stats.count = count;
+	pool->stats.bytes = pool->arena_size;
+
+	return pool;
+}
+
+/**
+ *  @brief  "C" Free a pool and its arena
+ *  @param[in] pool   pool from create_frame_pool, NULL is ignored
+ *  @return none
+ *  @note   every frame should be back. a frame still held is reported,
+ *          its memory is unmapped anyway.
+*/
+void destroy_frame_pool(struct frame_pool *pool)
+{
+	if (!pool)
+		return;
+	if (pool->num_free != pool->count)
+		DBGERROR("frame pool destroyed with %d frames in use\n", pool->count - pool->num_free);
+	munmap(pool->arena, pool->arena_size);
+	pthread_mutex_destroy(&pool->lock);
+	free(pool->free_list);
+	free(pool->frames);
+	free(pool);
+}
+
+/**
+ *  @brief  "C" Take a free frame
+ *  @param[in] pool   frame pool
+ *  @return \b frame with one reference, bytesused zero
+ *          \b NULL when every frame is held, counted as exhausted
+*/
+struct pool_frame *get_pool_frame(struct frame_pool *pool)
+{
+	struct pool_frame *frame = NULL;
+	int in_use;
+
+	if (!pool)
+		return NULL;
+	pthread_mutex_lock(&pool->lock);
+	pool->stats.gets++;
+	if (pool->num_free == 0) {
+		pool->stats.exhausted++;
+	} else {
+		frame = &pool->frames[pool->free_list[--pool->num_free]];
+		in_use = pool->count - pool->num_free;
+		if (in_use > pool->stats.max_in_use)
+			pool->stats.max_in_use = in_use;
+	}
+	pthread_mutex_unlock(&pool->lock);
+	if (frame) {
+		frame->bytesused = 0;
+		frame->num_planes = 0;
+		frame->sequence = 0;
+		memset(&frame->timestamp, 0, sizeof(frame->timestamp));
+		__atomic_store_n(&frame->refs, 1, __ATOMIC_RELAXED);
+	}
+
+	return frame;
+}
+
+/**
+ *  @brief  "C" Hold one more reference
+ *  @param[in] frame  frame held by the caller
+ *  @return \b frame, for passing it on in one expression
+ *  @note   only a holder may add a reference. a frame reached through a
+ *          pointer another thread may drop needs that thread's lock.
+*/
+struct pool_frame *ref_pool_frame(struct pool_frame *frame)
+{
+	if (frame)
+		__atomic_add_fetch(&frame->refs, 1, __ATOMIC_RELAXED);
+
+	return frame;
+}
+
+/**
+ *  @brief  "C" Drop a reference, the last one gives the frame back
+ *  @param[in] frame  frame held by the caller, NULL is ignored
+ *  @return none
+*/
+void unref_pool_frame(struct pool_frame *frame)
+{
+	struct frame_pool *pool;
+
+	if (!frame)
+		return;
+	/* release: our writes to the frame are done before it is reused */
+	if (__atomic_sub_fetch(&frame->refs, 1, __ATOMIC_ACQ_REL) != 0)
+		return;
+	pool = frame->pool;
+	pthread_mutex_lock(&pool->lock);
+	pool->free_list[pool->num_free++] = frame->index;
+	pthread_mutex_unlock(&pool->lock);
+}
+
+/**
+ *  @brief  "C" Time since a capture timestamp
+ *  @param[in] ts   frame timestamp, CLOCK_MONOTONIC as v4l2 gives it
+ *  @return \b micro seconds, under zero for a stamp ahead of now
+*/
+long long frame_age_us(const struct timeval *ts)
+{
+	return (long long)now_us() - ((long long)ts->tv_sec * 1000000 + ts->tv_usec);
+}
+
+/**
+ *  @brief  "C" Read the pool counters
+ *  @param[in]  pool   frame pool
+ *  @param[out] stats  counters
+ *  @return \b zero for success
+ *          \b under zero value indicated the error
+*/
+int get_frame_pool_stats(struct frame_pool *pool, struct frame_pool_stats *stats)
+{
+	if (!pool || !stats)
+		return VIDEO_ERR_INVALID;
+	pthread_mutex_lock(&pool->lock);
+	*stats = pool->stats;
+	stats->in_use = pool->count - pool->num_free;
+	pthread_mutex_unlock(&pool->lock);
+
+	return 0;
+}
@@ -3,10 +3,31 @@
 
 #include "object.hpp"
 
+/*
+ * A listener gets each event on a worker thread of the application, never
+ * on the thread that made it, and holds a reference to it while it runs.
+ */
 struct IListener : virtual  public TObject {
-	virtual void eventFired(void *data) = 0;
+	virtual void eventFired(Object event) = 0;
 };
 
 DECLARE_CTK_INTERFACE(Listener, Object);
 
+/* What a listener's full queue does with a new event */
+enum listener_policy {
+	LISTENER_DROP_OLDEST,		/* the oldest queued event goes, e.g. a preview */
+	LISTENER_DROP_NEWEST,		/* the new event goes */
+	LISTENER_BLOCK,			/* the application waits, nothing is lost */
+};
+
+/* Counters of one listener */
+struct listener_stats {
+	unsigned long long fired;	/* events given to eventFired */
+	unsigned long long dropped;	/* events its policy dropped */
+	unsigned long long latency_us_sum;	/* queued to eventFired returned */
+	unsigned long long latency_us_max;
+	unsigned int queued;
+	unsigned int max_queued;
+};
+
 #endif
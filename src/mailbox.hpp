@@ -0,0 +1,88 @@
+/**
+ * Copyright(c) 2020 I4VINE Inc.,
+ *
+ *  @file  mailbox.hpp
+ *  @brief latest wins hand-off between one producer and one consumer.
+ *
+ * A triple buffer: the producer fills its back slot and swaps it with the
+ * middle one, the consumer swaps its front slot with the middle one when
+ * that holds something new. Neither side ever waits for the other, the
+ * consumer always gets the newest published slot, and a slot published
+ * over before it was taken comes back to the producer as superseded.
+*/
+#ifndef __MAILBOX_HPP__
+#define __MAILBOX_HPP__
+
+#include <stddef.h>
+#include <atomic>
+
+/* Counters of a mailbox, readable from any thread */
+struct mailbox_stats {
+	unsigned long long published;
+	unsigned long long taken;
+	unsigned long long superseded;	/* published over before taken */
+};
+
+template <class T>
+class TMailbox {
+private:
+	enum { FRESH = 4 };		/* middle holds a slot not taken yet */
+
+	T slots[3];
+	/* producer and consumer lines apart, they are written by different cores */
+	alignas(64) unsigned int back;	/* producer's */
+	std::atomic<unsigned long long> published;
+	std::atomic<unsigned long long> superseded;
+	alignas(64) unsigned int front;	/* consumer's */
+	std::atomic<unsigned long long> taken;
+	alignas(64) std::atomic<unsigned int> middle;	/* slot index | FRESH */
+
+public:
+	TMailbox() : slots(), back(0), published(0), superseded(0), front(1), taken(0), middle(2) {}
+
+	/** @brief  producer: the slot to fill, always there */
+	T *producerSlot() { return &slots[back]; }
+
+	/**
+	 *  @brief  producer: make the filled slot the newest
+	 *  @return \b the slot it replaced when the consumer never took it,
+	 *             the producer drops its contents before filling it again
+	 *          \b NULL otherwise
+	 */
+	T *publish()
+	{
+		unsigned int old = middle.exchange(back | FRESH, std::memory_order_acq_rel);
+
+		published.fetch_add(1, std::memory_order_relaxed);
+		back = old & ~FRESH;
+		if (!(old & FRESH))
+			return NULL;
+		superseded.fetch_add(1, std::memory_order_relaxed);
+		return &slots[back];
+	}
+
+	/**
+	 *  @brief  consumer: the newest slot not taken yet
+	 *  @return \b slot, the consumer's until its next take()
+	 *          \b NULL when nothing was published since the last take()
+	 *  @note   the consumer should drop a slot's contents before it takes
+	 *          the next one, the slot goes back to the producer then.
+	 */
+	T *take()
+	{
+		if (!(middle.load(std::memory_order_relaxed) & FRESH))
+			return NULL;
+		front = middle.exchange(front, std::memory_order_acq_rel) & ~FRESH;
+		taken.fetch_add(1, std::memory_order_relaxed);
+		return &slots[front];
+	}
+
+	void getStats(struct mailbox_stats *st) const
+	{
+		st->published = published.load(std::memory_order_relaxed);
+		st->taken = taken.load(std::memory_order_relaxed);
+		st->superseded = superseded.load(std::memory_order_relaxed);
+	}
+};
+
+#endif
@@ -0,0 +1,481 @@
+/**
+ * Copyright(c) 2020 I4VINE Inc.,
+ *
+ *  @file  media_api.c
+ *  @brief media controller pipeline setup.
+ *
+ * Sensors behind an ISP are configured pad by pad on their subdevs. The
+ * video node alone (S_CROP, S_FMT) lets the ISP scale whatever the sensor
+ * happens to run at, so the pipeline is set up here first: the sensor
+ * gets its native or binned mode closest to the wanted frame and every
+ * pad up to the video node carries that mode unchanged.
+ *
+ * Drivers without subdevs (vivid, uvcvideo) have a video node only, the
+ * setup then just enumerates the graph and leaves the sizes alone.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <linux/media.h>
+#include <linux/v4l2-subdev.h>
+#include <linux/v4l2-mediabus.h>
+#include <linux/videodev2.h>
+
+#include <capis.h>
+
+#define MAX_MEDIA_DEVICES	4
+#define MAX_MEDIA_ENTITIES	64
+/* video node to sensor, longer chains are a broken graph */
+#define MAX_PIPELINE_HOPS	16
+
+struct media_entity {
+	struct media_entity_desc info;
+	struct media_pad_desc *pads;
+	struct media_link_desc *links;
+	char devnode[64];		/* "" for entities without a node */
+};
+
+struct media_graph {
+	int fd;
+	struct media_device_info info;
+	int num_entities;
+	struct media_entity entities[MAX_MEDIA_ENTITIES];
+};
+
+/* one hop of the pipeline, entity with the pads the stream uses */
+struct media_hop {
+	struct media_entity *entity;
+	int sink_pad;			/* -1 for the sensor */
+	int source_pad;			/* -1 for the video node */
+};
+
+static struct media_graph *graphs[MAX_MEDIA_DEVICES];
+
+static struct media_graph *get_graph(int media)
+{
+	if (media < 0 || media >= MAX_MEDIA_DEVICES)
+		return NULL;
+	return graphs[media];
+}
+
+/* /dev name of a char device from sysfs, udev may have renamed it */
+static void find_devnode(struct media_entity *e)
+{
+	char path[64], line[64];
+	FILE *fp;
+
+	e->devnode[0] = 0;
+	if (!e->info.dev.major && !e->info.dev.minor)
+		return;
+	snprintf(path, sizeof(path), "/sys/dev/char/%u:%u/uevent", e->info.dev.major, e->info.dev.minor);
+	fp = fopen(path, "r");
+	if (!fp)
+		return;
+	while (fgets(line, sizeof(line), fp)) {
+		if (!strncmp(line, "DEVNAME=", 8)) {
+			/* a name fgets cut is a wrong path, better none */
+			if (line[strcspn(line, "\n")] || feof(fp)) {
+				line[strcspn(line, "\n")] = 0;
+				if (snprintf(e->devnode, sizeof(e->devnode), "/dev/%s", line + 8) >=
+				    (int)sizeof(e->devnode))
+					e->devnode[0] = 0;
+			}
+			break;
+		}
+	}
+	fclose(fp);
+}
+
+static struct media_entity *find_entity(struct media_graph *g, unsigned int id)
+{
+	int i;
+
+	for (i = 0; i < g->num_entities; i++)
+		if (g->entities[i].info.id == id)
+			return &g->entities[i];
+	return NULL;
+}
+
+static void free_graph(struct media_graph *g)
+{
+	int i;
+
+	for (i = 0; i < g->num_entities; i++) {
+		free(g->entities[i].pads);
+		free(g->entities[i].links);
+	}
+	if (g->fd >= 0)
+		close(g->fd);
+	free(g);
+}
+
+static int enum_graph(struct media_graph *g)
+{
+	struct media_entity *e;
+	struct media_links_enum links;
+	unsigned int id = 0;
+
+	for (;;) {
+		if (g->num_entities == MAX_MEDIA_ENTITIES) {
+			DBGERROR("media graph has more than %d entities\n", MAX_MEDIA_ENTITIES);
+			return -1;
+		}
+		e = &g->entities[g->num_entities];
+		memset(e, 0, sizeof(*e));
+		e->info.id = id | MEDIA_ENT_ID_FLAG_NEXT;
+		if (ioctl(g->fd, MEDIA_IOC_ENUM_ENTITIES, &e->info) < 0) {
+			if (errno == EINVAL)
+				break;
+			DBGERROR("MEDIA_IOC_ENUM_ENTITIES error %d, %s\n", errno, strerror(errno));
+			return -1;
+		}
+		id = e->info.id;
+		g->num_entities++;
+
+		/* at least one element so calloc never gives NULL for success */
+		e->pads = calloc(e->info.pads + 1, sizeof(*e->pads));
+		e->links = calloc(e->info.links + 1, sizeof(*e->links));
+		if (!e->pads || !e->links)
+			return -1;
+		memset(&links, 0, sizeof(links));
+		links.entity = e->info.id;
+		links.pads = e->pads;
+		links.links = e->links;
+		if (ioctl(g->fd, MEDIA_IOC_ENUM_LINKS, &links) < 0) {
+			DBGERROR("MEDIA_IOC_ENUM_LINKS error %d, %s\n", errno, strerror(errno));
+			return -1;
+		}
+		find_devnode(e);
+	}
+
+	return 0;
+}
+
+/**
+ *  @brief  "C" open a media device and read its graph
+ *  @param[in] dev_name  media node, e.g. "/dev/media0"
+ *  @return \b media value for the other media calls
+ *          \b under zero value indicated the error
+ *  @see    setup_media_pipeline, close_media_device
+*/
+int open_media_device(const char *dev_name)
+{
+	struct media_graph *g;
+	int media;
+
+	for (media = 0; media < MAX_MEDIA_DEVICES; media++)
+		if (!graphs[media])
+			break;
+	if (media == MAX_MEDIA_DEVICES)
+		return -1;
+
+	g = calloc(1, sizeof(*g));
+	if (!g)
+		return -1;
+	g->fd = open(dev_name, O_RDWR);
+	if (g->fd < 0) {
+		DBGERROR("Media device open failed(%s).\n", dev_name);
+		free(g);
+		return -1;
+	}
+	if (ioctl(g->fd, MEDIA_IOC_DEVICE_INFO, &g->info) < 0) {
+		DBGERROR("%s is no media device\n", dev_name);
+		free_graph(g);
+		return -1;
+	}
+	if (enum_graph(g)) {
+		free_graph(g);
+		return -1;
+	}
+	DBGINFO("media %s: driver %s model %s, %d entities\n", dev_name,
+		g->info.driver, g->info.model, g->num_entities);
+	graphs[media] = g;
+
+	return media;
+}
+
+/**
+ *  @brief  "C" close a media device
+ *  @param[in] media  media value from open_media_device
+ *  @return none
+ *  @note   the pipeline stays configured.
+*/
+void close_media_device(int media)
+{
+	struct media_graph *g = get_graph(media);
+
+	if (!g)
+		return;
+	graphs[media] = NULL;
+	free_graph(g);
+}
+
+/**
+ *  @brief  "C" print entities, pads and links of a media device
+ *  @param[in] media  media value from open_media_device
+ *  @return \b zero for success
+ *          \b under zero value indicated the error
+*/
+int print_media_graph(int media)
+{
+	struct media_graph *g = get_graph(media);
+	struct media_entity *e, *peer;
+	struct media_link_desc *l;
+	int i, j;
+
+	if (!g)
+		return -1;
+	DBGPRINT("media %s (%s), %d entities\n", g->info.model, g->info.driver, g->num_entities);
+	for (i = 0; i < g->num_entities; i++) {
+		e = &g->entities[i];
+		DBGPRINT("- %u \"%s\" type 0x%x, %u pads %s\n", e->info.id, e->info.name,
+			 e->info.type, e->info.pads, e->devnode);
+		for (j = 0; j < e->info.links; j++) {
+			l = &e->links[j];
+			/* every link is listed by both ends, print it at the source */
+			if (l->source.entity != e->info.id)
+				continue;
+			peer = find_entity(g, l->sink.entity);
+			DBGPRINT("    pad%u -> \"%s\":%u [%s%s]\n", l->source.index,
+				 peer ? peer->info.name : "?", l->sink.index,
+				 (l->flags & MEDIA_LNK_FL_ENABLED) ? "ENABLED" : "",
+				 (l->flags & MEDIA_LNK_FL_IMMUTABLE) ? ",IMMUTABLE" : "");
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Link feeding sink pad `pad` of `e`. An enabled one wins, else the first
+ * one that can be enabled.
+ */
+static struct media_link_desc *upstream_link(struct media_entity *e, int pad)
+{
+	struct media_link_desc *found = NULL;
+	int i;
+
+	for (i = 0; i < e->info.links; i++) {
+		struct media_link_desc *l = &e->links[i];
+
+		if ((l->flags & MEDIA_LNK_FL_LINK_TYPE) != MEDIA_LNK_FL_DATA_LINK)
+			continue;
+		if (l->sink.entity != e->info.id || (pad >= 0 && l->sink.index != pad))
+			continue;
+		if (l->flags & MEDIA_LNK_FL_ENABLED)
+			return l;
+		if (!found)
+			found = l;
+	}
+
+	return found;
+}
+
+static int enable_link(struct media_graph *g, struct media_link_desc *l)
+{
+	struct media_link_desc desc;
+
+	if (l->flags & MEDIA_LNK_FL_ENABLED)
+		return 0;
+	desc = *l;
+	desc.flags |= MEDIA_LNK_FL_ENABLED;
+	if (ioctl(g->fd, MEDIA_IOC_SETUP_LINK, &desc) < 0) {
+		DBGERROR("MEDIA_IOC_SETUP_LINK error %d, %s\n", errno, strerror(errno));
+		return -1;
+	}
+	l->flags = desc.flags;
+
+	return 0;
+}
+
+/* walk from the video node up to the sensor, hops[0] is the video node */
+static int find_pipeline(struct media_graph *g, struct media_entity *video, struct media_hop *hops)
+{
+	struct media_link_desc *l;
+	struct media_entity *e = video;
+	int n = 0;
+
+	hops[0].entity = video;
+	hops[0].source_pad = -1;
+	for (;;) {
+		l = upstream_link(e, -1);
+		if (!l) {
+			/* no sink pad fed by anything, this is the source */
+			hops[n].sink_pad = -1;
+			return n + 1;
+		}
+		if (n + 1 == MAX_PIPELINE_HOPS) {
+			DBGERROR("media pipeline longer than %d\n", MAX_PIPELINE_HOPS);
+			return -1;
+		}
+		if (enable_link(g, l))
+			return -1;
+		hops[n].sink_pad = l->sink.index;
+		e = find_entity(g, l->source.entity);
+		if (!e)
+			return -1;
+		n++;
+		hops[n].entity = e;
+		hops[n].source_pad = l->source.index;
+	}
+}
+
+static int subdev_fmt(int fd, int request, int pad, struct v4l2_mbus_framefmt *fmt)
+{
+	struct v4l2_subdev_format sfmt;
+
+	memset(&sfmt, 0, sizeof(sfmt));
+	sfmt.which = V4L2_SUBDEV_FORMAT_ACTIVE;
+	sfmt.pad = pad;
+	if (request == VIDIOC_SUBDEV_S_FMT)
+		sfmt.format = *fmt;
+	if (ioctl(fd, request, &sfmt) < 0)
+		return -1;
+	*fmt = sfmt.format;
+
+	return 0;
+}
+
+/*
+ * Sensor mode for the wanted frame: exact if there is one, else the
+ * smallest covering it, else the largest. Step/continuous ranges clamp.
+ */
+static void pick_sensor_mode(int fd, int pad, unsigned int code,
+			     unsigned int width, unsigned int height,
+			     unsigned int *mode_w, unsigned int *mode_h)
+{
+	struct v4l2_subdev_frame_size_enum fse;
+	unsigned int w, h, best_w = 0, best_h = 0;
+	unsigned long long area, best = 0;
+	int covers, best_covers = 0;
+
+	memset(&fse, 0, sizeof(fse));
+	fse.pad = pad;
+	fse.code = code;
+	fse.which = V4L2_SUBDEV_FORMAT_ACTIVE;
+	for (fse.index = 0; ioctl(fd, VIDIOC_SUBDEV_ENUM_FRAME_SIZE, &fse) >= 0; fse.index++) {
+		w = width < fse.min_width ? fse.min_width : width > fse.max_width ? fse.max_width : width;
+		h = height < fse.min_height ? fse.min_height : height > fse.max_height ? fse.max_height : height;
+		if (w == width && h == height) {
+			best_w = w;
+			best_h = h;
+			break;
+		}
+		covers = w >= width && h >= height;
+		area = (unsigned long long)w * h;
+		if (!best_w || covers > best_covers ||
+		    (covers == best_covers && (covers ? area < best : area > best))) {
+			best_covers = covers;
+			best = area;
+			best_w = w;
+			best_h = h;
+		}
+	}
+	if (best_w) {
+		*mode_w = best_w;
+		*mode_h = best_h;
+	}
+}
+
+/**
+ *  @brief  "C" set up the subdev pipeline in front of a capture module
+ *  @param[in] media   media value from open_media_device
+ *  @param[in] module  video module whose node is in the media graph
+ *  @param[in] width   wanted frame, e.g. the negotiated uvc frame
+ *  @param[in] height
+ *  @return \b zero for success
+ *          \b under zero value indicated the error
+ *  @note   call before init_video_device. Links from the video node up to
+ *          the sensor are enabled, the sensor runs its native or binned
+ *          mode closest to width x height and that mode is carried on
+ *          every pad. Only the last subdev is asked for width x height,
+ *          so any remaining resize happens once, next to memory.
+*/
+int setup_media_pipeline(int media, int module, int width, int height)
+{
+	struct media_graph *g = get_graph(media);
+	struct media_hop hops[MAX_PIPELINE_HOPS];
+	struct media_entity *video = NULL;
+	struct v4l2_mbus_framefmt fmt;
+	struct stat st;
+	const char *dev_name;
+	unsigned int mode_w, mode_h;
+	int i, n, fd;
+
+	dev_name = get_video_device_name(module);
+	if (!g || !dev_name || stat(dev_name, &st) < 0)
+		return -1;
+	for (i = 0; i < g->num_entities; i++) {
+		if (g->entities[i].info.dev.major == major(st.st_rdev) &&
+		    g->entities[i].info.dev.minor == minor(st.st_rdev))
+			video = &g->entities[i];
+	}
+	if (!video) {
+		DBGERROR("%s is not in media graph %s\n", dev_name, g->info.model);
+		return -1;
+	}
+	n = find_pipeline(g, video, hops);
+	if (n < 0)
+		return -1;
+	if (n == 1) {
+		DBGINFO("%s has no subdevs, nothing to set up\n", dev_name);
+		return 0;
+	}
+
+	/* the sensor: native mode first */
+	fd = open(hops[n - 1].entity->devnode, O_RDWR);
+	if (fd < 0) {
+		DBGERROR("subdev open failed(%s).\n", hops[n - 1].entity->devnode);
+		return -1;
+	}
+	if (subdev_fmt(fd, VIDIOC_SUBDEV_G_FMT, hops[n - 1].source_pad, &fmt) < 0)
+		goto err;
+	mode_w = fmt.width;
+	mode_h = fmt.height;
+	pick_sensor_mode(fd, hops[n - 1].source_pad, fmt.code, width, height, &mode_w, &mode_h);
+	fmt.width = mode_w;
+	fmt.height = mode_h;
+	if (subdev_fmt(fd, VIDIOC_SUBDEV_S_FMT, hops[n - 1].source_pad, &fmt) < 0)
+		goto err;
+	close(fd);
+	DBGINFO("\"%s\" mode %ux%u for %dx%d\n", hops[n - 1].entity->info.name,
+		fmt.width, fmt.height, width, height);
+
+	/* downstream subdevs take what comes in, hop 0 is the video node */
+	for (i = n - 2; i > 0; i--) {
+		struct v4l2_mbus_framefmt out;
+
+		fd = open(hops[i].entity->devnode, O_RDWR);
+		if (fd < 0) {
+			DBGERROR("subdev open failed(%s).\n", hops[i].entity->devnode);
+			return -1;
+		}
+		if (subdev_fmt(fd, VIDIOC_SUBDEV_S_FMT, hops[i].sink_pad, &fmt) < 0)
+			goto err;
+		/* source keeps the code the subdev outputs, e.g. bayer to yuv */
+		if (subdev_fmt(fd, VIDIOC_SUBDEV_G_FMT, hops[i].source_pad, &out) < 0)
+			goto err;
+		out.width = (i == 1) ? (unsigned int)width : fmt.width;
+		out.height = (i == 1) ? (unsigned int)height : fmt.height;
+		if (subdev_fmt(fd, VIDIOC_SUBDEV_S_FMT, hops[i].source_pad, &out) < 0)
+			goto err;
+		close(fd);
+		DBGINFO("\"%s\" %ux%u -> %ux%u\n", hops[i].entity->info.name,
+			fmt.width, fmt.height, out.width, out.height);
+		fmt = out;
+	}
+
+	return 0;
+
+err:
+	DBGERROR("subdev format error %d, %s\n", errno, strerror(errno));
+	close(fd);
+	return -1;
+}
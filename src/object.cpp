@@ -0,0 +1,35 @@
+/**
+ * Copyright(c) 2019 I4VINE Inc.,
+ * All right reserved by Seungwoo Kim <ksw@i4vine.com>
+ *  @file  object.cpp
+ *  @brief reference counting of the root class
+ *
+ * A handle may be the last one on any thread. The decrement releases
+ * the writes made through it and the last one acquires everybody's, so
+ * the destructor sees the object as the other threads left it.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include "object.h"
+
+void TObject::_incref()
+{
+	/* the caller already holds a reference, nothing to order against */
+	f_rc.fetch_add(1, std::memory_order_relaxed);
+}
+
+void TObject::_decref()
+{
+	if (f_rc.fetch_sub(1, std::memory_order_acq_rel) == 1)
+		delete this;
+}
+
+#if !defined(NDEBUG)
+int __ctk_cond = 0;
+
+void __ctk_assert(const char *test, const char *file, int line)
+{
+	fprintf(stderr, "%s:%d: assertion failed: %s\n", file, line, test);
+	abort();
+}
+#endif
@@ -11,13 +11,21 @@
 #ifndef __ctk_object_h
 #define __ctk_object_h
 
+#include <atomic>
+#include <utility>
+
 typedef long long ctklong;
 
+/*
+ * The reference count is atomic, so handles to one object may be made and
+ * dropped on different threads, e.g. a frame passed from capture to uvc.
+ * Only the count is shared safely, the object's own members are not.
+ */
 class TObject {
 	friend class Handle;
 private:
 protected:
-	unsigned int f_rc;
+	std::atomic<unsigned int> f_rc;
 	void _incref();
 	void _decref();
 protected:
@@ -46,6 +54,15 @@ protected:
 	~Handle() { _decref(); }
 	void _assign(TObject* obj) { if(obj) obj->_incref(); _decref(); f_object = obj; }
 	void _assign(const Handle& handle) { handle._incref(); _decref(); f_object = handle.f_object; }
+	/* moves take the reference over, the source is left empty */
+	Handle(Handle&& obj) : f_object(obj.f_object) { obj.f_object = 0; }
+	void _assign(Handle&& handle) {
+		TObject* old = f_object;
+		if (this == &handle) return;
+		f_object = handle.f_object;
+		handle.f_object = 0;
+		if (old) old->_decref();
+	}
 };
 
 class Object : public Handle {
@@ -54,8 +71,10 @@ protected:
 public:
 	Object(TObject* obj = 0) : Handle(obj) {}
 	Object(const Object& obj) : Handle(obj) {}
+	Object(Object&& obj) : Handle(std::move(obj)) {}
 	Object& operator=(TObject* obj) { _assign(obj); return *this; }
 	Object& operator=(const Object& obj) { _assign(obj); return *this; }
+	Object& operator=(Object&& obj) { _assign(std::move(obj)); return *this; }
 	~Object() {}
 	const TObject* operator->() const { return f_object; }
 	TObject* operator->() { return f_object; }
@@ -97,6 +116,8 @@ public:
 	ObjectHandle<T,Object>& operator=(T* obj) { return (ObjectHandle<T,Object>&)Object::operator=(obj); };
 	ObjectHandle(const ObjectHandle<T,Object>& obj) : Object(obj) {};
 	ObjectHandle<T,Object>& operator=(const ObjectHandle<T,Object>& obj) { return (ObjectHandle<T,Object>&)Object::operator=(obj); };
+	ObjectHandle(ObjectHandle<T,Object>&& obj) : Object(std::move(obj)) {};
+	ObjectHandle<T,Object>& operator=(ObjectHandle<T,Object>&& obj) { return (ObjectHandle<T,Object>&)Object::operator=(std::move(obj)); };
 	const T* operator->() const { return dynamic_cast<const T*>(Object::f_object); };
 	T* operator->() { return dynamic_cast<T*>(Object::f_object); };
 	T& operator*() { return dynamic_cast<T&>(*Object::f_object); };
@@ -0,0 +1,212 @@
+/**
+ * Copyright(c) 2020 I4VINE Inc.,
+ *
+ *  @file  pair_api.c
+ *  @brief rgb and depth pairing by capture timestamp.
+ *
+ * The rgb side adds every captured frame to a short history. The depth
+ * side asks for the rgb frame whose timestamp is nearest its own and
+ * gets it only when the two are within the tolerance. Every match
+ * attempt goes into a histogram of signed skew (depth - rgb), so the
+ * tolerance can be set from what the sensors really do.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <linux/videodev2.h>
+
+#include <capis.h>
+
+struct pair_entry {
+	struct pool_frame *frame;
+	long long us;			/* capture timestamp */
+	int used;			/* paired with a depth frame at least once */
+};
+
+struct frame_pairer {
+	pthread_mutex_t lock;
+	int history;
+	int count;
+	int head;			/* next entry to fill, the oldest when full */
+	struct pair_entry *entries;
+	struct pair_stats stats;
+};
+
+static long long tv_us(const struct timeval *tv)
+{
+	return (long long)tv->tv_sec * 1000000 + tv->tv_usec;
+}
+
+/**
+ *  @brief  "C" Make a pairer
+ *  @param[in] history       rgb frames kept to pick from
+ *  @param[in] tolerance_us  largest skew of a pair, zero for the default
+ *  @return \b pairer
+ *          \b NULL when out of memory
+ *  @note   every kept frame holds a reference, size the rgb pool for it.
+*/
+struct frame_pairer *pairer_create(int history, unsigned int tolerance_us)
+{
+	struct frame_pairer *pr;
+
+	if (history <= 0)
+		return NULL;
+	pr = (struct frame_pairer *)calloc(1, sizeof(*pr));
+	if (!pr)
+		return NULL;
+	pr->entries = (struct pair_entry *)calloc(history, sizeof(struct pair_entry));
+	if (!pr->entries) {
+		free(pr);
+		return NULL;
+	}
+	pthread_mutex_init(&pr->lock, NULL);
+	pr->history = history;
+	pairer_set_tolerance(pr, tolerance_us);
+
+	return pr;
+}
+
+/**
+ *  @brief  "C" Free a pairer, dropping the frames it keeps
+ *  @param[in] pr   pairer, NULL is ignored
+ *  @return none
+*/
+void pairer_destroy(struct frame_pairer *pr)
+{
+	int i;
+
+	if (!pr)
+		return;
+	for (i = 0; i < pr->history; i++)
+		unref_pool_frame(pr->entries[i].frame);
+	pthread_mutex_destroy(&pr->lock);
+	free(pr->entries);
+	free(pr);
+}
+
+/**
+ *  @brief  "C" Set the largest skew of a pair, clears the histogram
+ *  @param[in] pr            pairer
+ *  @param[in] tolerance_us  zero for PAIR_DEFAULT_TOLERANCE_US
+ *  @return none
+ *  @note   the histogram spans twice the tolerance each way, the first
+ *          and last bins also take everything beyond.
+*/
+void pairer_set_tolerance(struct frame_pairer *pr, unsigned int tolerance_us)
+{
+	if (!tolerance_us)
+		tolerance_us = PAIR_DEFAULT_TOLERANCE_US;
+	pthread_mutex_lock(&pr->lock);
+	memset(pr->stats.skew_hist, 0, sizeof(pr->stats.skew_hist));
+	pr->stats.tolerance_us = tolerance_us;
+	pr->stats.skew_bin_us = (4 * tolerance_us + PAIR_SKEW_BINS - 1) / PAIR_SKEW_BINS;
+	pthread_mutex_unlock(&pr->lock);
+}
+
+/**
+ *  @brief  "C" Add a captured rgb frame
+ *  @param[in] pr     pairer
+ *  @param[in] frame  frame with its timestamp set, the pairer takes its
+ *                    own reference
+ *  @return none
+ *  @note   the oldest frame leaves the history, counted as unpaired if
+ *          no depth frame matched it.
+*/
+void pairer_add_rgb(struct frame_pairer *pr, struct pool_frame *frame)
+{
+	struct pair_entry *e;
+	struct pool_frame *old;
+
+	ref_pool_frame(frame);
+	pthread_mutex_lock(&pr->lock);
+	e = &pr->entries[pr->head];
+	old = e->frame;
+	if (old && !e->used)
+		pr->stats.unpaired_rgb++;
+	e->frame = frame;
+	e->us = tv_us(&frame->timestamp);
+	e->used = 0;
+	pr->head = (pr->head + 1) % pr->history;
+	if (pr->count < pr->history)
+		pr->count++;
+	pthread_mutex_unlock(&pr->lock);
+	/* the last reference may free it, not under the lock */
+	unref_pool_frame(old);
+}
+
+/**
+ *  @brief  "C" Find the rgb frame of a depth frame
+ *  @param[in] pr   pairer
+ *  @param[in] ts   depth capture timestamp
+ *  @return \b rgb frame nearest in time, with a reference for the caller
+ *          \b NULL when none is within the tolerance, counted as unpaired
+*/
+struct pool_frame *pairer_match(struct frame_pairer *pr, const struct timeval *ts)
+{
+	struct pair_stats *st = &pr->stats;
+	struct pair_entry *best = NULL;
+	struct pool_frame *frame = NULL;
+	long long us = tv_us(ts), skew = 0, d;
+	int i, bin;
+
+	pthread_mutex_lock(&pr->lock);
+	for (i = 0; i < pr->history; i++) {
+		if (!pr->entries[i].frame)
+			continue;
+		d = us - pr->entries[i].us;
+		if (!best || llabs(d) < llabs(skew)) {
+			best = &pr->entries[i];
+			skew = d;
+		}
+	}
+	if (!best) {
+		st->unpaired_depth++;
+		pthread_mutex_unlock(&pr->lock);
+		return NULL;
+	}
+
+	bin = (skew + 2LL * st->tolerance_us) / (long long)st->skew_bin_us;
+	if (skew + 2LL * st->tolerance_us < 0)
+		bin = 0;
+	if (bin >= PAIR_SKEW_BINS)
+		bin = PAIR_SKEW_BINS - 1;
+	st->skew_hist[bin]++;
+	if (st->matches == 0 || skew < st->skew_us_min)
+		st->skew_us_min = skew;
+	if (st->matches == 0 || skew > st->skew_us_max)
+		st->skew_us_max = skew;
+	st->matches++;
+
+	if (llabs(skew) <= st->tolerance_us) {
+		st->paired++;
+		st->skew_us_sum += skew;
+		best->used = 1;
+		frame = ref_pool_frame(best->frame);
+	} else {
+		st->unpaired_depth++;
+	}
+	pthread_mutex_unlock(&pr->lock);
+
+	return frame;
+}
+
+/**
+ *  @brief  "C" Read the pairing counters and skew histogram
+ *  @param[in]  pr      pairer
+ *  @param[out] stats   counters
+ *  @return \b zero for success
+ *          \b under zero value indicated the error
+*/
+int pairer_get_stats(struct frame_pairer *pr, struct pair_stats *stats)
+{
+	if (!pr || !stats)
+		return VIDEO_ERR_INVALID;
+	pthread_mutex_lock(&pr->lock);
+	*stats = pr->stats;
+	pthread_mutex_unlock(&pr->lock);
+
+	return 0;
+}
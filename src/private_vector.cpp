@@ -23,7 +23,7 @@ TVector::trimToSize()
 		Object* oldData = elementData;
 		elementData = new Object[elementCount];
 		for(int i = 0; i < elementCount; i++) {
-			elementData[i] = oldData[i];
+			elementData[i] = std::move(oldData[i]);
 		}
 		delete[] oldData;
 		length = elementCount;
@@ -50,7 +50,7 @@ TVector::ensureCapacityHelper(int minCapacity)
 	}
 	elementData = new Object[newCapacity];
 	for(int i = 0; i < elementCount; i++) {
-		elementData[i] = oldData[i];
+		elementData[i] = std::move(oldData[i]);
 	}
 	length = newCapacity;
 	delete[] oldData;
@@ -97,7 +97,7 @@ TVector::removeElementAt(int index)
 	int j = elementCount - index - 1;
 	if (j > 0) {
 		for(int i = index; i < index+j; i++) {
-			elementData[i] = elementData[i+1];
+			elementData[i] = std::move(elementData[i+1]);
 		}
 	}
 	elementCount--;
@@ -112,7 +112,7 @@ TVector::insertElementAt(Object obj, int index)
 	    ensureCapacityHelper(newcount);
 	}
 	for(int i = elementCount-1; i >= index; i--) {
-		elementData[i+1] = elementData[i];
+		elementData[i+1] = std::move(elementData[i]);
 	}
 	elementData[index] = obj;
 	elementCount++;
@@ -0,0 +1,328 @@
+/**
+ * Copyright(c) 2020 I4VINE Inc.,
+ *
+ *  @file  reactor_api.c
+ *  @brief single epoll loop for capture and uvc gadget i/o.
+ *
+ * One thread waits on every capture fd (POLLIN), the uvc gadget fd
+ * (POLLPRI for usb events, POLLOUT for done buffers) and an eventfd used
+ * to stop the loop. This replaces a select() per dequeue and per gadget
+ * call, and gives one place to measure dispatch latency.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <linux/videodev2.h>
+
+#include <capis.h>
+
+enum {
+	SOURCE_NONE = 0,
+	SOURCE_VIDEO,
+	SOURCE_UVC,
+};
+
+struct reactor_source {
+	int type;
+	int fd;
+	int module;			/* SOURCE_VIDEO */
+	REACTOR_VIDEO_FUNC func;	/* SOURCE_VIDEO */
+	void *arg;
+	struct reactor_stats stats;
+};
+
+static int epfd = -1;
+static int stopfd = -1;
+static int uvc_source = -1;
+static volatile int reactor_done;
+static struct reactor_source sources[REACTOR_MAX_SOURCES];
+
+#define STOP_TOKEN	REACTOR_MAX_SOURCES
+/* how often a silent capture fd is checked for a stall */
+#define WATCHDOG_MS	100
+
+static unsigned long long now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int add_source(int type, int fd, unsigned int events)
+{
+	struct epoll_event ev;
+	int id;
+
+	if (epfd < 0)
+		return -1;
+	for (id = 0; id < REACTOR_MAX_SOURCES; id++)
+		if (sources[id].type == SOURCE_NONE)
+			break;
+	if (id == REACTOR_MAX_SOURCES)
+		return -1;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = events;
+	ev.data.u32 = id;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+		DBGERROR("epoll add fd %d failed %d, %s\n", fd, errno, strerror(errno));
+		return -1;
+	}
+	memset(&sources[id], 0, sizeof(sources[id]));
+	sources[id].type = type;
+	sources[id].fd = fd;
+
+	return id;
+}
+
+/**
+ *  @brief  "C" create the reactor
+ *  @return \b zero for success
+ *          \b under zero value indicated the error
+ *  @see    reactor_run, reactor_close
+*/
+int reactor_init(void)
+{
+	struct epoll_event ev;
+
+	if (epfd >= 0)
+		return 0;
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (epfd < 0) {
+		DBGERROR("epoll_create failed %d, %s\n", errno, strerror(errno));
+		return -1;
+	}
+	stopfd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (stopfd < 0) {
+		DBGERROR("eventfd failed %d, %s\n", errno, strerror(errno));
+		close(epfd);
+		epfd = -1;
+		return -1;
+	}
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.u32 = STOP_TOKEN;
+	epoll_ctl(epfd, EPOLL_CTL_ADD, stopfd, &ev);
+	memset(sources, 0, sizeof(sources));
+	uvc_source = -1;
+	reactor_done = 0;
+
+	return 0;
+}
+
+/**
+ *  @brief  "C" watch a capture module
+ *  @param[in] module  video module, opened and streaming
+ *  @param[in] func    called with module and arg when a frame is ready.
+ *                     it should dequeue exactly one buffer.
+ *  @param[in] arg     handler argument
+ *  @return \b source id for reactor_get_stats
+ *          \b under zero value indicated the error
+ *  @note   dequeue of the module stops waiting by itself, see set_video_wait.
+*/
+int reactor_add_video(int module, REACTOR_VIDEO_FUNC func, void *arg)
+{
+	int id, fd;
+
+	fd = get_fd(module);
+	if (fd < 0 || !func)
+		return -1;
+	id = add_source(SOURCE_VIDEO, fd, EPOLLIN);
+	if (id < 0)
+		return -1;
+	sources[id].module = module;
+	sources[id].func = func;
+	sources[id].arg = arg;
+	set_video_wait(module, 0);
+
+	return id;
+}
+
+/**
+ *  @brief  "C" watch the uvc gadget
+ *  @return \b source id for reactor_get_stats
+ *          \b under zero value indicated the error
+ *  @note   call after init_uvc_gadget_device. The gadget is also serviced
+ *          after every capture dispatch so lent slots get new frames at once.
+*/
+int reactor_add_uvc_gadget(void)
+{
+	int id, fd;
+
+	fd = get_uvc_gadget_fd();
+	if (fd < 0)
+		return -1;
+	id = add_source(SOURCE_UVC, fd, EPOLLPRI | EPOLLOUT);
+	if (id < 0)
+		return -1;
+	uvc_source = id;
+
+	return id;
+}
+
+/**
+ *  @brief  "C" stop watching a source
+ *  @param[in] id  source id from reactor_add_xxx
+ *  @return none
+ *  @note   only from the reactor thread or when it is not running.
+*/
+void reactor_remove(int id)
+{
+	if (id < 0 || id >= REACTOR_MAX_SOURCES || sources[id].type == SOURCE_NONE)
+		return;
+	epoll_ctl(epfd, EPOLL_CTL_DEL, sources[id].fd, NULL);
+	if (sources[id].type == SOURCE_VIDEO)
+		set_video_wait(sources[id].module, 1);
+	if (id == uvc_source)
+		uvc_source = -1;
+	sources[id].type = SOURCE_NONE;
+}
+
+static void dispatch_video(struct reactor_source *src, unsigned long long start)
+{
+	struct reactor_stats *st = &src->stats;
+	struct video_stats vs;
+	unsigned long long frames, lat;
+
+	get_video_stats(src->module, &vs);
+	frames = vs.frames;
+	src->func(src->module, src->arg);
+	get_video_stats(src->module, &vs);
+	if (vs.frames != frames) {
+		/* v4l2 timestamps are CLOCK_MONOTONIC, drop odd ones from old drivers */
+		lat = (unsigned long long)vs.last_timestamp.tv_sec * 1000000 + vs.last_timestamp.tv_usec;
+		if (lat <= start && start - lat < 10000000) {
+			lat = start - lat;
+			st->latency_us_sum += lat;
+			st->latency_count++;
+			if (lat > st->latency_us_max)
+				st->latency_us_max = lat;
+		}
+	}
+}
+
+/**
+ *  @brief  "C" run the reactor in the calling thread
+ *  @return \b zero when stopped by reactor_stop
+ *          \b under zero value indicated the error
+ *  @see    reactor_stop
+*/
+int reactor_run(void)
+{
+	struct epoll_event events[REACTOR_MAX_SOURCES + 1];
+	unsigned long long wake, start, end;
+	int n, i, video;
+
+	if (epfd < 0)
+		return -1;
+	while (!reactor_done) {
+		n = epoll_wait(epfd, events, REACTOR_MAX_SOURCES + 1, WATCHDOG_MS);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			DBGERROR("epoll_wait failed %d, %s\n", errno, strerror(errno));
+			return -1;
+		}
+		/* a stalled stream never makes its fd ready */
+		for (i = 0; i < REACTOR_MAX_SOURCES; i++) {
+			if (sources[i].type == SOURCE_VIDEO && check_video_stall(sources[i].module) < 0)
+				sources[i].stats.errors++;
+		}
+		if (n == 0)
+			continue;
+		wake = now_us();
+		video = 0;
+		for (i = 0; i < n && !reactor_done; i++) {
+			struct reactor_source *src;
+			unsigned int id = events[i].data.u32;
+
+			if (id == STOP_TOKEN)
+				break;
+			src = &sources[id];
+			if (src->type == SOURCE_NONE)
+				continue;
+			if (events[i].events & EPOLLERR) {
+				/* capture fd of a stopped stream, nothing to dequeue */
+				src->stats.errors++;
+				if (src->type == SOURCE_VIDEO)
+					continue;
+			}
+			/* earlier handlers of this wake up delay the later ones */
+			start = now_us();
+			src->stats.dispatches++;
+			src->stats.wait_us_sum += start - wake;
+			if (start - wake > src->stats.wait_us_max)
+				src->stats.wait_us_max = start - wake;
+			if (src->type == SOURCE_VIDEO) {
+				dispatch_video(src, start);
+				video = 1;
+			} else {
+				service_uvc_gadget_device(events[i].events & (EPOLLPRI | EPOLLOUT));
+			}
+			end = now_us();
+			src->stats.busy_us_sum += end - start;
+		}
+		/* a new frame may fill a lent gadget slot right away */
+		if (video && uvc_source >= 0 && !reactor_done)
+			service_uvc_gadget_device(0);
+	}
+
+	return 0;
+}
+
+/**
+ *  @brief  "C" make reactor_run return
+ *  @return none
+ *  @note   safe from any thread and from signal handlers.
+*/
+void reactor_stop(void)
+{
+	uint64_t one = 1;
+
+	reactor_done = 1;
+	/* a full counter still wakes the loop, nothing to do on error */
+	if (stopfd >= 0 && write(stopfd, &one, sizeof(one)) < 0)
+		return;
+}
+
+/**
+ *  @brief  "C" get dispatch counters of a source
+ *  @param[in]  id     source id from reactor_add_xxx
+ *  @param[out] stats  counters since the source was added
+ *  @return \b zero for success
+ *          \b under zero value indicated the error
+*/
+int reactor_get_stats(int id, struct reactor_stats *stats)
+{
+	if (id < 0 || id >= REACTOR_MAX_SOURCES || sources[id].type == SOURCE_NONE)
+		return -1;
+	*stats = sources[id].stats;
+
+	return 0;
+}
+
+/**
+ *  @brief  "C" close the reactor
+ *  @return none
+ *  @note   reactor_run must have returned.
+*/
+void reactor_close(void)
+{
+	int i;
+
+	for (i = 0; i < REACTOR_MAX_SOURCES; i++)
+		reactor_remove(i);
+	if (stopfd >= 0)
+		close(stopfd);
+	if (epfd >= 0)
+		close(epfd);
+	stopfd = epfd = -1;
+}
@@ -39,10 +39,13 @@ void signal_handler(int sig)
 
 void get_rgbd_data(void *data)
 {
+	struct fifo_mem_t *pair = (struct fifo_mem_t *)data;
 		
 //	printf("get_rgbd_data\n");
 #if defined(NETWORK_CLIENT)
-		send(sock_fd, data, 640*480*2, 0);		
+		send(sock_fd, pair->rgb->data, 640*480*2, 0);		
+#else
+	(void)pair;
 #endif		
 	
 }
@@ -50,7 +53,6 @@ void get_rgbd_data(void *data)
 extern FILE *dfp;
 int main(void)
 {
-	struct v4l2_buffer buf;	
 	int ret=0;
 	c = new TRGBDClass(4);
 #if defined(NETWORK_CLIENT)
@@ -87,12 +89,9 @@ int main(void)
 
 	c->RegisterCallback((void*)get_rgbd_data);
 	
+	/* the capture thread runs the depth frames through runner */
 	while(!c->thr_data.g_depth_done){
-		c->runner(&buf);	
-		
-		
-		
-		
+		usleep(100000);
 	}
 	if(exit_process){
 		printf("exit_process\n");
@@ -0,0 +1,314 @@
+/**
+ * Copyright(c) 2020 I4VINE Inc.,
+ *
+ *  @file  spsc_ring.hpp
+ *  @brief single producer single consumer ring for pipeline hand-offs.
+ *
+ * One thread fills slots, one other thread drains them. The indexes run
+ * over twice the capacity, so full and empty differ without a spare slot
+ * and the capacity is any count given at run time. They are published
+ * with release stores and read with acquire loads, so a slot's contents
+ * are visible before its index is. The consumer may block on a futex
+ * until the producer commits, the producer on another until the consumer
+ * releases a slot.
+*/
+#ifndef __SPSC_RING_HPP__
+#define __SPSC_RING_HPP__
+
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <atomic>
+#include <new>
+#include <utility>
+
+/* Counters of a ring, readable from any thread */
+struct spsc_ring_stats {
+	unsigned long long pushed;
+	unsigned long long popped;
+	unsigned long long overflows;	/* producer found the ring full */
+	unsigned int occupancy;
+	unsigned int max_occupancy;
+};
+
+template <class T>
+class TSpscRing {
+private:
+	T *slots;
+	unsigned int cap;
+	/* producer and consumer lines apart, they are written by different cores */
+	alignas(64) std::atomic<unsigned int> prod;	/* next slot to fill, 0 .. 2 * cap - 1 */
+	std::atomic<unsigned long long> pushed;
+	std::atomic<unsigned long long> overflows;
+	std::atomic<unsigned int> max_occupancy;
+	alignas(64) std::atomic<unsigned int> cons;	/* next slot to drain */
+	std::atomic<unsigned long long> popped;
+	alignas(64) std::atomic<uint32_t> wake_seq;	/* futex word, bumped per commit */
+	std::atomic<int> waiting;
+	std::atomic<int> closed;
+	alignas(64) std::atomic<uint32_t> space_seq;	/* futex word, bumped per release */
+	std::atomic<int> space_waiting;
+
+	static_assert(sizeof(std::atomic<uint32_t>) == sizeof(uint32_t), "futex needs a plain 32 bit word");
+
+	unsigned int next(unsigned int i) const { return i + 1 == 2 * cap ? 0 : i + 1; }
+	T *slot(unsigned int i) const { return &slots[i >= cap ? i - cap : i]; }
+	unsigned int count(unsigned int p, unsigned int c) const { return p >= c ? p - c : p + 2 * cap - c; }
+
+	void wake()
+	{
+		wake_seq.fetch_add(1, std::memory_order_seq_cst);
+		if (waiting.load(std::memory_order_seq_cst))
+			syscall(SYS_futex, (uint32_t *)&wake_seq, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+	}
+
+	void wakeSpace()
+	{
+		space_seq.fetch_add(1, std::memory_order_seq_cst);
+		if (space_waiting.load(std::memory_order_seq_cst))
+			syscall(SYS_futex, (uint32_t *)&space_seq, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+	}
+
+	T *freeSlot()
+	{
+		unsigned int p = prod.load(std::memory_order_relaxed);
+
+		return count(p, cons.load(std::memory_order_acquire)) >= cap ? NULL : slot(p);
+	}
+
+public:
+	TSpscRing(unsigned int capacity) : cap(capacity), prod(0), pushed(0), overflows(0),
+		max_occupancy(0), cons(0), popped(0), wake_seq(0), waiting(0), closed(0),
+		space_seq(0), space_waiting(0)
+	{
+		slots = capacity ? new (std::nothrow) T[capacity] : NULL;
+	}
+	~TSpscRing() { delete [] slots; }
+
+	/** @brief  slots were allocated */
+	bool valid() const { return slots != NULL; }
+	unsigned int capacity() const { return cap; }
+	unsigned int size() const
+	{
+		return count(prod.load(std::memory_order_acquire), cons.load(std::memory_order_acquire));
+	}
+	bool empty() const { return size() == 0; }
+
+	/**
+	 *  @brief  producer: free slot to fill in place
+	 *  @return \b slot, publish it with commit()
+	 *          \b NULL when full, counted as overflow
+	 */
+	T *producerSlot()
+	{
+		T *s = freeSlot();
+
+		if (!s)
+			overflows.fetch_add(1, std::memory_order_relaxed);
+		return s;
+	}
+
+	/**
+	 *  @brief  producer: wait for a free slot
+	 *  @param[in] timeout_ms  -1 to wait until a release or close()
+	 *  @return \b slot as producerSlot(), a wait is counted as one overflow
+	 *          \b NULL on timeout or when closed
+	 */
+	T *waitSlot(int timeout_ms = -1)
+	{
+		struct timespec ts, *pts = NULL;
+		T *s;
+		uint32_t seq;
+
+		if ((s = freeSlot()))
+			return s;
+		overflows.fetch_add(1, std::memory_order_relaxed);
+		if (timeout_ms >= 0) {
+			ts.tv_sec = timeout_ms / 1000;
+			ts.tv_nsec = (timeout_ms % 1000) * 1000000L;
+			pts = &ts;
+		}
+		for (;;) {
+			if (closed.load(std::memory_order_acquire))
+				return NULL;
+			seq = space_seq.load(std::memory_order_seq_cst);
+			space_waiting.store(1, std::memory_order_seq_cst);
+			/* a release between the check and the wait changed seq */
+			if ((s = freeSlot())) {
+				space_waiting.store(0, std::memory_order_relaxed);
+				return s;
+			}
+			if (syscall(SYS_futex, (uint32_t *)&space_seq, FUTEX_WAIT_PRIVATE, seq, pts, NULL, 0) < 0 &&
+			    errno == ETIMEDOUT) {
+				space_waiting.store(0, std::memory_order_relaxed);
+				return freeSlot();
+			}
+			space_waiting.store(0, std::memory_order_relaxed);
+			if ((s = freeSlot()))
+				return s;
+		}
+	}
+
+	/** @brief  producer: hand the slot from producerSlot() to the consumer */
+	void commit()
+	{
+		unsigned int p = next(prod.load(std::memory_order_relaxed));
+		unsigned int n = count(p, cons.load(std::memory_order_acquire));
+
+		prod.store(p, std::memory_order_release);
+		pushed.fetch_add(1, std::memory_order_relaxed);
+		if (n > max_occupancy.load(std::memory_order_relaxed))
+			max_occupancy.store(n, std::memory_order_relaxed);
+		wake();
+	}
+
+	/** @brief  producer: copy in, false when full */
+	bool push(const T &v)
+	{
+		T *s = producerSlot();
+
+		if (!s)
+			return false;
+		*s = v;
+		commit();
+		return true;
+	}
+
+	/** @brief  producer: move in, v is left as it was when full */
+	bool push(T &&v)
+	{
+		T *s = producerSlot();
+
+		if (!s)
+			return false;
+		*s = std::move(v);
+		commit();
+		return true;
+	}
+
+	/** @brief  producer: wait for room and move in, false on timeout or close */
+	bool pushWait(T &&v, int timeout_ms = -1)
+	{
+		T *s = waitSlot(timeout_ms);
+
+		if (!s)
+			return false;
+		*s = std::move(v);
+		commit();
+		return true;
+	}
+
+	/**
+	 *  @brief  consumer: oldest slot, read it in place
+	 *  @return \b slot, give it back with release()
+	 *          \b NULL when empty
+	 */
+	T *consumerSlot()
+	{
+		unsigned int c = cons.load(std::memory_order_relaxed);
+
+		if (c == prod.load(std::memory_order_acquire))
+			return NULL;
+		return slot(c);
+	}
+
+	/** @brief  consumer: the slot from consumerSlot() may be filled again */
+	void release()
+	{
+		cons.store(next(cons.load(std::memory_order_relaxed)), std::memory_order_release);
+		popped.fetch_add(1, std::memory_order_relaxed);
+		wakeSpace();
+	}
+
+	/**
+	 *  @brief  consumer: move out without waiting, false when empty
+	 *  @note   a handle leaves the slot, it does not hold the object until
+	 *          the slot is filled again.
+	 */
+	bool tryPop(T &v)
+	{
+		T *s = consumerSlot();
+
+		if (!s)
+			return false;
+		v = std::move(*s);
+		release();
+		return true;
+	}
+
+	/**
+	 *  @brief  consumer: wait for a slot
+	 *  @param[in] timeout_ms  -1 to wait until a commit or close()
+	 *  @return \b slot as consumerSlot()
+	 *          \b NULL on timeout or when closed
+	 */
+	T *wait(int timeout_ms = -1)
+	{
+		struct timespec ts, *pts = NULL;
+		T *s;
+		uint32_t seq;
+
+		if (timeout_ms >= 0) {
+			ts.tv_sec = timeout_ms / 1000;
+			ts.tv_nsec = (timeout_ms % 1000) * 1000000L;
+			pts = &ts;
+		}
+		for (;;) {
+			if ((s = consumerSlot()))
+				return s;
+			if (closed.load(std::memory_order_acquire))
+				return NULL;
+			seq = wake_seq.load(std::memory_order_seq_cst);
+			waiting.store(1, std::memory_order_seq_cst);
+			/* a commit between the check and the wait changed seq */
+			if ((s = consumerSlot())) {
+				waiting.store(0, std::memory_order_relaxed);
+				return s;
+			}
+			if (syscall(SYS_futex, (uint32_t *)&wake_seq, FUTEX_WAIT_PRIVATE, seq, pts, NULL, 0) < 0 &&
+			    errno == ETIMEDOUT) {
+				waiting.store(0, std::memory_order_relaxed);
+				return consumerSlot();
+			}
+			waiting.store(0, std::memory_order_relaxed);
+		}
+	}
+
+	/** @brief  consumer: wait and move out, false on timeout or close */
+	bool pop(T &v, int timeout_ms = -1)
+	{
+		T *s = wait(timeout_ms);
+
+		if (!s)
+			return false;
+		v = std::move(*s);
+		release();
+		return true;
+	}
+
+	/**
+	 *  @brief  wake a waiting consumer for good, e.g. at shutdown
+	 *  @note   a waiting producer gives up too, the consumer still gets
+	 *          what was committed before.
+	 */
+	void close()
+	{
+		closed.store(1, std::memory_order_release);
+		wake();
+		wakeSpace();
+	}
+
+	void getStats(struct spsc_ring_stats *st) const
+	{
+		st->pushed = pushed.load(std::memory_order_relaxed);
+		st->popped = popped.load(std::memory_order_relaxed);
+		st->overflows = overflows.load(std::memory_order_relaxed);
+		st->occupancy = size();
+		st->max_occupancy = max_occupancy.load(std::memory_order_relaxed);
+	}
+};
+
+#endif
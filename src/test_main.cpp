@@ -10,6 +10,7 @@
 
 #include <object.h>
 #include <apis.h>
+#include "spsc_ring.hpp"
 
 /*
 int main(int argc, char *argv[])
@@ -36,23 +37,8 @@ struct fifo_mem_t {
 	char depth[DEPTH9_DATA_SIZE];
 };
 
-struct fifo_t {
-	uint8_t head;
-	uint8_t tail;
-	uint8_t size;
-	uint8_t mask;
-	
-	struct fifo_mem_t fifo_mem[0];
-} __attribute__ ((packed));
-
-#define INIT_FIFO(t,s)	(t->head = t->tail = 0, t->size = s, t->mask = s-1)
-#define FIFO_EMPTY(t)	(t->head == t->tail)
-#define DQUE_FIFO_HEAD(t)	(&t->fifo_mem[t->head])
-#define QUE_FIFO_HEAD(t)	(t->head++, t->head &= t->mask)
-#define DQUE_FIFO_TAIL(t)	(&t->fifo_mem[t->tail])
-#define QUE_FIFO_TAIL(t)	(t->tail++, t->tail &= t->mask)
-#define FIFO_FULL(t)	(((t->head+1) & t->mask) == t->tail)
-#define DATA_IN_FIFO(t)	((t->head >= t->tail) ? (t->head - t->tail) : (t->head + t->size - t->tail))
+/* paired frames, capture side to the uvc side */
+typedef TSpscRing<struct fifo_mem_t> rgbd_ring_t;
 
 struct thread_data_t {
 	int rgb_width;
@@ -65,8 +51,7 @@ struct thread_data_t {
 
 	char depth[DEPTH9_DATA_SIZE];
 
-	struct fifo_t *rgbd_data_q;
-	char __fifo_data[sizeof(struct fifo_mem_t) * 4 + sizeof(struct fifo_t)];
+	rgbd_ring_t *rgbd_data_q;
 };
 
 struct thread_data_t thr_data;
@@ -102,6 +87,9 @@ static void signal_handler(int sig)
 	//close_uvc_gadget_device();
 	//uninit_video_device(MODULE_DEPTH);
 	//close_video_device(MODULE_DEPTH);
+	/* every thread is out, nothing uses the ring any more */
+	delete thr_data.rgbd_data_q;
+	thr_data.rgbd_data_q = NULL;
 
 	printf("Closed all device.\n");
 	exit(0);
@@ -166,9 +154,6 @@ static void *depth_capture_func(void *data)
 	struct fifo_mem_t *fmem;
 	int ret, idx;
 
-	thd->rgbd_data_q = (struct fifo_t *)&thd->__fifo_data[0];
-	INIT_FIFO(thd->rgbd_data_q, 4);
-
 	ret = init_video_device(MODULE_DEPTH, 224, 173 * 9, 4);
 	if (ret) return NULL;
 	start_video_capture(MODULE_DEPTH);
@@ -177,14 +162,13 @@ static void *depth_capture_func(void *data)
 		dequeue_and_capture(MODULE_DEPTH, &buf, &thd->depth[0]);
 		/* Copy data into some where */
 		idx = (thd->rgb_index - 1) & 31;
-		if (!FIFO_FULL(thd->rgbd_data_q)) {
-			fmem = DQUE_FIFO_HEAD(thd->rgbd_data_q);
+		fmem = thd->rgbd_data_q->producerSlot();
+		if (fmem) {
 			fmem->rgb_stamp = thd->rgb_stamps[idx];
 			fmem->depth_stamp = buf.timestamp;
 			memcpy(&fmem->rgb[0], &thd->rgb[idx][0], thd->rgb_size);
 			memcpy(&fmem->depth[0], &thd->depth[0], buf.bytesused);
-			QUE_FIFO_HEAD(thd->rgbd_data_q);
-			//DBGINFO("fifo que head=%d tail=%d\n", thd->rgbd_data_q->head, thd->rgbd_data_q->tail);
+			thd->rgbd_data_q->commit();
 		}else{
 			printf("FIFO_FULL\n");
 		}
@@ -227,13 +211,13 @@ void fill_buf_func(void *fdt, int data_mode, void *data, int len)
 	struct thread_data_t *thd = (struct thread_data_t *)fdt;
 	struct fifo_mem_t *fmem;
 	/* if 3d data available, put a data into data ptr*/
-	DBGINFO("buf_fuc empty=%d len=%d\n", FIFO_EMPTY(thd->rgbd_data_q), len);
-	DBGVERBOSE("fifo head=%d tail=%d\n", thd->rgbd_data_q->head, thd->rgbd_data_q->tail);
+	DBGINFO("buf_fuc empty=%d len=%d\n", thd->rgbd_data_q->empty(), len);
+	DBGVERBOSE("fifo size=%u\n", thd->rgbd_data_q->size());
 #if 0	
-	if (!FIFO_EMPTY(thd->rgbd_data_q)) {
-		fmem = DQUE_FIFO_TAIL(thd->rgbd_data_q);
+	fmem = thd->rgbd_data_q->consumerSlot();
+	if (fmem) {
 		memcpy(data, &fmem->rgb[0], len);
-		QUE_FIFO_TAIL(thd->rgbd_data_q);
+		thd->rgbd_data_q->release();
 	}
 #else
 	if (!flip) {
@@ -307,8 +291,7 @@ int main(int argc, char *argv[])
 	thr_data.rgb_width = 640;
 	thr_data.rgb_height = 480;
 	thr_data.rgb_size = thr_data.rgb_width * thr_data.rgb_height * 2;
-	thr_data.rgbd_data_q = (struct fifo_t *)&thr_data.__fifo_data[0];
-	INIT_FIFO(thr_data.rgbd_data_q, 4);
+	thr_data.rgbd_data_q = new rgbd_ring_t(4);
 #if 0
 	/* 1. open video devices. if error, return ERROR CODE */
 	ret = open_video_device(MODULE_RGB);
@@ -359,17 +342,15 @@ int main(int argc, char *argv[])
 		dequeue_and_capture(MODULE_DEPTH, &buf, &thr_data.depth[0]);
 		/* Copy data into some where */
 		idx = (thr_data.rgb_index - 1) & 31;
-		if (!FIFO_FULL(thr_data.rgbd_data_q)) {
-			struct fifo_mem_t *fmem;
+		struct fifo_mem_t *fmem = thr_data.rgbd_data_q->producerSlot();
 
-			fmem = DQUE_FIFO_HEAD(thr_data.rgbd_data_q);
+		if (fmem) {
 			fmem->rgb_stamp = thr_data.rgb_stamps[idx];
 			fmem->depth_stamp = buf.timestamp;
 			memcpy(&fmem->rgb[0], &thr_data.rgb[idx][0], thr_data.rgb_size);
 			memcpy(&fmem->depth[0], &thr_data.depth[0], buf.bytesused);
 			/* The we need to call the callback func */
-			QUE_FIFO_HEAD(thr_data.rgbd_data_q);
-			//DBGINFO("fifo que head=%d tail=%d\n", thr_data.rgbd_data_q->head, thr_data.rgbd_data_q->tail);
+			thr_data.rgbd_data_q->commit();
 		}
 		/* call calback User calc functions */
 		/* thd->callback((void *)thd); */
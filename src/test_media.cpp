@@ -0,0 +1,47 @@
+/**
+ * Copyright(c) 2020 I4VINE Inc.,
+ *
+ *  @file  test_media.cpp
+ *  @brief media graph and pipeline setup test application.
+ *
+ * media /dev/mediaN [/dev/videoN width height]
+ *
+ * Prints the graph. With a video node it sets up the pipeline in front
+ * of it, then runs S_FMT on the node to check the sizes agree. vivid
+ * (modprobe vivid) gives a media device with video nodes and no subdevs.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <linux/videodev2.h>
+
+#include <capis.h>
+
+int main(int argc, char *argv[])
+{
+	int media, ret = 0;
+
+	dfp = stdout;
+	if (argc < 2) {
+		printf("usage: %s /dev/mediaN [/dev/videoN width height]\n", argv[0]);
+		return 1;
+	}
+	media = open_media_device(argv[1]);
+	if (media < 0)
+		return 1;
+	print_media_graph(media);
+	if (argc > 4) {
+		set_video_device_name(MODULE_RGB, argv[2]);
+		ret = setup_media_pipeline(media, MODULE_RGB, atoi(argv[3]), atoi(argv[4]));
+		printf("setup_media_pipeline: %d\n", ret);
+		if (ret == 0 && open_video_device(MODULE_RGB) == 0) {
+			ret = init_video_device(MODULE_RGB, atoi(argv[3]), atoi(argv[4]), 4);
+			printf("init_video_device: %d\n", ret);
+			uninit_video_device(MODULE_RGB);
+			close_video_device(MODULE_RGB);
+		}
+	}
+	close_media_device(media);
+
+	return ret ? 1 : 0;
+}
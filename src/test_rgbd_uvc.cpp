@@ -19,6 +19,7 @@
 
  
 #include "capis.h"
+#include "spsc_ring.hpp"
 
 
 #define DEF_RGB_WIDTH	1280
@@ -36,23 +37,8 @@ struct fifo_mem_t {
 	char depth[DEPTH9_DATA_SIZE];
 };
 
-struct fifo_t {
-	uint8_t head;
-	uint8_t tail;
-	uint8_t size;
-	uint8_t mask;
-	
-	struct fifo_mem_t fifo_mem[0];
-} __attribute__ ((packed));
-
-#define INIT_FIFO(t,s)	(t->head = t->tail = 0, t->size = s, t->mask = s-1)
-#define FIFO_EMPTY(t)	(t->head == t->tail)
-#define DQUE_FIFO_HEAD(t)	(&t->fifo_mem[t->head])
-#define QUE_FIFO_HEAD(t)	(t->head++, t->head &= t->mask)
-#define DQUE_FIFO_TAIL(t)	(&t->fifo_mem[t->tail])
-#define QUE_FIFO_TAIL(t)	(t->tail++, t->tail &= t->mask)
-#define FIFO_FULL(t)	(((t->head+1) & t->mask) == t->tail)
-#define DATA_IN_FIFO(t)	((t->head >= t->tail) ? (t->head - t->tail) : (t->head + t->size - t->tail))
+/* paired frames, capture side to the uvc side */
+typedef TSpscRing<struct fifo_mem_t> rgbd_ring_t;
 
 struct thread_data_t {
 	int rgb_width;
@@ -65,8 +51,7 @@ struct thread_data_t {
 
 	char depth[DEPTH9_DATA_SIZE];
 
-	struct fifo_t *rgbd_data_q;
-	char __fifo_data[sizeof(struct fifo_mem_t) * 4 + sizeof(struct fifo_t)];
+	rgbd_ring_t *rgbd_data_q;
 };
 
 struct thread_data_t thr_data;
@@ -110,13 +95,13 @@ void fill_buf_func(void *fdt, int data_mode, void *data, int len)
 	struct thread_data_t *thd = (struct thread_data_t *)fdt;
 	struct fifo_mem_t *fmem;
 	/* if 3d data available, put a data into data ptr*/
-	DBGINFO("buf_fuc empty=%d len=%d\n", FIFO_EMPTY(thd->rgbd_data_q), len);
-	DBGVERBOSE("fifo head=%d tail=%d\n", thd->rgbd_data_q->head, thd->rgbd_data_q->tail);
+	DBGINFO("buf_fuc empty=%d len=%d\n", thd->rgbd_data_q->empty(), len);
+	DBGVERBOSE("fifo size=%u\n", thd->rgbd_data_q->size());
 #if 1
-	if (!FIFO_EMPTY(thd->rgbd_data_q)) {
-		fmem = DQUE_FIFO_TAIL(thd->rgbd_data_q);
+	fmem = thd->rgbd_data_q->consumerSlot();
+	if (fmem) {
 		memcpy(data, &fmem->rgb[0], len);
-		QUE_FIFO_TAIL(thd->rgbd_data_q);
+		thd->rgbd_data_q->release();
 	}
 #else
 	if (!flip) {
@@ -247,8 +232,7 @@ int main(int argc, char *argv[])
 	thr_data.rgb_width = 640;
 	thr_data.rgb_height = 480;
 	thr_data.rgb_size = thr_data.rgb_width * thr_data.rgb_height * 2;
-	thr_data.rgbd_data_q = (struct fifo_t *)&thr_data.__fifo_data[0];
-	INIT_FIFO(thr_data.rgbd_data_q, 4);
+	thr_data.rgbd_data_q = new rgbd_ring_t(4);
 	
 	ret = open_video_device(MODULE_RGB);
 	if (ret) return ERROR_OPEN_RGB;
@@ -277,17 +261,15 @@ int main(int argc, char *argv[])
 		dequeue_and_capture(MODULE_DEPTH, &buf, &thr_data.depth[0]);
 		/* Copy data into some where */
 		idx = (thr_data.rgb_index - 1) & 31;
-		if (!FIFO_FULL(thr_data.rgbd_data_q)) {
-			struct fifo_mem_t *fmem;
+		struct fifo_mem_t *fmem = thr_data.rgbd_data_q->producerSlot();
 
-			fmem = DQUE_FIFO_HEAD(thr_data.rgbd_data_q);
+		if (fmem) {
 			fmem->rgb_stamp = thr_data.rgb_stamps[idx];
 			fmem->depth_stamp = buf.timestamp;
 			memcpy(&fmem->rgb[0], &thr_data.rgb[idx][0], thr_data.rgb_size);
 			memcpy(&fmem->depth[0], &thr_data.depth[0], buf.bytesused);
 			/* The we need to call the callback func */
-			QUE_FIFO_HEAD(thr_data.rgbd_data_q);
-			//DBGINFO("fifo que head=%d tail=%d\n", thr_data.rgbd_data_q->head, thr_data.rgbd_data_q->tail);
+			thr_data.rgbd_data_q->commit();
 		}
 		/* call calback User calc functions */
 		/* thd->callback((void *)thd); */
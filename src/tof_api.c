@@ -0,0 +1,771 @@
+/**
+ * Copyright(c) 2020 I4VINE Inc.,
+ *
+ *  @file  tof_api.c
+ *  @brief ToF depth engine: raw phase frames to depth, amplitude and
+ *         confidence maps.
+ *
+ * A raw frame is phase images stacked, 4 per modulation frequency (0, 90,
+ * 180 and 270 degrees), in one of the layouts of the sensor modes: 4
+ * images at one frequency, 2 x 4 at two, or a gray image and 2 x 4. For
+ * each frequency a pixel's phase is atan2(A90 - A270, A0 - A180) and its
+ * amplitude half the length of that vector. The phase gives the distance
+ * within that frequency's ambiguity range, and two are unwrapped together
+ * up to the range of their common divisor frequency. Each frequency set
+ * has a row kernel of its own, picked per layout in tof_create.
+ *
+ * The math is fixed point. atan2 and the vector length come from tables
+ * indexed by the ratio of the smaller to the larger of |I| and |Q|, the
+ * division a table of reciprocals. Phases are 16 bits a turn, distances
+ * in 1/8 mm. Per pixel calibration is tables too, in one binary blob
+ * mapped as it is (see struct tof_calib_header): a phase offset per
+ * frequency, the cosine of the pixel's ray for depth along the axis, and
+ * a wiggling correction by phase. Without a blob the tables change
+ * nothing, the loop is the same either way.
+ *
+ * The frame is cut in tiles of rows that the caller and the engine's
+ * workers take in turn. A worker unpacks the phase rows of a tile row with
+ * the SIMD kernels of depth_api.c and does the math 4 pixels at a time
+ * with GCC vector types, NEON on arm and SSE on x86, without branches.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <linux/videodev2.h>
+
+#include <capis.h>
+
+#define TOF_TILE_ROWS		8
+#define TOF_SATURATED		4095
+#define TOF_LIGHT_SPEED		299792458.0
+#define TOF_TURN		65536		/* phase units of a full turn */
+#define TOF_ATAN_STEPS		1024		/* ratio steps of the atan and length tables */
+#define TOF_MAX_RANGE_MM	16000		/* unwrapped, keeps the math in 32 bits */
+#define TOF_CALIB_ALIGN		64
+#define TOF_WIGGLE_SHIFT	8		/* log2 of TOF_WIGGLE_BINS */
+#define TOF_MAX_MODULATED	8		/* phase images of the frequencies */
+
+typedef int v4si __attribute__((vector_size(16)));
+typedef unsigned int v4su __attribute__((vector_size(16)));
+typedef unsigned short v4hu __attribute__((vector_size(8)));
+typedef unsigned char v4qu __attribute__((vector_size(4)));
+
+#define V4(x)	((v4si){ (x), (x), (x), (x) })
+
+struct tof_engine;
+
+typedef void (*tof_row_fn)(const struct tof_engine *e, const unsigned short *rows, unsigned int y);
+
+struct tof_worker {
+	struct tof_engine *e;
+	int id;
+	pthread_t thr;
+	unsigned short *rows;		/* unpacked rows of the modulated phases */
+	unsigned long long busy_us;
+	unsigned long long tiles;
+};
+
+struct tof_engine {
+	struct tof_config cfg;
+	int range8[2];			/* ambiguity range of each frequency, 1/8 mm */
+	int range2_inv;			/* 2^24 / range8[1] */
+	int tiles;
+
+	/* calibration, in the mapped blob or the identity in calib_mem */
+	const unsigned short *phase_offset[2];
+	const unsigned short *ray_z;
+	const short *wiggle[2];
+	void *calib_map;
+	size_t calib_size;
+	void *calib_mem;
+
+	pthread_mutex_t lock;
+	pthread_cond_t start;
+	pthread_cond_t done;
+	unsigned int generation;	/* bumped per frame, wakes the workers */
+	int pending;			/* workers still on the frame */
+	int stop;
+	int next_tile;			/* taken with an atomic add */
+	const unsigned char *src;
+	struct tof_output out;
+
+	int threads;
+	int started;			/* threads of workers[1 .. started] */
+	struct tof_worker *workers;	/* [0] is the caller of tof_process */
+	struct tof_stats stats;
+};
+
+/* |I| and |Q| are 12 bits, so are the indexes of recip_lut */
+static unsigned int recip_lut[4096];			/* 2^20 / i */
+static unsigned short atan_lut[TOF_ATAN_STEPS + 1];	/* atan(i / STEPS), TOF_TURN a turn */
+static unsigned short hyp_lut[TOF_ATAN_STEPS + 1];	/* sqrt(1 + (i / STEPS)^2), 16384 = 1 */
+static pthread_once_t lut_once = PTHREAD_ONCE_INIT;
+
+static void init_luts(void)
+{
+	double r;
+	int i;
+
+	for (i = 1; i < 4096; i++)
+		recip_lut[i] = ((1u << 20) + i / 2) / i;
+	for (i = 0; i <= TOF_ATAN_STEPS; i++) {
+		r = (double)i / TOF_ATAN_STEPS;
+		atan_lut[i] = lround(atan(r) * TOF_TURN / (2 * M_PI));
+		hyp_lut[i] = lround(sqrt(1 + r * r) * 16384);
+	}
+}
+
+static unsigned long long now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static unsigned int gcd(unsigned int a, unsigned int b)
+{
+	unsigned int t;
+
+	while (b) {
+		t = a % b;
+		a = b;
+		b = t;
+	}
+	return a;
+}
+
+static inline v4si vsel(v4si m, v4si a, v4si b)
+{
+	return (a & m) | (b & ~m);
+}
+
+static inline v4si vabs(v4si x)
+{
+	return (x ^ (x >> 31)) - (x >> 31);
+}
+
+static inline v4si vload(const unsigned short *p)
+{
+	v4hu h;
+
+	memcpy(&h, p, sizeof(h));
+	return __builtin_convertvector(h, v4si);
+}
+
+/* table lookups, a load per lane: neither NEON nor SSE gathers */
+static inline v4si vlut(const unsigned short *t, v4si i)
+{
+	return (v4si){ t[i[0]], t[i[1]], t[i[2]], t[i[3]] };
+}
+
+static inline v4si vlut_s(const short *t, v4si i)
+{
+	return (v4si){ t[i[0]], t[i[1]], t[i[2]], t[i[3]] };
+}
+
+static inline v4si vlut32(const unsigned int *t, v4si i)
+{
+	return (v4si){ (int)t[i[0]], (int)t[i[1]], (int)t[i[2]], (int)t[i[3]] };
+}
+
+/**
+ *  @brief  atan2(y, x) in [0, TOF_TURN) and the length of (x, y)
+ *  @note   folded to the first octant, where min / max indexes the tables
+*/
+static inline v4si vphase(v4si y, v4si x, v4si *len)
+{
+	v4si ax = vabs(x), ay = vabs(y);
+	v4si steep = ay > ax;
+	v4si mn = vsel(steep, ax, ay), mx = vsel(steep, ay, ax);
+	v4si i = (mn * vlut32(recip_lut, mx) + 512) >> 10;
+	v4si a;
+
+	i = vsel(i > TOF_ATAN_STEPS, V4(TOF_ATAN_STEPS), i);
+	*len = (mx * vlut(hyp_lut, i) + 8192) >> 14;
+	a = vlut(atan_lut, i);
+	a = vsel(steep, TOF_TURN / 4 - a, a);
+	a = vsel(x < 0, TOF_TURN / 2 - a, a);
+	a = vsel(y < 0, TOF_TURN - a, a);
+	return a & (TOF_TURN - 1);
+}
+
+/* calibrated phase of frequency f to distance, 1/8 mm */
+static inline v4si vdistance(const struct tof_engine *e, int f, v4si phase, unsigned int px)
+{
+	phase = (phase - vload(e->phase_offset[f] + px)) & (TOF_TURN - 1);
+	phase = (phase + vlut_s(e->wiggle[f], phase >> (16 - TOF_WIGGLE_SHIFT))) & (TOF_TURN - 1);
+	return (phase * e->range8[f]) >> 16;
+}
+
+/**
+ *  @brief  one row of every map from the unpacked rows of its modulated
+ *          phases, 4 per frequency
+ *  @note   the layout's frequencies and wraps are constants of each
+ *          instance below, the compiler drops the other frequency's code
+ *          and unrolls the unwrap. a vector of 4 pixels at a time,
+ *          selects instead of branches
+*/
+static inline __attribute__((always_inline))
+void tof_row_kernel(const struct tof_engine *e, const unsigned short *rows, unsigned int y,
+		    const int freqs, const int wraps)
+{
+	const struct tof_config *c = &e->cfg;
+	const unsigned int w = c->width;
+	const v4si r1 = V4(e->range8[0]), r2 = V4(e->range8[1]);
+	const int conf_k = (255 << 16) / c->full_amplitude;
+	const int err_k = (512 << 16) / e->range8[1];
+	unsigned short *depth = e->out.depth + (size_t)y * w;
+	unsigned short *amplitude = e->out.amplitude + (size_t)y * w;
+	unsigned char *confidence = e->out.confidence + (size_t)y * w;
+	unsigned int x, px;
+	int k, p;
+
+	for (x = 0, px = y * w; x < w; x += 4, px += 4) {
+		v4si a[TOF_MAX_MODULATED], len1, len2, amp, d1, d2, d, m, err, best, dist, conf;
+		v4si sat = V4(0), valid;
+		v4hu h;
+		v4qu b;
+
+		for (p = 0; p < 4 * freqs; p++) {
+			a[p] = vload(rows + p * w + x);
+			sat |= a[p] >= TOF_SATURATED;
+		}
+		d1 = vdistance(e, 0, vphase(a[1] - a[3], a[0] - a[2], &len1), px);
+		if (freqs == 1) {
+			amp = (len1 + 1) >> 1;
+			best = V4(0);
+			dist = d1;
+		} else {
+			d2 = vdistance(e, 1, vphase(a[5] - a[7], a[4] - a[6], &len2), px);
+			/* mean of both, each half its vector's length */
+			amp = (len1 + len2 + 2) >> 2;
+
+			/* the wrap of frequency 1 whose distance frequency 2 agrees
+			   with best. m is the nearest whole number of range 2, plus one */
+			best = V4(0x7fffffff);
+			dist = V4(0);
+#pragma GCC unroll 8
+			for (k = 0; k < wraps; k++) {
+				d = d1 + k * r1 - d2;
+				m = ((d + r2 + r2 / 2) * e->range2_inv) >> 24;
+				err = vabs(d + r2 - m * r2);
+				valid = err < best;
+				best = vsel(valid, err, best);
+				dist = vsel(valid, d + d2, dist);
+			}
+		}
+
+		valid = (amp >= (int)c->min_amplitude) & ~sat;
+		/* along the axis, mm: the ray's cosine is Q15, distance 1/8 mm */
+		d = (v4si)(((v4su)dist * (v4su)vload(e->ray_z + px) + (1u << 17)) >> 18) & valid;
+		h = __builtin_convertvector(d, v4hu);
+		memcpy(depth + x, &h, sizeof(h));
+
+		h = __builtin_convertvector(amp, v4hu);
+		memcpy(amplitude + x, &h, sizeof(h));
+
+		/* strong signal and frequencies agreeing, 0 where no depth */
+		conf = (vsel(amp > (int)c->full_amplitude, V4(c->full_amplitude), amp) * conf_k) >> 16;
+		err = 256 - ((best * err_k) >> 16);
+		conf = ((conf * (err & ~(err >> 31))) >> 8) & valid;
+		b = __builtin_convertvector(conf, v4qu);
+		memcpy(confidence + x, &b, sizeof(b));
+	}
+}
+
+/* the kernel of each frequency set, a new one does not touch the others */
+#define TOF_ROW(name, freqs, wraps)						\
+static void name(const struct tof_engine *e, const unsigned short *rows, unsigned int y) \
+{										\
+	tof_row_kernel(e, rows, y, freqs, wraps);				\
+}
+
+TOF_ROW(tof_row_1f, 1, 1)
+TOF_ROW(tof_row_2f_4w, 2, 4)
+
+/* Phase layouts, TOF_LAYOUT_xxx. wraps is fixed by the kernel: the
+   frequencies may change as long as their ratio gives the same */
+static const struct tof_layout_desc {
+	int phases;			/* images of a frame */
+	int first;			/* the first modulated one */
+	int freqs;			/* 4 images each */
+	int wraps;			/* of frequency 1 in the unwrapped range */
+	unsigned int freq_hz[2];	/* defaults */
+	tof_row_fn row;
+} layouts[TOF_LAYOUTS] = {
+	[TOF_LAYOUT_4] = { 4, 0, 1, 1, { TOF_DEFAULT_FREQ2_HZ, 0 }, tof_row_1f },
+	[TOF_LAYOUT_2X4] = { 8, 0, 2, 4, { TOF_DEFAULT_FREQ1_HZ, TOF_DEFAULT_FREQ2_HZ }, tof_row_2f_4w },
+	[TOF_LAYOUT_9] = { 9, 1, 2, 4, { TOF_DEFAULT_FREQ1_HZ, TOF_DEFAULT_FREQ2_HZ }, tof_row_2f_4w },
+};
+
+/* take tiles until none are left */
+static void tof_tiles(struct tof_engine *e, struct tof_worker *wk)
+{
+	const struct tof_config *c = &e->cfg;
+	const struct tof_layout_desc *l = &layouts[c->layout];
+	unsigned long long t = now_us();
+	unsigned int y, y1;
+	int tile, p;
+
+	while ((tile = __atomic_fetch_add(&e->next_tile, 1, __ATOMIC_RELAXED)) < e->tiles) {
+		y1 = (tile + 1) * TOF_TILE_ROWS;
+		if (y1 > c->height)
+			y1 = c->height;
+		for (y = tile * TOF_TILE_ROWS; y < y1; y++) {
+			/* phase p of row y is raw row p * height + y */
+			for (p = l->first; p < l->phases; p++)
+				unpack_sbggr12p(e->src + ((size_t)p * c->height + y) * c->stride, c->stride,
+						c->width, 1, wk->rows + (p - l->first) * c->width, c->width);
+			l->row(e, wk->rows, y);
+		}
+		wk->tiles++;
+	}
+	wk->busy_us += now_us() - t;
+}
+
+static void *tof_worker_func(void *arg)
+{
+	struct tof_worker *wk = (struct tof_worker *)arg;
+	struct tof_engine *e = wk->e;
+	unsigned int gen = 0;
+
+	if (e->cfg.first_cpu >= 0)
+		set_thread_cpu(e->cfg.first_cpu + wk->id);
+	pthread_mutex_lock(&e->lock);
+	for (;;) {
+		while (e->generation == gen && !e->stop)
+			pthread_cond_wait(&e->start, &e->lock);
+		if (e->stop)
+			break;
+		gen = e->generation;
+		pthread_mutex_unlock(&e->lock);
+		tof_tiles(e, wk);
+		pthread_mutex_lock(&e->lock);
+		if (--e->pending == 0)
+			pthread_cond_signal(&e->done);
+	}
+	pthread_mutex_unlock(&e->lock);
+
+	return NULL;
+}
+
+/* where the tables of a blob for this configuration are */
+static void calib_layout(const struct tof_config *c, struct tof_calib_header *h)
+{
+	unsigned int pixels = c->width * c->height;
+
+	memset(h, 0, sizeof(*h));
+	h->magic = TOF_CALIB_MAGIC;
+	h->version = TOF_CALIB_VERSION;
+	h->width = c->width;
+	h->height = c->height;
+	h->freq_hz[0] = c->freq_hz[0];
+	h->freq_hz[1] = c->freq_hz[1];
+	h->wiggle_bins = TOF_WIGGLE_BINS;
+#define CALIB_ALIGN(x)	(((x) + TOF_CALIB_ALIGN - 1) & ~(TOF_CALIB_ALIGN - 1))
+	h->phase_offset = CALIB_ALIGN(sizeof(*h));
+	h->ray_z = CALIB_ALIGN(h->phase_offset + 2 * pixels * sizeof(unsigned short));
+	h->wiggle = CALIB_ALIGN(h->ray_z + pixels * sizeof(unsigned short));
+	h->size = CALIB_ALIGN(h->wiggle + 2 * TOF_WIGGLE_BINS * sizeof(short));
+#undef CALIB_ALIGN
+}
+
+/* point the tables into a blob already checked against calib_layout */
+static void calib_use(struct tof_engine *e, const void *blob)
+{
+	const struct tof_calib_header *h = (const struct tof_calib_header *)blob;
+	const char *base = (const char *)blob;
+	unsigned int pixels = e->cfg.width * e->cfg.height;
+
+	e->phase_offset[0] = (const unsigned short *)(base + h->phase_offset);
+	e->phase_offset[1] = e->phase_offset[0] + pixels;
+	e->ray_z = (const unsigned short *)(base + h->ray_z);
+	e->wiggle[0] = (const short *)(base + h->wiggle);
+	e->wiggle[1] = e->wiggle[0] + TOF_WIGGLE_BINS;
+}
+
+/* a blob that changes nothing: no offsets, rays on the axis, no wiggling */
+static int calib_identity(struct tof_engine *e)
+{
+	struct tof_calib_header h;
+	unsigned short *ray;
+	unsigned int i, pixels = e->cfg.width * e->cfg.height;
+
+	calib_layout(&e->cfg, &h);
+	e->calib_mem = calloc(1, h.size);
+	if (!e->calib_mem)
+		return VIDEO_ERR_NOMEM;
+	memcpy(e->calib_mem, &h, sizeof(h));
+	ray = (unsigned short *)((char *)e->calib_mem + h.ray_z);
+	for (i = 0; i < pixels; i++)
+		ray[i] = 32768;
+	calib_use(e, e->calib_mem);
+
+	return 0;
+}
+
+/**
+ *  @brief  "C" Phase images in a frame of a layout
+ *  @param[in] layout   TOF_LAYOUT_xxx
+ *  @return \b images, the capture height is this times the phase height
+ *          \b under zero value for an unknown layout
+*/
+int tof_layout_phases(int layout)
+{
+	if (layout < 0 || layout >= TOF_LAYOUTS)
+		return VIDEO_ERR_INVALID;
+
+	return layouts[layout].phases;
+}
+
+/**
+ *  @brief  "C" The layout of a negotiated capture height
+ *  @param[in] height         rows of a frame, get_video_format
+ *  @param[in] phase_height   rows of one phase image, DEPTH_PHASE_HEIGHT
+ *  @return \b TOF_LAYOUT_xxx
+ *          \b VIDEO_ERR_UNSUPPORTED when no layout has that many images
+*/
+int tof_layout_of_height(unsigned int height, unsigned int phase_height)
+{
+	int l;
+
+	for (l = 0; l < TOF_LAYOUTS; l++)
+		if (phase_height && height == layouts[l].phases * phase_height)
+			return l;
+
+	return VIDEO_ERR_UNSUPPORTED;
+}
+
+/**
+ *  @brief  "C" Defaults of the engine, for a 224 x 173 per phase depth node
+ *  @param[out] cfg      configuration to change and give to tof_create
+ *  @param[in]  layout   TOF_LAYOUT_xxx, sets the frequencies of the mode
+ *  @return none
+*/
+void tof_default_config(struct tof_config *cfg, int layout)
+{
+	if (layout < 0 || layout >= TOF_LAYOUTS)
+		layout = TOF_LAYOUT_9;
+	memset(cfg, 0, sizeof(*cfg));
+	cfg->layout = layout;
+	cfg->width = DEPTH_PHASE_WIDTH;
+	cfg->height = DEPTH_PHASE_HEIGHT;
+	cfg->stride = DEPTH_PHASE_WIDTH / 2 * 3;
+	cfg->freq_hz[0] = layouts[layout].freq_hz[0];
+	cfg->freq_hz[1] = layouts[layout].freq_hz[1];
+	cfg->min_amplitude = 16;
+	cfg->full_amplitude = 512;
+	cfg->budget_us = 33333;
+	cfg->threads = TOF_DEFAULT_THREADS;
+	cfg->first_cpu = -1;
+}
+
+/**
+ *  @brief  "C" Make a depth engine and start its workers
+ *  @param[in] cfg   from tof_default_config, copied
+ *  @return \b engine
+ *          \b NULL for a bad configuration or out of memory
+ *  @note   the width must be a multiple of 4. with two frequencies,
+ *          freq_hz[0] must be as many times their common divisor as the
+ *          layout's kernel unwraps, 4 (the defaults are 4:3). one
+ *          frequency ignores freq_hz[1].
+ *          the engine starts uncalibrated, see tof_load_calibration.
+ *  @see    tof_destroy
+*/
+struct tof_engine *tof_create(const struct tof_config *cfg)
+{
+	const struct tof_layout_desc *l;
+	struct tof_engine *e;
+	unsigned int f2, g;
+	int i, j;
+
+	if (!cfg || cfg->layout < 0 || cfg->layout >= TOF_LAYOUTS || !cfg->width ||
+	    (cfg->width & 3) || !cfg->height || cfg->stride < cfg->width / 2 * 3 ||
+	    !cfg->freq_hz[0] || !cfg->full_amplitude)
+		return NULL;
+	l = &layouts[cfg->layout];
+	/* one frequency: the second is the first, range and all */
+	f2 = l->freqs == 2 ? cfg->freq_hz[1] : cfg->freq_hz[0];
+	if (!f2)
+		return NULL;
+	g = gcd(cfg->freq_hz[0], f2);
+	if ((int)(cfg->freq_hz[0] / g) != l->wraps) {
+		DBGERROR("tof: %u/%u Hz unwrap in %u ranges, the layout's kernel does %d\n",
+			 cfg->freq_hz[0], f2, cfg->freq_hz[0] / g, l->wraps);
+		return NULL;
+	}
+	if (TOF_LIGHT_SPEED / (2.0 * g) * 1000 > TOF_MAX_RANGE_MM ||
+	    TOF_LIGHT_SPEED / (2.0 * f2) * 8000 >= 32768)
+		return NULL;
+	pthread_once(&lut_once, init_luts);
+	e = (struct tof_engine *)calloc(1, sizeof(*e));
+	if (!e)
+		return NULL;
+	e->cfg = *cfg;
+	if (l->freqs == 1)
+		e->cfg.freq_hz[1] = 0;
+	e->range8[0] = lround(TOF_LIGHT_SPEED / (2.0 * cfg->freq_hz[0]) * 8000);
+	e->range8[1] = lround(TOF_LIGHT_SPEED / (2.0 * f2) * 8000);
+	e->range2_inv = (1 << 24) / e->range8[1];
+	e->tiles = (cfg->height + TOF_TILE_ROWS - 1) / TOF_TILE_ROWS;
+	e->threads = cfg->threads > 0 ? cfg->threads : TOF_DEFAULT_THREADS;
+	if (e->threads > TOF_MAX_THREADS)
+		e->threads = TOF_MAX_THREADS;
+	pthread_mutex_init(&e->lock, NULL);
+	pthread_cond_init(&e->start, NULL);
+	pthread_cond_init(&e->done, NULL);
+	e->stats.threads = e->threads;
+	e->stats.budget_us = cfg->budget_us;
+
+	e->workers = (struct tof_worker *)calloc(e->threads, sizeof(struct tof_worker));
+	if (!e->workers || calib_identity(e)) {
+		tof_destroy(e);
+		return NULL;
+	}
+	for (i = 0; i < e->threads; i++) {
+		e->workers[i].e = e;
+		e->workers[i].id = i;
+		e->workers[i].rows = (unsigned short *)malloc(sizeof(unsigned short) *
+							      4 * l->freqs * cfg->width);
+		if (!e->workers[i].rows) {
+			e->threads = i;
+			tof_destroy(e);
+			return NULL;
+		}
+	}
+	/* worker 0 is whoever calls tof_process */
+	for (i = 1; i < e->threads; i++, e->started++) {
+		if (pthread_create(&e->workers[i].thr, NULL, tof_worker_func, &e->workers[i]) != 0) {
+			DBGERROR("tof worker %d not started, %d threads\n", i, i);
+			/* tof_destroy frees the rows of the first e->threads only */
+			for (j = i; j < e->threads; j++) {
+				free(e->workers[j].rows);
+				e->workers[j].rows = NULL;
+			}
+			e->threads = i;
+			e->stats.threads = i;
+			break;
+		}
+	}
+
+	return e;
+}
+
+/**
+ *  @brief  "C" Stop the workers and free an engine
+ *  @param[in] e   engine, NULL is ignored
+ *  @return none
+*/
+void tof_destroy(struct tof_engine *e)
+{
+	int i;
+
+	if (!e)
+		return;
+	pthread_mutex_lock(&e->lock);
+	e->stop = 1;
+	pthread_cond_broadcast(&e->start);
+	pthread_mutex_unlock(&e->lock);
+	for (i = 1; i <= e->started; i++)
+		pthread_join(e->workers[i].thr, NULL);
+	for (i = 0; e->workers && i < e->threads; i++)
+		free(e->workers[i].rows);
+	free(e->workers);
+	if (e->calib_map)
+		munmap(e->calib_map, e->calib_size);
+	free(e->calib_mem);
+	pthread_cond_destroy(&e->done);
+	pthread_cond_destroy(&e->start);
+	pthread_mutex_destroy(&e->lock);
+	free(e);
+}
+
+/**
+ *  @brief  "C" Bytes of the maps of one frame, see tof_output_planes
+ *  @param[in] e   engine
+ *  @return \b bytes
+*/
+unsigned int tof_output_size(const struct tof_engine *e)
+{
+	unsigned int pixels = e->cfg.width * e->cfg.height;
+
+	return pixels * (2 * sizeof(unsigned short) + 1);
+}
+
+/**
+ *  @brief  "C" Point the maps into one buffer of tof_output_size bytes
+ *  @param[in]  e      engine
+ *  @param[in]  data   buffer, depth then amplitude then confidence
+ *  @param[out] out    maps
+ *  @return none
+*/
+void tof_output_planes(const struct tof_engine *e, void *data, struct tof_output *out)
+{
+	unsigned int pixels = e->cfg.width * e->cfg.height;
+
+	out->depth = (unsigned short *)data;
+	out->amplitude = out->depth + pixels;
+	out->confidence = (unsigned char *)(out->amplitude + pixels);
+}
+
+/**
+ *  @brief  "C" Calibrate the engine from a binary blob
+ *  @param[in] e      engine
+ *  @param[in] path   blob of struct tof_calib_header and its tables
+ *  @return \b zero for success
+ *          \b under zero value indicated the error
+ *  @note   the blob is mapped read only as it is, nothing is parsed or
+ *          copied. it must be for the engine's width, height and
+ *          frequencies; on an error the engine keeps its calibration.
+ *          not while tof_process runs.
+*/
+int tof_load_calibration(struct tof_engine *e, const char *path)
+{
+	struct tof_calib_header want;
+	struct stat st;
+	void *map;
+	int fd;
+
+	if (!e || !path)
+		return VIDEO_ERR_INVALID;
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		DBGERROR("%s: no calibration\n", path);
+		return VIDEO_ERR_IO;
+	}
+	calib_layout(&e->cfg, &want);
+	if (fstat(fd, &st) || st.st_size < (off_t)want.size) {
+		DBGERROR("%s: %lld bytes, %u needed\n", path, (long long)st.st_size, want.size);
+		close(fd);
+		return VIDEO_ERR_INVALID;
+	}
+	/* the tables are read by every frame, fault them in now */
+	map = mmap(NULL, want.size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return VIDEO_ERR_NOMEM;
+	if (memcmp(map, &want, sizeof(want))) {
+		DBGERROR("%s: not a calibration of %ux%u at %u/%u Hz\n", path, want.width,
+			 want.height, want.freq_hz[0], want.freq_hz[1]);
+		munmap(map, want.size);
+		return VIDEO_ERR_INVALID;
+	}
+	if (e->calib_map)
+		munmap(e->calib_map, e->calib_size);
+	e->calib_map = map;
+	e->calib_size = want.size;
+	calib_use(e, map);
+
+	return 0;
+}
+
+/**
+ *  @brief  "C" Write the engine's calibration as a blob
+ *  @param[in] e      engine
+ *  @param[in] path   file to write
+ *  @return \b zero for success
+ *          \b under zero value indicated the error
+ *  @note   an uncalibrated engine writes the identity blob, the layout a
+ *          calibration tool fills in.
+*/
+int tof_save_calibration(struct tof_engine *e, const char *path)
+{
+	const struct tof_calib_header *h;
+	FILE *fp;
+	size_t n;
+
+	if (!e || !path)
+		return VIDEO_ERR_INVALID;
+	h = (const struct tof_calib_header *)(e->calib_map ? e->calib_map : e->calib_mem);
+	fp = fopen(path, "wb");
+	if (!fp)
+		return VIDEO_ERR_IO;
+	n = fwrite(h, 1, h->size, fp);
+	if (fclose(fp) || n != h->size)
+		return VIDEO_ERR_IO;
+
+	return 0;
+}
+
+/**
+ *  @brief  "C" Make the maps of a raw frame
+ *  @param[in]  e        engine
+ *  @param[in]  raw      SBGGR12P frame, the layout's images stacked
+ *  @param[in]  length   bytes of raw
+ *  @param[out] out      maps, width x height each
+ *  @return \b zero for success
+ *          \b under zero value indicated the error
+ *  @note   the caller works on tiles too, it returns with the frame done.
+ *          one frame at a time per engine.
+*/
+int tof_process(struct tof_engine *e, const void *raw, unsigned int length, struct tof_output *out)
+{
+	struct tof_stats *st;
+	unsigned long long t;
+	unsigned int us;
+
+	if (!e || !raw || !out ||
+	    length < (unsigned long long)e->cfg.stride * e->cfg.height *
+		     layouts[e->cfg.layout].phases)
+		return VIDEO_ERR_INVALID;
+	t = now_us();
+	pthread_mutex_lock(&e->lock);
+	e->src = (const unsigned char *)raw;
+	e->out = *out;
+	e->next_tile = 0;
+	e->pending = e->threads - 1;
+	e->generation++;
+	pthread_cond_broadcast(&e->start);
+	pthread_mutex_unlock(&e->lock);
+
+	tof_tiles(e, &e->workers[0]);
+
+	pthread_mutex_lock(&e->lock);
+	while (e->pending)
+		pthread_cond_wait(&e->done, &e->lock);
+	us = now_us() - t;
+	st = &e->stats;
+	st->frames++;
+	st->last_us = us;
+	st->us_sum += us;
+	if (us > st->us_max)
+		st->us_max = us;
+	if (st->budget_us && us > st->budget_us)
+		st->over_budget++;
+	pthread_mutex_unlock(&e->lock);
+
+	return 0;
+}
+
+/**
+ *  @brief  "C" Read the time the frames took against the budget
+ *  @param[in]  e       engine
+ *  @param[out] stats   counters
+ *  @return \b zero for success
+ *          \b under zero value indicated the error
+*/
+int tof_get_stats(struct tof_engine *e, struct tof_stats *stats)
+{
+	int i;
+
+	if (!e || !stats)
+		return VIDEO_ERR_INVALID;
+	pthread_mutex_lock(&e->lock);
+	*stats = e->stats;
+	for (i = 0; i < e->threads; i++) {
+		stats->busy_us[i] = e->workers[i].busy_us;
+		stats->tiles[i] = e->workers[i].tiles;
+	}
+	pthread_mutex_unlock(&e->lock);
+
+	return 0;
+}
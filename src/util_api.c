@@ -1,5 +1,10 @@
+#define _GNU_SOURCE
 #include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
 #include <sys/time.h>
+#include <sched.h>
+#include <pthread.h>
 
 #include <capis.h>
 
@@ -16,6 +21,61 @@ void timer_init()
 	start_tv = (tv.tv_sec*1000 + tv.tv_usec/1000);
 }
 
+/**
+ *  @brief  allocate page aligned buffers for IO_METHOD_USERPTR
+ *  @param[out] start   array of count buffer pointers to fill
+ *  @param[in]  count   number of buffers
+ *  @param[in]  length  size of each buffer, rounded up to page size
+ *  @return zero for success, none zero for error.
+ *  @note   page alignment lets both capture and uvc gadget take the
+ *          buffers as USERPTR.
+ *  @see    free_userptr_buffers, set_video_userptr_pool
+*/
+int alloc_userptr_buffers(void **start, int count, unsigned int length)
+{
+	long page = sysconf(_SC_PAGESIZE);
+	int i;
+
+	length = (length + page - 1) & ~(page - 1);
+	for (i = 0; i < count; i++) {
+		if (posix_memalign(&start[i], page, length)) {
+			free_userptr_buffers(start, i);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+void free_userptr_buffers(void **start, int count)
+{
+	int i;
+
+	for (i = 0; i < count; i++) {
+		free(start[i]);
+		start[i] = NULL;
+	}
+}
+
+/**
+ *  @brief  pin the calling thread to a cpu
+ *  @param[in]  cpu  cpu number, under zero leaves the thread free
+ *  @return zero for success, none zero for error.
+ *  @note   give each capture head its own core so heads do not
+ *          delay each other's dequeue.
+*/
+int set_thread_cpu(int cpu)
+{
+	cpu_set_t set;
+
+	if (cpu < 0)
+		return 0;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+
+	return pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
+
 void cur_time(FILE *fp)
 {
 	struct timeval tv;
@@ -42,6 +42,7 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -59,6 +60,8 @@ static struct uvc_device *device;
 
 static UVC_BUFFER_FILL_FUNC fill_buffer_handler;
 static UVC_BUFFER_RELEASE_FUNC buffer_release_handler;
+static int uvc_io_method = IO_METHOD_USERPTR;
+static int uvc_zero_copy;
 
 /* Enable debug prints. */
 #undef ENABLE_BUFFER_DEBUG
@@ -114,6 +117,10 @@ struct buffer {
 	struct v4l2_buffer buf;
 	void *start;
 	size_t length;
+
+	/* lend_buffers: buffer lent by the fill handler */
+	struct uvc_buffer_desc desc;
+	int queued;
 };
 
 /* ---------------------------------------------------------------------------
@@ -249,12 +256,14 @@ struct uvc_device {
 	enum usb_device_speed speed;
 
 	/* uvc specific flags */
+	int lend_buffers;	/* DMABUF, or USERPTR zero copy: no gadget side buffers */
 	int first_buffer_queued;
 	int uvc_shutdown_requested;
 
 	/* uvc buffer queue and dequeue counters */
 	unsigned long long int qbuf_count;
 	unsigned long long int dqbuf_count;
+	unsigned long long int qbuf_errors;	/* filled, never reached the host */
 
 	/* v4l2 device hook */
 	//struct v4l2_device *vdev;
@@ -324,12 +333,40 @@ static int uvc_video_stream(struct uvc_device *dev, int enable)
 	return 0;
 }
 
+static int uvc_desc_valid(struct uvc_device *dev, struct uvc_buffer_desc *desc)
+{
+	if (dev->io == IO_METHOD_DMABUF)
+		return desc->fd >= 0;
+
+	return desc->start != NULL;
+}
+
+/* Give every lent buffer back to its owner. Gadget must not be streaming. */
+static void uvc_release_lent(struct uvc_device *dev)
+{
+	unsigned int i;
+
+	if (dev->mem == NULL)
+		return;
+
+	for (i = 0; i < dev->nbufs; ++i) {
+		if (uvc_desc_valid(dev, &dev->mem[i].desc) && buffer_release_handler != NULL)
+			buffer_release_handler(&dev->mem[i].desc.priv, dev->fdata);
+	}
+	free(dev->mem);
+	dev->mem = NULL;
+}
+
 static int uvc_uninit_device(struct uvc_device *dev)
 {
 	unsigned int i;
 	int ret;
 
 	switch (dev->io) {
+	case IO_METHOD_DMABUF:
+		uvc_release_lent(dev);
+		break;
+
 	case IO_METHOD_MMAP:
 		for (i = 0; i < dev->nbufs; ++i) {
 			ret = munmap(dev->mem[i].start, dev->mem[i].length);
@@ -344,7 +381,9 @@ static int uvc_uninit_device(struct uvc_device *dev)
 
 	case IO_METHOD_USERPTR:
 	default:
-		if (dev->run_standalone) {
+		if (dev->lend_buffers) {
+			uvc_release_lent(dev);
+		} else if (dev->run_standalone) {
 			for (i = 0; i < dev->nbufs; ++i)
 				free(dev->dummy_buf[i].start);
 
@@ -409,6 +448,60 @@ static void uvc_close(struct uvc_device *dev)
  * UVC streaming related
  */
 
+/*
+ * Ask the fill handler which buffer goes into gadget slot @index and queue it.
+ * The slot keeps its previous buffer when the handler has nothing newer, so
+ * the host gets the last frame again instead of a stall.
+ */
+static int uvc_video_queue_lent(struct uvc_device *dev, unsigned int index)
+{
+	struct buffer *mem = &dev->mem[index];
+	struct uvc_buffer_desc desc = mem->desc;
+	struct v4l2_buffer buf;
+	int ret;
+
+	if (fill_buffer_handler != NULL)
+		fill_buffer_handler(dev->fdata,
+			dev->io == IO_METHOD_DMABUF ? UVC_DATA_MODE_DMABUF : UVC_DATA_MODE_USERPTR,
+			&desc, dev->imgsize);
+
+	/* A new buffer replaced the old one, hand the old one back. */
+	if (uvc_desc_valid(dev, &mem->desc) &&
+		(desc.fd != mem->desc.fd || desc.start != mem->desc.start || desc.priv != mem->desc.priv)) {
+		if (buffer_release_handler != NULL)
+			buffer_release_handler(&mem->desc.priv, dev->fdata);
+	}
+	mem->desc = desc;
+
+	/* Nothing captured yet, try again on next process call. */
+	if (!uvc_desc_valid(dev, &desc))
+		return 0;
+
+	CLEAR(buf);
+	buf.type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+	buf.index = index;
+	if (dev->io == IO_METHOD_DMABUF) {
+		buf.memory = V4L2_MEMORY_DMABUF;
+		buf.m.fd = desc.fd;
+	} else {
+		buf.memory = V4L2_MEMORY_USERPTR;
+		buf.m.userptr = (unsigned long)desc.start;
+	}
+	buf.length = desc.length;
+	buf.bytesused = desc.bytesused ? desc.bytesused : dev->imgsize;
+
+	ret = ioctl(dev->uvc_fd, VIDIOC_QBUF, &buf);
+	if (ret < 0) {
+		DBGERROR("UVC: VIDIOC_QBUF failed : %s (%d).\n", strerror(errno), errno);
+		dev->qbuf_errors++;
+		return ret;
+	}
+	mem->queued = 1;
+	dev->qbuf_count++;
+
+	return 0;
+}
+
 static void uvc_video_fill_buffer(struct uvc_device *dev, struct v4l2_buffer *buf)
 {
 	unsigned int bpl;
@@ -454,11 +547,31 @@ static int uvc_video_process(struct uvc_device *dev)
 		ubuf.memory = V4L2_MEMORY_MMAP;
 		break;
 
+	case IO_METHOD_DMABUF:
+		ubuf.memory = V4L2_MEMORY_DMABUF;
+		break;
+
 	case IO_METHOD_USERPTR:
 	default:
 		ubuf.memory = V4L2_MEMORY_USERPTR;
 		break;
 	}
+	if (dev->lend_buffers) {
+		ret = ioctl(dev->uvc_fd, VIDIOC_DQBUF, &ubuf);
+		if (ret == 0) {
+			dev->dqbuf_count++;
+			dev->mem[ubuf.index].queued = 0;
+		} else if (errno != EAGAIN) {
+			DBGERROR("UVC: VIDIOC_DQBUF failed : %s (%d).\n", strerror(errno), errno);
+		}
+
+		/* Refill the dequeued slot and any slot still waiting for a frame. */
+		for (i = 0; i < dev->nbufs; ++i) {
+			if (!dev->mem[i].queued)
+				uvc_video_queue_lent(dev, i);
+		}
+		return 0;
+	}
 	if (dev->run_standalone) {
 		/* UVC stanalone setup. */
 		ret = ioctl(dev->uvc_fd, VIDIOC_DQBUF, &ubuf);
@@ -476,6 +589,7 @@ static int uvc_video_process(struct uvc_device *dev)
 		ret = ioctl(dev->uvc_fd, VIDIOC_QBUF, &ubuf);
 		if (ret < 0){
 			printf("=======================VIDIOC_QBUF error\n");
+			dev->qbuf_errors++;
 			return ret;
 		}
 		dev->qbuf_count++;
@@ -507,6 +621,7 @@ static int uvc_video_qbuf_mmap(struct uvc_device *dev)
 		ret = ioctl(dev->uvc_fd, VIDIOC_QBUF, &(dev->mem[i].buf));
 		if (ret < 0) {
 			DBGERROR("UVC: VIDIOC_QBUF failed : %s (%d).\n", strerror(errno), errno);
+			dev->qbuf_errors++;
 			return ret;
 		}
 
@@ -547,6 +662,22 @@ static int uvc_video_qbuf_userptr(struct uvc_device *dev)
 	return 0;
 }
 
+static int uvc_video_qbuf_lent(struct uvc_device *dev)
+{
+	unsigned int i;
+	int ret;
+
+	for (i = 0; i < dev->nbufs; ++i) {
+		if (dev->mem[i].queued)
+			continue;
+		ret = uvc_video_queue_lent(dev, i);
+		if (ret < 0)
+			return ret;
+	}
+
+	return 0;
+}
+
 static int uvc_video_qbuf(struct uvc_device *dev)
 {
 	int ret = 0;
@@ -556,8 +687,15 @@ static int uvc_video_qbuf(struct uvc_device *dev)
 		ret = uvc_video_qbuf_mmap(dev);
 		break;
 
+	case IO_METHOD_DMABUF:
+		ret = uvc_video_qbuf_lent(dev);
+		break;
+
 	case IO_METHOD_USERPTR:
-		ret = uvc_video_qbuf_userptr(dev);
+		if (dev->lend_buffers)
+			ret = uvc_video_qbuf_lent(dev);
+		else
+			ret = uvc_video_qbuf_userptr(dev);
 		break;
 
 	default:
@@ -723,6 +861,44 @@ err:
 	return ret;
 }
 
+static int uvc_video_reqbufs_lent(struct uvc_device *dev, int nbufs)
+{
+	struct v4l2_requestbuffers rb;
+	unsigned int i;
+	int ret;
+
+	/* Buffers from an earlier request go back to their owner first. */
+	uvc_release_lent(dev);
+
+	CLEAR(rb);
+
+	rb.count = nbufs;
+	rb.type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+	rb.memory = dev->io == IO_METHOD_DMABUF ? V4L2_MEMORY_DMABUF : V4L2_MEMORY_USERPTR;
+
+	ret = ioctl(dev->uvc_fd, VIDIOC_REQBUFS, &rb);
+	if (ret < 0) {
+		DBGERROR("UVC: VIDIOC_REQBUFS error %s (%d).\n", strerror(errno), errno);
+		return ret;
+	}
+
+	if (!rb.count)
+		return 0;
+
+	dev->mem = calloc(rb.count, sizeof dev->mem[0]);
+	if (!dev->mem) {
+		DBGERROR("UVC: Out of memory\n");
+		return -ENOMEM;
+	}
+	for (i = 0; i < rb.count; ++i)
+		dev->mem[i].desc.fd = -1;
+
+	dev->nbufs = rb.count;
+	DBGVERBOSE("UVC: %u lent buffer slots allocated.\n", rb.count);
+
+	return 0;
+}
+
 static int uvc_video_reqbufs(struct uvc_device *dev, int nbufs)
 {
 	int ret = 0;
@@ -733,9 +909,17 @@ static int uvc_video_reqbufs(struct uvc_device *dev, int nbufs)
 		ret = uvc_video_reqbufs_mmap(dev, nbufs);
 		break;
 
+	case IO_METHOD_DMABUF:
+		printf("IO_METHOD_DMABUF nbufs %d\n", nbufs);
+		ret = uvc_video_reqbufs_lent(dev, nbufs);
+		break;
+
 	case IO_METHOD_USERPTR:
 		printf("IO_METHOD_USERPTR nbufs %d\n", nbufs);
-		ret = uvc_video_reqbufs_userptr(dev, nbufs);
+		if (dev->lend_buffers)
+			ret = uvc_video_reqbufs_lent(dev, nbufs);
+		else
+			ret = uvc_video_reqbufs_userptr(dev, nbufs);
 		break;
 
 	default:
@@ -1580,6 +1764,40 @@ int open_uvc_gadget_device(char *name)
 	return uvc_open(&device, name);
 }
 
+/**
+ *  @brief  select io method of uvc gadget.
+ *  @param[in] io  IO_METHOD_USERPTR(default), IO_METHOD_MMAP or IO_METHOD_DMABUF
+ *  @return zero for success, none zero for error.
+ *  @note   call before init_uvc_gadget_device. With IO_METHOD_DMABUF the fill
+ *          callback gets UVC_DATA_MODE_DMABUF and a struct uvc_buffer_desc, and
+ *          the release callback is called when the gadget drops the buffer.
+ *  @see    init_uvc_gadget_device
+*/
+int set_uvc_gadget_io_method(int io)
+{
+	if (io != IO_METHOD_MMAP && io != IO_METHOD_USERPTR && io != IO_METHOD_DMABUF)
+		return -EINVAL;
+	uvc_io_method = io;
+
+	return 0;
+}
+
+/**
+ *  @brief  let IO_METHOD_USERPTR gadget send application buffers without copy.
+ *  @param[in] enable  non zero to lend buffers, zero to copy into gadget buffers
+ *  @return zero for success, none zero for error.
+ *  @note   call before init_uvc_gadget_device. The fill callback then gets
+ *          UVC_DATA_MODE_USERPTR and a struct uvc_buffer_desc to put a page
+ *          aligned buffer in, given back by the release callback.
+ *  @see    set_uvc_gadget_io_method, alloc_userptr_buffers
+*/
+int set_uvc_gadget_zero_copy(int enable)
+{
+	uvc_zero_copy = enable;
+
+	return 0;
+}
+
 /**
  *  @brief  uvc gadget device open, initialize and querries.
  *  @param[in]  fill_buf_func     Callback function for Fill buffer.
@@ -1592,7 +1810,9 @@ int init_uvc_gadget_device(void *fdata, UVC_BUFFER_FILL_FUNC fill_buf_func, UVC_
 	device->width = 640;
 	device->height = 550;
 	device->fcc = V4L2_PIX_FMT_YUYV;
-	device->io = IO_METHOD_USERPTR;
+	device->io = uvc_io_method;
+	device->lend_buffers = (uvc_io_method == IO_METHOD_DMABUF) ||
+		(uvc_io_method == IO_METHOD_USERPTR && uvc_zero_copy);
 	device->bulk = 1; /* currently not supported. */
 	device->nbufs = 2; /* currently only two buffers would be emough */
 	device->mult = 0;
@@ -1637,9 +1857,6 @@ int init_uvc_gadget_device(void *fdata, UVC_BUFFER_FILL_FUNC fill_buf_func, UVC_
 	fill_buffer_handler = fill_buf_func;
 	buffer_release_handler = release_buf_func;
 
-	/* We are using USERPTR */
-	device->io = IO_METHOD_USERPTR;
-
 	uvc_events_init(device);
 	/* v4l2 process */
 	uvc_video_set_format(device);
@@ -1685,10 +1902,8 @@ int process_uvc_gadget_device(int useconds)
 	nfds = device->uvc_fd + 1;
 
 	ret = select(nfds, &fds_rcv, &fds_snd, &fds_ext, &tv);
-	if (FD_ISSET(device->uvc_fd, &fds_ext))
-		uvc_events_process(device);
-	if (FD_ISSET(device->uvc_fd, &fds_snd))
-		uvc_video_process(device);
+	service_uvc_gadget_device((FD_ISSET(device->uvc_fd, &fds_ext) ? POLLPRI : 0) |
+				  (FD_ISSET(device->uvc_fd, &fds_snd) ? POLLOUT : 0));
 
 	/* we don't have rcv message in this context */
 	if(ret == 0){
@@ -1697,6 +1912,51 @@ int process_uvc_gadget_device(int useconds)
 	return ret;
 }
 
+/**
+ *  @brief  get file descriptor of uvc gadget for an external poll loop.
+ *  @return fd, under zero if gadget is not open.
+ *  @see    service_uvc_gadget_device, reactor_add_uvc_gadget
+*/
+int get_uvc_gadget_fd(void)
+{
+	return device ? device->uvc_fd : -1;
+}
+
+/**
+ *  @brief  get the buffer counters of the uvc gadget.
+ *  @param[out] stats   queue, dequeue and failed queue counts
+ *  @return zero for success, under zero if gadget is not open.
+ *  @note   read before close_uvc_gadget_device.
+*/
+int get_uvc_gadget_stats(struct uvc_gadget_stats *stats)
+{
+	if (!device)
+		return -1;
+	stats->qbuf = device->qbuf_count;
+	stats->dqbuf = device->dqbuf_count;
+	stats->qbuf_errors = device->qbuf_errors;
+
+	return 0;
+}
+
+/**
+ *  @brief  service uvc gadget for ready poll events.
+ *  @param[in]  events  POLLPRI for usb events, POLLOUT for done buffers,
+ *                      zero to only refill lent slots with new frames.
+ *  @return none zero for error
+ *  @see    get_uvc_gadget_fd, process_uvc_gadget_device
+*/
+int service_uvc_gadget_device(unsigned int events)
+{
+	if (events & POLLPRI)
+		uvc_events_process(device);
+	/* lent slots may be idle waiting for a first frame, poll them too */
+	if ((events & POLLOUT) || device->lend_buffers)
+		uvc_video_process(device);
+
+	return 0;
+}
+
 /**
  *  @brief  uvc gadget device close.
  *  @return none
@@ -1714,4 +1974,5 @@ void close_uvc_gadget_device()
         device->is_streaming = 0;
     }
 	uvc_close(device);
+	device = NULL;
 }
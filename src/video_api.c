@@ -25,50 +25,317 @@
 #include <sys/signal.h>
 #include <errno.h>
 #include <stdint.h>
+#include <pthread.h>
 #include <sys/mman.h>
 #include <sys/ioctl.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/syscall.h>
 
 #include <linux/i2c.h>
 #include <linux/i2c-dev.h>
 
-#include <linux/media.h>
-#include <linux/v4l2-subdev.h>
-#include <linux/v4l2-mediabus.h>
 #include <linux/videodev2.h>
+#include <linux/memfd.h>
+#include <linux/dma-buf.h>
 
 #include <linux/mxc_v4l2.h>
 
 #include <capis.h>
 
-struct buffer {
+/* udmabuf turns memfd pages into a dma-buf, kernel 4.20 and later. */
+#ifndef UDMABUF_CREATE
+struct udmabuf_create {
+	__u32 memfd;
+	__u32 flags;
+	__u64 offset;
+	__u64 size;
+};
+#define UDMABUF_FLAGS_CLOEXEC	0x01
+#define UDMABUF_CREATE		_IOW('u', 0x42, struct udmabuf_create)
+#endif
+
+#ifndef F_ADD_SEALS
+#define F_ADD_SEALS		(1024 + 9)
+#define F_SEAL_SHRINK		0x0002
+#endif
+
+#if defined(CAPTURE_MPLANE)
+#define CAPTURE_BUF_TYPE	V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE
+#else
+#define CAPTURE_BUF_TYPE	V4L2_BUF_TYPE_VIDEO_CAPTURE
+#endif
+
+struct plane {
         void   *start;
+        unsigned int length;
+        unsigned int bytesused;	/* of last dequeue */
+};
+
+struct buffer {
+        void   *start;		/* plane 0 for multi planar */
         size_t offset;
         unsigned int length;
+        int    dmabuf_fd;	/* exported or imported dma-buf, -1 if none */
+        int    queued;		/* owned by the driver queue */
+#if defined(CAPTURE_MPLANE)
+        int    num_planes;
+        struct plane planes[VIDEO_MAX_PLANES];
+        struct v4l2_plane v4l2_planes[VIDEO_MAX_PLANES];	/* of last dequeue, for requeue */
+#endif
+};
+
+/* application owned buffers for IO_METHOD_USERPTR, count 0 if none given */
+struct userptr_pool {
+	void **start;
+	unsigned int length;
+	int count;
+};
+
+/* One capture node. Module values index contexts[], MODULE_RGB and
+   MODULE_3DDEPTH are the two built in ones. */
+struct video_context {
+	char dev_name[64];
+	int kind;		/* MODULE_RGB or MODULE_3DDEPTH, picks the defaults */
+	int fd;
+	int io;			/* io method the buffers were set up with */
+	int memory;		/* v4l2 memory type the queue was set up with */
+	int cap_fmt;
+	int num_planes;
+	unsigned int frame_size;	/* negotiated bytes per frame, all planes */
+	unsigned int width;		/* negotiated, of plane 0 */
+	unsigned int height;
+	unsigned int bytesperline;
+	struct buffer *buffers;
+	int n_buffers;
+	struct userptr_pool pool;
+	struct video_stats stats;
+	int nowait;		/* fd is polled by the caller, see set_video_wait */
+	int cpu_access;		/* VIDEO_CPU_xxx, see set_video_cpu_access */
+	unsigned int qbuf_flags;	/* cache hints for QBUF and PREPARE_BUF */
+	volatile int streaming;
+	int stall_ms;		/* watchdog, 0 for default, under zero for off */
+	int failed_recoveries;	/* restarts since the last good frame */
+	unsigned long long last_frame_us;	/* or STREAMON time */
+	struct video_timeline timeline;
+	unsigned long long mark_us;	/* end of the last timeline step */
+	int timing;		/* timeline runs until the first frame */
+};
+
+/*
+ * Probe cache. Enumerating sizes and formats and the crop probes give the
+ * same answers on every start for the same sensor, so a node whose
+ * driver/card/bus_info was set up once skips them. Kept in a file to
+ * survive reboots.
+ */
+#define MAX_PROBE_ENTRIES	16
+#define DEFAULT_PROBE_CACHE	"/var/tmp/rgbd_video.probe"
+
+struct probe_entry {
+	char driver[16];
+	char card[32];
+	char bus_info[32];
+	unsigned int fourcc;
+	int width;
+	int height;
 };
 
-static int fd_rgb;
-static int fd_3d;
+static struct video_context ctx_rgb = {
+	.dev_name = "/dev/video0", .kind = MODULE_RGB, .fd = -1,
+	.io = IO_METHOD_MMAP, .memory = V4L2_MEMORY_MMAP,
+	.cap_fmt = V4L2_PIX_FMT_YUYV, .num_planes = 1,
+	.cpu_access = VIDEO_CPU_RW,
+};
+static struct video_context ctx_3d = {
+	.dev_name = "/dev/video1", .kind = MODULE_3DDEPTH, .fd = -1,
+	.io = IO_METHOD_MMAP, .memory = V4L2_MEMORY_MMAP,
+	.cap_fmt = V4L2_PIX_FMT_SBGGR12P, .num_planes = 1,
+	.cpu_access = VIDEO_CPU_RW,
+};
 
-static int n_buffers_3d;
-static int n_buffers_rgb;
+static struct video_context *contexts[MAX_VIDEO_CONTEXTS] = {
+	[MODULE_RGB] = &ctx_rgb,
+	[MODULE_3DDEPTH] = &ctx_3d,
+};
+static pthread_mutex_t contexts_lock = PTHREAD_MUTEX_INITIALIZER;
 
 static int g_capture_mode = 0;
-static int g_cap_fmt_rgb;
-static int g_cap_fmt_3d;
-static int g_io;
+static int g_io = IO_METHOD_MMAP;
 static int g_camera_framerate = 30;
 static int g_input = 0;
 
-static struct buffer *buffers_3d;
-static struct buffer *buffers_rgb;
+static char probe_path[128] = DEFAULT_PROBE_CACHE;
+static struct probe_entry probe_cache[MAX_PROBE_ENTRIES];
+static int probe_count = -1;	/* not loaded */
+static pthread_mutex_t probe_lock = PTHREAD_MUTEX_INITIALIZER;
 
 #define DBG_ENTER()	DBGINFO("enter %s\n", __func__)
 #define DBG_EXIT()	DBGINFO("exit %s\n", __func__)
 
 #define CLEAR(x) memset(&(x), 0, sizeof(x))
-#define errno_exit(s)		DBGERROR("%s error %d, %s\n", s, errno, strerror(errno));exit(EXIT_FAILURE)
+#define errno_return(s)		do { DBGERROR("%s error %d, %s\n", s, errno, strerror(errno)); return errno_to_error(errno); } while (0)
+
+/* frame periods without a frame before the stream is restarted */
+#define STALL_FRAMES		8
+/* restarts without a frame in between before giving up with VIDEO_ERR_TIMEOUT */
+#define MAX_RECOVERY		3
+
+static int errno_to_error(int err)
+{
+	switch (err) {
+	case ENODEV:
+	case ENXIO:
+		return VIDEO_ERR_NODEV;
+	case ENOMEM:
+		return VIDEO_ERR_NOMEM;
+	case ETIMEDOUT:
+		return VIDEO_ERR_TIMEOUT;
+	default:
+		return VIDEO_ERR_IO;
+	}
+}
+
+static unsigned long long mono_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* close the running timeline step */
+static void timeline_mark(struct video_context *ctx, const char *step)
+{
+	struct video_timeline *tl = &ctx->timeline;
+	unsigned long long now = mono_us();
+
+	if (tl->count < VIDEO_TIMELINE_STEPS) {
+		tl->steps[tl->count].step = step;
+		tl->steps[tl->count].us = now - ctx->mark_us;
+		tl->count++;
+	}
+	tl->total_us += now - ctx->mark_us;
+	ctx->mark_us = now;
+}
+
+static void timeline_print(struct video_context *ctx)
+{
+	struct video_timeline *tl = &ctx->timeline;
+	int i;
+
+	DBGPRINT("%s startup%s:\n", ctx->dev_name, tl->cached ? " (cached probe)" : "");
+	for (i = 0; i < tl->count; i++) {
+		DBGPRINT("  %-12s %4u.%03u ms\n", tl->steps[i].step,
+			 tl->steps[i].us / 1000, tl->steps[i].us % 1000);
+	}
+	DBGPRINT("  %-12s %4u.%03u ms\n", "total", tl->total_us / 1000, tl->total_us % 1000);
+}
+
+static void probe_load(void)
+{
+	struct probe_entry *e;
+	char line[160], *f[6], *p;
+	FILE *fp;
+	int i;
+
+	probe_count = 0;
+	if (!probe_path[0] || !(fp = fopen(probe_path, "r")))
+		return;
+	while (probe_count < MAX_PROBE_ENTRIES && fgets(line, sizeof(line), fp)) {
+		/* driver, card, bus_info, fourcc, width, height; tab separated */
+		line[strcspn(line, "\n")] = 0;
+		p = line;
+		for (i = 0; i < 6 && p; i++) {
+			f[i] = p;
+			p = strchr(p, '\t');
+			if (p)
+				*p++ = 0;
+		}
+		if (i < 6)
+			continue;
+		e = &probe_cache[probe_count++];
+		CLEAR(*e);
+		strncpy(e->driver, f[0], sizeof(e->driver) - 1);
+		strncpy(e->card, f[1], sizeof(e->card) - 1);
+		strncpy(e->bus_info, f[2], sizeof(e->bus_info) - 1);
+		e->fourcc = strtoul(f[3], NULL, 16);
+		e->width = atoi(f[4]);
+		e->height = atoi(f[5]);
+	}
+	fclose(fp);
+}
+
+static void probe_save(void)
+{
+	FILE *fp;
+	int i;
+
+	if (!probe_path[0] || !(fp = fopen(probe_path, "w")))
+		return;
+	for (i = 0; i < probe_count; i++) {
+		fprintf(fp, "%s\t%s\t%s\t%08x\t%d\t%d\n", probe_cache[i].driver,
+			probe_cache[i].card, probe_cache[i].bus_info, probe_cache[i].fourcc,
+			probe_cache[i].width, probe_cache[i].height);
+	}
+	fclose(fp);
+}
+
+static void probe_key(struct probe_entry *e, struct v4l2_capability *cap,
+		      unsigned int fourcc, int width, int height)
+{
+	CLEAR(*e);
+	/* tabs would break the file format */
+	snprintf(e->driver, sizeof(e->driver), "%.*s", (int)strcspn((char *)cap->driver, "\t\n"), cap->driver);
+	snprintf(e->card, sizeof(e->card), "%.*s", (int)strcspn((char *)cap->card, "\t\n"), cap->card);
+	snprintf(e->bus_info, sizeof(e->bus_info), "%.*s", (int)strcspn((char *)cap->bus_info, "\t\n"), cap->bus_info);
+	e->fourcc = fourcc;
+	e->width = width;
+	e->height = height;
+}
+
+static int probe_find(struct probe_entry *key)
+{
+	int i;
+
+	if (probe_count < 0)
+		probe_load();
+	for (i = 0; i < probe_count; i++) {
+		if (!memcmp(&probe_cache[i], key, sizeof(*key)))
+			return i;
+	}
+
+	return -1;
+}
+
+/* remember a node that initialized fine, or forget one that did not */
+static void probe_update(struct probe_entry *key, int good)
+{
+	int i;
+
+	pthread_mutex_lock(&probe_lock);
+	i = probe_find(key);
+	if (good && i < 0) {
+		if (probe_count == MAX_PROBE_ENTRIES) {
+			/* drop the oldest */
+			memmove(&probe_cache[0], &probe_cache[1], (MAX_PROBE_ENTRIES - 1) * sizeof(*key));
+			probe_count--;
+		}
+		probe_cache[probe_count++] = *key;
+		probe_save();
+	} else if (!good && i >= 0) {
+		memmove(&probe_cache[i], &probe_cache[i + 1], (probe_count - i - 1) * sizeof(*key));
+		probe_count--;
+		probe_save();
+	}
+	pthread_mutex_unlock(&probe_lock);
+}
+
+static struct video_context *get_context(int module)
+{
+	if (module < 0 || module >= MAX_VIDEO_CONTEXTS)
+		return NULL;
+	return contexts[module];
+}
 
 static int xioctl(int fh, int request, void *arg)
 {
@@ -78,10 +345,9 @@ static int xioctl(int fh, int request, void *arg)
 		r = ioctl(fh, request, arg);
 	} while (r == -1 && ((errno == EINTR) || (errno == EAGAIN)));
 	
-	if (r == -1) {
-		DBGERROR("error %d, %s\n", errno, strerror(errno));
-		exit(EXIT_FAILURE);
-	}
+	/* callers decide what a failure means, errno is kept */
+	if (r == -1)
+		DBGINFO("ioctl 0x%X error %d, %s\n", request, errno, strerror(errno));
 	return r;
 }
 
@@ -94,56 +360,356 @@ static void print_pixelformat(char *prefix, int val)
 					(val >> 24) & 0xff);
 }
 
+/**
+ *  @brief "C" make a capture context for another V4L2 node
+ *  @param[in] dev_name  video node, e.g. "/dev/video4"
+ *  @param[in] kind      MODULE_RGB or MODULE_3DDEPTH, gives the default format
+ *  @return \b module value of the new context, use it like MODULE_RGB
+ *          \b under zero value indicated the error
+ *  @note  every context has its own buffers, format and stats, so several
+ *         sensor heads run in one process. The node is opened by
+ *         open_video_device as usual.
+ *  @see   destroy_video_context, set_video_device_name
+*/
+int create_video_context(const char *dev_name, int kind)
+{
+	struct video_context *ctx;
+	int module;
+
+	if (kind != MODULE_RGB && kind != MODULE_3DDEPTH)
+		return -1;
+	ctx = calloc(1, sizeof(*ctx));
+	if (!ctx)
+		return -1;
+	*ctx = (kind == MODULE_RGB) ? ctx_rgb : ctx_3d;
+	memset(&ctx->stats, 0, sizeof(ctx->stats));
+	ctx->fd = -1;
+	ctx->buffers = NULL;
+	ctx->n_buffers = 0;
+	CLEAR(ctx->pool);
+	strncpy(ctx->dev_name, dev_name, sizeof(ctx->dev_name) - 1);
+
+	pthread_mutex_lock(&contexts_lock);
+	for (module = MODULE_3DDEPTH + 1; module < MAX_VIDEO_CONTEXTS; module++) {
+		if (!contexts[module]) {
+			contexts[module] = ctx;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&contexts_lock);
+	if (module == MAX_VIDEO_CONTEXTS) {
+		DBGERROR("no free video context for %s\n", dev_name);
+		free(ctx);
+		return -1;
+	}
+
+	return module;
+}
+
+/**
+ *  @brief "C" free a context from create_video_context
+ *  @param[in] module  module value from create_video_context
+ *  @return none
+ *  @note  uninit and close the device first. built in modules are kept.
+*/
+void destroy_video_context(int module)
+{
+	struct video_context *ctx;
+
+	if (module <= MODULE_3DDEPTH || !(ctx = get_context(module)))
+		return;
+	pthread_mutex_lock(&contexts_lock);
+	contexts[module] = NULL;
+	pthread_mutex_unlock(&contexts_lock);
+	free(ctx);
+}
+
+/**
+ *  @brief "C" change the video node of a module
+ *  @param[in] module    video module
+ *  @param[in] dev_name  video node
+ *  @return \b 0 for success
+ *          \b under zero value indicated the error
+ *  @note  call before open_video_device.
+*/
+int set_video_device_name(int module, const char *dev_name)
+{
+	struct video_context *ctx = get_context(module);
+
+	if (!ctx)
+		return -1;
+	strncpy(ctx->dev_name, dev_name, sizeof(ctx->dev_name) - 1);
+	ctx->dev_name[sizeof(ctx->dev_name) - 1] = 0;
+
+	return 0;
+}
+
+/**
+ *  @brief "C" get the video node of a module
+ *  @param[in] module    video module
+ *  @return \b node name, NULL for a bad module
+*/
+const char *get_video_device_name(int module)
+{
+	struct video_context *ctx = get_context(module);
+
+	return ctx ? ctx->dev_name : NULL;
+}
+
+/**
+ *  @brief "C" get the negotiated frame size of a module
+ *  @param[in] module    video module
+ *  @return \b bytes per frame, all planes back to back as dequeue_and_capture
+ *             copies them
+ *          \b under zero value indicated the error, e.g. before init_video_device
+*/
+int get_video_frame_size(int module)
+{
+	struct video_context *ctx = get_context(module);
+
+	if (!ctx || !ctx->frame_size)
+		return VIDEO_ERR_INVALID;
+
+	return ctx->frame_size;
+}
+
+/**
+ *  @brief "C" get the negotiated format of a module
+ *  @param[in]  module        video module
+ *  @param[out] width         pixels, may be NULL
+ *  @param[out] height        rows, may be NULL
+ *  @param[out] bytesperline  of plane 0, may be NULL. zero when the
+ *                            driver did not say
+ *  @return \b 0 for success
+ *          \b under zero value indicated the error, e.g. before init_video_device
+ *  @note   the driver may have changed what init_video_device asked for.
+*/
+int get_video_format(int module, unsigned int *width, unsigned int *height,
+		     unsigned int *bytesperline)
+{
+	struct video_context *ctx = get_context(module);
+
+	if (!ctx || !ctx->frame_size)
+		return VIDEO_ERR_INVALID;
+	if (width)
+		*width = ctx->width;
+	if (height)
+		*height = ctx->height;
+	if (bytesperline)
+		*bytesperline = ctx->bytesperline;
+
+	return 0;
+}
+
+/**
+ *  @brief "C" get frame counters of a module
+ *  @param[in]  module  video module
+ *  @param[out] stats   counters since init_video_device
+ *  @return \b 0 for success
+ *          \b under zero value indicated the error
+*/
+int get_video_stats(int module, struct video_stats *stats)
+{
+	struct video_context *ctx = get_context(module);
+
+	if (!ctx)
+		return -1;
+	*stats = ctx->stats;
+
+	return 0;
+}
+
+/**
+ *  @brief "C" get the startup timeline of a module
+ *  @param[in]  module  video module
+ *  @param[out] tl      time per step from open_video_device to the first frame
+ *  @return \b 0 for success
+ *          \b under zero value indicated the error
+ *  @note  the timeline is also printed when the first frame arrives.
+*/
+int get_video_timeline(int module, struct video_timeline *tl)
+{
+	struct video_context *ctx = get_context(module);
+
+	if (!ctx)
+		return -1;
+	*tl = ctx->timeline;
+
+	return 0;
+}
+
+/**
+ *  @brief "C" set the probe cache file
+ *  @param[in] path  cache file, NULL or "" to always probe
+ *  @return \b 0 for success
+ *          \b under zero value indicated the error
+ *  @note  init_video_device skips size/format enumeration and the crop
+ *         probes for a node whose driver, card, bus_info, format and size
+ *         are in the cache. Delete the file after changing sensor drivers.
+*/
+int set_video_probe_cache(const char *path)
+{
+	if (path && strlen(path) >= sizeof(probe_path))
+		return -1;
+	pthread_mutex_lock(&probe_lock);
+	snprintf(probe_path, sizeof(probe_path), "%s", path ? path : "");
+	probe_count = -1;
+	pthread_mutex_unlock(&probe_lock);
+
+	return 0;
+}
+
+static void update_stats(struct video_context *ctx, struct v4l2_buffer *buf)
+{
+	struct video_stats *st = &ctx->stats;
+
+	/* the driver skips sequence numbers for frames it had no buffer for */
+	if (st->frames && buf->sequence > st->last_sequence + 1)
+		st->sequence_gaps += buf->sequence - st->last_sequence - 1;
+	st->frames++;
+	st->bytes += buf->bytesused;
+	st->last_sequence = buf->sequence;
+	st->last_timestamp = buf->timestamp;
+
+	if (ctx->timing) {
+		ctx->timing = 0;
+		timeline_mark(ctx, "first frame");
+		timeline_print(ctx);
+	}
+}
+
 /**
  *  @brief "C" video device open
- *  @param[in] module  0 for RGB camera, 1 for Depth-3D
- *  @param[out] fd for RGB camera and Depth-3D.           
+ *  @param[in] module  0 for RGB camera, 1 for Depth-3D, or a module value
+ *                     from create_video_context
  *
  *  @return \b 0 for successful open
  *          \b under zero value indicated the error
-            \b does not returns error code, because failure make immediately exit.
- *  @see   close_video_device
+            \b VIDEO_ERR_NODEV if the node can not be opened.
+ *  @see   close_video_device, set_video_device_name
 */
 int open_video_device(int module)
 {
+	struct video_context *ctx = get_context(module);
 	int fd;
-	char *dev_name;
 
 	DBG_ENTER();
 
-	if (module == MODULE_RGB)
-		dev_name = "/dev/video0";
-	else
-	if (module == MODULE_3DDEPTH)
-		dev_name = "/dev/video1";
-	else
-		return -1;
+	if (!ctx)
+		return VIDEO_ERR_INVALID;
 
-	fd = open(dev_name, O_RDWR , 0); ///* required */ | O_NONBLOC
+	CLEAR(ctx->timeline);
+	ctx->timing = 1;
+	ctx->mark_us = mono_us();
+	fd = open(ctx->dev_name, O_RDWR , 0); ///* required */ | O_NONBLOC
 	if (-1 == fd) {
-		DBGERROR("Video device open failed(%s).\n", dev_name);
-		exit(EXIT_FAILURE);
+		DBGERROR("Video device open failed(%s).\n", ctx->dev_name);
+		return VIDEO_ERR_NODEV;
 	}
-	if (module == MODULE_RGB)
-		fd_rgb = fd;
-	else
-	if (module == MODULE_3DDEPTH)
-		fd_3d = fd;
-	else
+	ctx->fd = fd;
+	timeline_mark(ctx, "open");
+
+	return 0;
+}
+
+/**
+ *  @brief "C" select io method of capture devices
+ *  @param[in] io  IO_METHOD_MMAP, IO_METHOD_USERPTR or IO_METHOD_DMABUF
+ *  @return \b 0 for success
+ *          \b under zero value for unsupported method
+ *          \b VIDEO_ERR_UNSUPPORTED for USERPTR or DMABUF with CAPTURE_MPLANE
+ *  @note  call before init_video_device. With IO_METHOD_DMABUF the driver
+ *         buffers are exported with VIDIOC_EXPBUF, or memfd backed dma-bufs
+ *         are imported when the driver can not export. With IO_METHOD_USERPTR
+ *         the driver fills the pool given by set_video_userptr_pool.
+ *         each module keeps the method it was initialized with.
+ *  @see   get_video_dmabuf, set_video_userptr_pool
+*/
+int set_video_io_method(int io)
+{
+	if (io != IO_METHOD_MMAP && io != IO_METHOD_USERPTR && io != IO_METHOD_DMABUF)
+		return -1;
+#if defined(CAPTURE_MPLANE)
+	/* init_userp and init_dmabuf are single planar, only MMAP has planes */
+	if (io != IO_METHOD_MMAP)
+		return VIDEO_ERR_UNSUPPORTED;
+#endif
+	g_io = io;
+
+	return 0;
+}
+
+/**
+ *  @brief "C" select capture pixel format of a module
+ *  @param[in] module  video module
+ *  @param[in] fourcc  V4L2_PIX_FMT_xxx, e.g. V4L2_PIX_FMT_NV12M for multi planar
+ *  @return \b 0 for success
+ *          \b under zero value indicated the error
+ *  @note  call before init_video_device. defaults are YUYV for rgb and
+ *         SBGGR12P for 3d depth.
+*/
+int set_video_pixel_format(int module, unsigned int fourcc)
+{
+	struct video_context *ctx = get_context(module);
+
+	if (!ctx)
+		return -1;
+	ctx->cap_fmt = fourcc;
+
+	return 0;
+}
+
+/**
+ *  @brief "C" give application buffers for IO_METHOD_USERPTR capture
+ *  @param[in] module  video module
+ *  @param[in] start   buffer pointers, page aligned, kept by caller until uninit
+ *  @param[in] length  size of each buffer, at least the image size
+ *  @param[in] count   number of buffers, replaces num_of_driverbuf
+ *  @return \b 0 for success
+ *          \b under zero value indicated the error
+ *  @note  without a pool init_video_device allocates the buffers itself.
+ *  @see   alloc_userptr_buffers, set_video_io_method
+*/
+int set_video_userptr_pool(int module, void **start, unsigned int length, int count)
+{
+	struct video_context *ctx = get_context(module);
+
+	if (!ctx)
 		return -1;
 
-	/* currently only MMAP support */
-	g_io = IO_METHOD_MMAP;
+	ctx->pool.start = start;
+	ctx->pool.length = length;
+	ctx->pool.count = start ? count : 0;
+
+	return 0;
+}
+
+/**
+ *  @brief "C" choose whether dequeue waits for a frame
+ *  @param[in] module  video module
+ *  @param[in] wait    non zero to select() in dequeue (default), zero when
+ *                     the caller only dequeues after its own poll said the
+ *                     fd is readable, e.g. from a reactor handler.
+ *  @return \b 0 for success
+ *          \b under zero value indicated the error
+ *  @see   reactor_add_video
+*/
+int set_video_wait(int module, int wait)
+{
+	struct video_context *ctx = get_context(module);
+
+	if (!ctx)
+		return -1;
+	ctx->nowait = !wait;
 
 	return 0;
 }
 
 int get_fd(int module)
 {
-	if (module == MODULE_RGB)
-		return fd_rgb;	
-	else if(module == MODULE_3DDEPTH)
-		return fd_3d;
+	struct video_context *ctx = get_context(module);
+
+	return ctx ? ctx->fd : -1;
 }
 
 /**
@@ -159,12 +725,9 @@ int vidioc_set_ctrl(int module, int ctrl_id, int value)
 {
 	struct v4l2_control ctrl;
 	int fd;
-	if (module == MODULE_RGB)
-		fd = fd_rgb;
-	else
-	if (module == MODULE_3DDEPTH)
-		fd = fd_3d;
-	else
+
+	fd = get_fd(module);
+	if (fd < 0)
 		return -1;
 
 
@@ -176,20 +739,15 @@ int vidioc_set_ctrl(int module, int ctrl_id, int value)
 	return ioctl(fd, VIDIOC_S_CTRL, &ctrl);
 }
 
-static int init_mmap(int module, int num_of_driverbuf)
+static int init_mmap(struct video_context *ctx, int num_of_driverbuf)
 {
 	struct v4l2_requestbuffers req;
-	int  n_buffers,fd;
+	int  n_buffers,fd,ret;
 	char *dev_name;
 	struct buffer *buffers;
 
-	if (module == MODULE_3DDEPTH) {
-		dev_name = "/dev/video1";
-		fd = fd_3d;
-	} else {
-		dev_name = "/dev/video0";
-		fd = fd_rgb;
-	}
+	dev_name = ctx->dev_name;
+	fd = ctx->fd;
 
 	DBG_ENTER();
 	CLEAR(req);
@@ -208,9 +766,9 @@ static int init_mmap(int module, int num_of_driverbuf)
 		if (EINVAL == errno) {
 			DBGERROR("%s does not support "
 					 "memory mappingn", dev_name);
-			exit(EXIT_FAILURE);
+			return VIDEO_ERR_UNSUPPORTED;
 		} else {
-			errno_exit("VIDIOC_REQBUFS");
+			errno_return("VIDIOC_REQBUFS");
 		}
 	}
 	DBGPRINT("VIDIOC_REQBUFS done\n");
@@ -218,88 +776,427 @@ static int init_mmap(int module, int num_of_driverbuf)
 	if (req.count < 2) {
 		DBGERROR("Insufficient buffer memory on %s\n",
 					 dev_name);
-		exit(EXIT_FAILURE);
+		return VIDEO_ERR_NOMEM;
 	}
 
-	if (fd == fd_3d) {
-		buffers_3d = calloc(req.count, sizeof(*buffers_3d));
-		if (!buffers_3d) {
-			DBGERROR("Out of memory\n");
-			exit(EXIT_FAILURE);
-		}
-		buffers = buffers_3d;
-	}
-	else {
-		buffers_rgb = calloc(req.count, sizeof(*buffers_rgb));
-		if (!buffers_rgb) {
-			DBGERROR("Out of memory\n");
-			exit(EXIT_FAILURE);
-		}
-		buffers = buffers_rgb;
+	buffers = calloc(req.count, sizeof(*buffers));
+	if (!buffers) {
+		DBGERROR("Out of memory\n");
+		return VIDEO_ERR_NOMEM;
 	}
+	ctx->buffers = buffers;
+	ctx->memory = V4L2_MEMORY_MMAP;
 
 
 	for (n_buffers = 0; n_buffers < req.count; ++n_buffers) {
 		struct v4l2_buffer buf;
 #if defined(CAPTURE_MPLANE)
-		int i;
-		struct v4l2_plane planes[FMT_NUM_PLANES];
+		int i, num_planes;
+		struct v4l2_plane planes[VIDEO_MAX_PLANES];
+
+		num_planes = ctx->num_planes;
 #endif
 
 		CLEAR(buf);
 
 #if defined(CAPTURE_MPLANE)
+		CLEAR(planes);
 		buf.type        = req.type;
 		buf.memory      = V4L2_MEMORY_MMAP;
 		buf.index       = n_buffers;
-		buf.length		= FMT_NUM_PLANES;
+		buf.length		= num_planes;
 		buf.m.planes 	= planes;
 
 		if (-1 == xioctl(fd, VIDIOC_QUERYBUF, &buf)) {
-			errno_exit("VIDIOC_QUERYBUF");
+			ret = errno_to_error(errno);
+			DBGERROR("VIDIOC_QUERYBUF error %d, %s\n", errno, strerror(errno));
+			goto err;
 		}
 
-		for(i=0; i<FMT_NUM_PLANES; i++) {
-			buffers[n_buffers].length[i] = planes[i].length;
-			buffers[n_buffers].start[i] =
+		buffers[n_buffers].num_planes = 0;
+		for(i=0; i<buf.length; i++) {
+			buffers[n_buffers].planes[i].length = planes[i].length;
+			buffers[n_buffers].planes[i].start =
 					mmap(NULL /* start anywhere */,
 						 planes[i].length,
 						  PROT_READ | PROT_WRITE /* required */,
 						  MAP_SHARED /* recommended */,
 						  fd, planes[i].m.mem_offset);
 
-			if (MAP_FAILED == buffers[n_buffers].start[i]) {
-				errno_exit("mmap");
+			if (MAP_FAILED == buffers[n_buffers].planes[i].start) {
+				ret = errno_to_error(errno);
+				DBGERROR("mmap error %d, %s\n", errno, strerror(errno));
+				n_buffers++;	/* unmap the planes done so far */
+				goto err;
 			}
+			buffers[n_buffers].num_planes++;
 		}
+		buffers[n_buffers].start = buffers[n_buffers].planes[0].start;
+		buffers[n_buffers].length = buffers[n_buffers].planes[0].length;
+		buffers[n_buffers].offset = planes[0].m.mem_offset;
 #else
 		buf.type        = req.type;
 		buf.memory      = V4L2_MEMORY_MMAP;
 		buf.index       = n_buffers;
 
 		if (-1 == xioctl(fd, VIDIOC_QUERYBUF, &buf)) {
-			errno_exit("VIDIOC_QUERYBUF");
+			ret = errno_to_error(errno);
+			DBGERROR("VIDIOC_QUERYBUF error %d, %s\n", errno, strerror(errno));
+			goto err;
 		}
 		buffers[n_buffers].length = buf.length;
 		buffers[n_buffers].offset = (size_t) buf.m.offset;
 		buffers[n_buffers].start = mmap (NULL, buffers[n_buffers].length,
 			PROT_READ | PROT_WRITE, MAP_SHARED,
 			fd, buffers[n_buffers].offset);
-		memset(buffers[n_buffers].start, 0xFF, buffers[n_buffers].length);
+		if (MAP_FAILED == buffers[n_buffers].start) {
+			ret = errno_to_error(errno);
+			DBGERROR("mmap error %d, %s\n", errno, strerror(errno));
+			goto err;
+		}
+#endif
+		buffers[n_buffers].dmabuf_fd = -1;
+	}
+	ctx->n_buffers = n_buffers;
+
+	DBG_EXIT();
+
+	return 0;
+
+err:
+	while (n_buffers--) {
+#if defined(CAPTURE_MPLANE)
+		int i;
+
+		for (i = 0; i < buffers[n_buffers].num_planes; i++)
+			munmap(buffers[n_buffers].planes[i].start, buffers[n_buffers].planes[i].length);
+#else
+		munmap(buffers[n_buffers].start, buffers[n_buffers].length);
 #endif
 	}
-	if (fd == fd_3d) {
-		n_buffers_3d = n_buffers;
+	free(buffers);
+	ctx->buffers = NULL;
+	ctx->n_buffers = 0;
+
+	return ret;
+}
+
+/**
+ *  @brief  "C" allocate memfd backed dma-buf
+ *  @param[in]  size   size of buffer in bytes
+ *  @param[out] start  cpu mapping of the buffer
+ *  @return \b dma-buf fd for success
+ *          \b under zero value indicated the error
+ *  @note   needs /dev/udmabuf, so plain Linux boxes without a dma-buf
+ *          exporter can still run the DMABUF path.
+ *  @see    free_dmabuf
+*/
+int alloc_dmabuf(unsigned int size, void **start)
+{
+	struct udmabuf_create create;
+	int memfd, devfd, fd;
+	long page = sysconf(_SC_PAGESIZE);
+
+	size = (size + page - 1) & ~(page - 1);
+
+	memfd = syscall(__NR_memfd_create, "uvc-dmabuf", MFD_ALLOW_SEALING);
+	if (memfd < 0) {
+		DBGERROR("memfd_create failed %d, %s\n", errno, strerror(errno));
+		return -1;
+	}
+	/* udmabuf refuses memfds which could shrink under it */
+	if (ftruncate(memfd, size) < 0 || fcntl(memfd, F_ADD_SEALS, F_SEAL_SHRINK) < 0) {
+		DBGERROR("memfd setup failed %d, %s\n", errno, strerror(errno));
+		close(memfd);
+		return -1;
+	}
+
+	devfd = open("/dev/udmabuf", O_RDWR);
+	if (devfd < 0) {
+		DBGERROR("/dev/udmabuf open failed %d, %s\n", errno, strerror(errno));
+		close(memfd);
+		return -1;
+	}
+	CLEAR(create);
+	create.memfd = memfd;
+	create.flags = UDMABUF_FLAGS_CLOEXEC;
+	create.offset = 0;
+	create.size = size;
+	fd = ioctl(devfd, UDMABUF_CREATE, &create);
+	close(devfd);
+	if (fd < 0) {
+		DBGERROR("UDMABUF_CREATE failed %d, %s\n", errno, strerror(errno));
+		close(memfd);
+		return -1;
+	}
+
+	*start = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+	/* the mapping and the dma-buf both hold the pages now */
+	close(memfd);
+	if (*start == MAP_FAILED) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+/**
+ *  @brief  "C" free buffer from alloc_dmabuf
+ *  @param[in]  fd     dma-buf fd
+ *  @param[in]  start  cpu mapping of the buffer
+ *  @param[in]  size   size given to alloc_dmabuf
+ *  @return none
+ *  @see    alloc_dmabuf
+*/
+void free_dmabuf(int fd, void *start, unsigned int size)
+{
+	long page = sysconf(_SC_PAGESIZE);
+
+	size = (size + page - 1) & ~(page - 1);
+	if (start)
+		munmap(start, size);
+	if (fd >= 0)
+		close(fd);
+}
+
+static int init_dmabuf(struct video_context *ctx, int num_of_driverbuf, unsigned int sizeimage)
+{
+	struct v4l2_requestbuffers req;
+	struct v4l2_exportbuffer expbuf;
+	struct buffer *buffers;
+	int i, n_buffers, fd, ret;
+
+	DBG_ENTER();
+	/* Prefer the driver's own buffers, exporting them costs no memory. */
+	ret = init_mmap(ctx, num_of_driverbuf);
+	if (ret)
+		return ret;
+
+	fd = ctx->fd;
+	buffers = ctx->buffers;
+	n_buffers = ctx->n_buffers;
+
+	for (i = 0; i < n_buffers; i++) {
+		CLEAR(expbuf);
+		expbuf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+		expbuf.index = i;
+		expbuf.flags = O_RDWR | O_CLOEXEC;
+		if (ioctl(fd, VIDIOC_EXPBUF, &expbuf) < 0)
+			break;
+		buffers[i].dmabuf_fd = expbuf.fd;
+	}
+	if (i == n_buffers) {
+		DBGPRINT("VIDIOC_EXPBUF done\n");
+		DBG_EXIT();
+		return 0;
+	}
+
+	/* Driver can not export, import memfd backed dma-bufs instead. */
+	DBGPRINT("VIDIOC_EXPBUF failed(%s), import memfd buffers\n", strerror(errno));
+	for (i = 0; i < n_buffers; i++) {
+		if (buffers[i].dmabuf_fd >= 0)
+			close(buffers[i].dmabuf_fd);
+		munmap(buffers[i].start, buffers[i].length);
+	}
+	CLEAR(req);
+	req.count = 0;
+	req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	req.memory = V4L2_MEMORY_MMAP;
+	xioctl(fd, VIDIOC_REQBUFS, &req);
+	ctx->n_buffers = 0;
+
+	req.count = n_buffers;
+	req.memory = V4L2_MEMORY_DMABUF;
+	if (-1 == xioctl(fd, VIDIOC_REQBUFS, &req)) {
+		ret = errno_to_error(errno);
+		DBGERROR("%s does not support dma-buf import\n", ctx->dev_name);
+		free(buffers);
+		ctx->buffers = NULL;
+		return ret;
+	}
+	/* the driver may want more than it gave for MMAP */
+	if (req.count > (unsigned int)n_buffers) {
+		struct buffer *more = realloc(buffers, req.count * sizeof(*buffers));
+
+		if (!more) {
+			DBGERROR("Out of memory\n");
+			free(buffers);
+			ctx->buffers = NULL;
+			return VIDEO_ERR_NOMEM;
+		}
+		buffers = more;
+		ctx->buffers = buffers;
+		memset(buffers + n_buffers, 0, (req.count - n_buffers) * sizeof(*buffers));
+		for (i = n_buffers; i < req.count; i++)
+			buffers[i].dmabuf_fd = -1;
+	}
+
+	for (i = 0; i < req.count; i++) {
+		buffers[i].offset = 0;
+		buffers[i].length = sizeimage;
+		buffers[i].dmabuf_fd = alloc_dmabuf(sizeimage, &buffers[i].start);
+		if (buffers[i].dmabuf_fd < 0) {
+			DBGERROR("Out of dma-buf memory\n");
+			while (i--)
+				free_dmabuf(buffers[i].dmabuf_fd, buffers[i].start, buffers[i].length);
+			free(buffers);
+			ctx->buffers = NULL;
+			return VIDEO_ERR_NOMEM;
+		}
+	}
+	ctx->n_buffers = req.count;
+	ctx->memory = V4L2_MEMORY_DMABUF;
+
+	DBG_EXIT();
+
+	return 0;
+}
+
+static int init_userp(struct video_context *ctx, int num_of_driverbuf, unsigned int sizeimage)
+{
+	struct v4l2_requestbuffers req;
+	struct userptr_pool *pool;
+	struct buffer *buffers;
+	char *dev_name;
+	int fd, i;
+
+	dev_name = ctx->dev_name;
+	fd = ctx->fd;
+	pool = &ctx->pool;
+
+	DBG_ENTER();
+	if (pool->count) {
+		if (pool->length < sizeimage) {
+			DBGERROR("userptr pool buffer %u is smaller than image %u\n",
+					 pool->length, sizeimage);
+			return VIDEO_ERR_INVALID;
+		}
+		num_of_driverbuf = pool->count;
+	}
+
+	CLEAR(req);
+	req.count = num_of_driverbuf;
+	req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	req.memory = V4L2_MEMORY_USERPTR;
+
+	if (-1 == ioctl(fd, VIDIOC_REQBUFS, &req)) {
+		DBGERROR("%s does not support user pointer i/o\n", dev_name);
+		return VIDEO_ERR_UNSUPPORTED;
+	}
+	DBGPRINT("VIDIOC_REQBUFS done\n");
+	/* the driver may change the count, a pool can not grow */
+	if (pool->count && req.count > (unsigned int)pool->count) {
+		DBGERROR("%s needs %u buffers, the userptr pool has %d\n", dev_name,
+				 req.count, pool->count);
+		return VIDEO_ERR_INVALID;
+	}
+	num_of_driverbuf = req.count;
+
+	buffers = calloc(num_of_driverbuf, sizeof(*buffers));
+	if (!buffers) {
+		DBGERROR("Out of memory\n");
+		return VIDEO_ERR_NOMEM;
 	}
-	else {
-		n_buffers_rgb = n_buffers;
+
+	for (i = 0; i < num_of_driverbuf; i++) {
+		buffers[i].dmabuf_fd = -1;
+		if (pool->count) {
+			buffers[i].start = pool->start[i];
+			buffers[i].length = pool->length;
+		} else {
+			buffers[i].length = sizeimage;
+			if (posix_memalign(&buffers[i].start, sysconf(_SC_PAGESIZE), sizeimage)) {
+				DBGERROR("Out of memory\n");
+				while (i--)
+					free(buffers[i].start);
+				free(buffers);
+				return VIDEO_ERR_NOMEM;
+			}
+		}
 	}
 
+	ctx->buffers = buffers;
+	ctx->n_buffers = num_of_driverbuf;
+	ctx->memory = V4L2_MEMORY_USERPTR;
 	DBG_EXIT();
 
 	return 0;
 }
 
+/* queue (VIDIOC_QBUF) or prepare (VIDIOC_PREPARE_BUF) buffer index */
+static int qbuf_index_ioctl(struct video_context *ctx, int index, int request)
+{
+	struct v4l2_buffer buf;
+	struct buffer *buffer = &ctx->buffers[index];
+
+#if defined(CAPTURE_MPLANE)
+	struct v4l2_plane planes[VIDEO_MAX_PLANES];
+
+	CLEAR(planes);
+#endif
+	CLEAR(buf);
+	buf.type = CAPTURE_BUF_TYPE;
+	buf.memory = ctx->memory;
+	buf.index = index;
+	buf.flags = ctx->qbuf_flags;
+#if defined(CAPTURE_MPLANE)
+	/* only MMAP is set up for multi planar */
+	buf.m.planes = planes;
+	buf.length = buffer->num_planes;
+#else
+	if (ctx->memory == V4L2_MEMORY_DMABUF) {
+		buf.m.fd = buffer->dmabuf_fd;
+		buf.length = buffer->length;
+	} else
+	if (ctx->memory == V4L2_MEMORY_USERPTR) {
+		buf.m.userptr = (unsigned long)buffer->start;
+		buf.length = buffer->length;
+	}
+#endif
+	return xioctl(ctx->fd, request, &buf);
+}
+
+static int qbuf_index(struct video_context *ctx, int index)
+{
+	if (-1 == qbuf_index_ioctl(ctx, index, VIDIOC_QBUF))
+		return -1;
+	ctx->buffers[index].queued = 1;
+
+	return 0;
+}
+
+/*
+ * Do the cache maintenance and page pinning of every buffer now, not on
+ * the first QBUF after STREAMON. Drivers without PREPARE_BUF are fine.
+ */
+static void prepare_buffers(struct video_context *ctx)
+{
+	int i;
+
+	for (i = 0; i < ctx->n_buffers; i++) {
+		if (-1 == qbuf_index_ioctl(ctx, i, VIDIOC_PREPARE_BUF)) {
+			DBGINFO("%s: no VIDIOC_PREPARE_BUF\n", ctx->dev_name);
+			break;
+		}
+	}
+}
+
+/* dma-buf backed buffers need explicit syncs around cpu access */
+static int sync_buffer(struct video_context *ctx, struct buffer *buffer, unsigned int when)
+{
+	struct dma_buf_sync sync;
+
+	if (buffer->dmabuf_fd < 0)
+		return 0;
+	CLEAR(sync);
+	sync.flags = when | ((ctx->cpu_access & VIDEO_CPU_WRITE) ? DMA_BUF_SYNC_RW : DMA_BUF_SYNC_READ);
+	if (-1 == xioctl(buffer->dmabuf_fd, DMA_BUF_IOCTL_SYNC, &sync))
+		errno_return("DMA_BUF_IOCTL_SYNC");
+
+	return 0;
+}
+
 static unsigned int get_size(int fmt, int num, int ww, int hh)
 {
     int size;
@@ -316,6 +1213,15 @@ static unsigned int get_size(int fmt, int num, int ww, int hh)
             size = (ww * hh) >> 2;
         }
         break;
+    case V4L2_PIX_FMT_NV12M:
+    case V4L2_PIX_FMT_NV21M:
+        if (num > 1) return 0;
+        if (num == 0) {
+            size = ww * hh;
+        } else {
+            size = (ww * hh) >> 1;
+        }
+        break;
     case V4L2_PIX_FMT_YUV422P:
         if (num == 0) {
             size = ww * hh;
@@ -344,11 +1250,13 @@ static unsigned int get_size(int fmt, int num, int ww, int hh)
 */
 void gain_ctrl(int module, int val)
 {
-	if (MODULE_3DDEPTH == module) {
+	struct video_context *ctx = get_context(module);
+
+	if (!ctx || MODULE_3DDEPTH == ctx->kind) {
 		// Do nothing for 3d sensor
 	} else 
-	if (MODULE_RGB == module) {
-		vidioc_set_ctrl(fd_rgb, V4L2_CID_EXPOSURE_AUTO, 0);
+	if (MODULE_RGB == ctx->kind) {
+		vidioc_set_ctrl(module, V4L2_CID_EXPOSURE_AUTO, 0);
 	}
 }
 
@@ -362,10 +1270,12 @@ void gain_ctrl(int module, int val)
 */
 void exposure_ctrl(int module, int val)
 {
-	if (MODULE_3DDEPTH == module) {
+	struct video_context *ctx = get_context(module);
+
+	if (!ctx || MODULE_3DDEPTH == ctx->kind) {
 	} else
-	if (MODULE_RGB == module) {
-		vidioc_set_ctrl(fd_rgb, V4L2_CID_EXPOSURE_AUTO, 0);
+	if (MODULE_RGB == ctx->kind) {
+		vidioc_set_ctrl(module, V4L2_CID_EXPOSURE_AUTO, 0);
 	}	
 }
 
@@ -389,34 +1299,43 @@ int init_video_device(int module, int width, int height, int num_of_driverbuf)
 	struct v4l2_frmsizeenum fsize;
 	struct v4l2_streamparm parm;
 	struct v4l2_fmtdesc ffmt;
+	struct video_context *ctx;
+	struct probe_entry probe;
 	char  *dev_name;
-	int fd,ret,cap_fmt;
+	int fd,ret,cap_fmt,cached;
 	int top = 0, left = 0;
 
 	DBG_ENTER();
-	if (module == MODULE_RGB) {
-		fd = fd_rgb;
-		dev_name = "/dev/video0";
-		g_cap_fmt_rgb = V4L2_PIX_FMT_YUYV;
-		cap_fmt = g_cap_fmt_rgb;
-	}
-	else
-	if (module == MODULE_3DDEPTH) {
-		fd = fd_3d;
-		dev_name = "/dev/video1";
-		g_cap_fmt_3d = V4L2_PIX_FMT_SBGGR12P;
-		cap_fmt = g_cap_fmt_3d;
-	} else
+	ctx = get_context(module);
+	if (!ctx)
 		return -1;
+	fd = ctx->fd;
+	dev_name = ctx->dev_name;
+	cap_fmt = ctx->cap_fmt;
+	ctx->io = g_io;
+	memset(&ctx->stats, 0, sizeof(ctx->stats));
+	/* a re-init without reopening starts a new timeline */
+	if (!ctx->timing) {
+		CLEAR(ctx->timeline);
+		ctx->timing = 1;
+		ctx->mark_us = mono_us();
+	}
+
+#if defined(CAPTURE_MPLANE)
+	if (ctx->io != IO_METHOD_MMAP) {
+		DBGERROR("multi planar capture supports only IO_METHOD_MMAP\n");
+		return VIDEO_ERR_UNSUPPORTED;
+	}
+#endif
 
 	if (-1 == xioctl(fd, VIDIOC_QUERYCAP, &cap)) {
 		 DBGERROR("VIDIOC_QUERYCAP err");
 		if (EINVAL == errno) {
 			DBGERROR("%s is no V4L2 device",
 					 dev_name);
-			exit(EXIT_FAILURE);
+			return VIDEO_ERR_UNSUPPORTED;
 		} else {
-			errno_exit("VIDIOC_QUERYCAP");
+			errno_return("VIDIOC_QUERYCAP");
 		}
 	}
 	if (!(cap.capabilities & V4L2_CAP_VIDEO_CAPTURE) &&
@@ -424,10 +1343,11 @@ int init_video_device(int module, int width, int height, int num_of_driverbuf)
 		DBGERROR("V4L2_CAP_VIDEO_CAPTURE err");
 		DBGERROR("%s is no video capture device\n",
 					 dev_name);
-		exit(EXIT_FAILURE);
+		return VIDEO_ERR_UNSUPPORTED;
 	}
 	DBGINFO("card:%s driver:%s bus:%s version : %X\n", cap.card, cap.driver, cap.bus_info, cap.version);
-	switch (g_io) {
+	timeline_mark(ctx, "querycap");
+	switch (ctx->io) {
 	case IO_METHOD_MMAP:
 	case IO_METHOD_USERPTR:
 	case IO_METHOD_DMABUF:
@@ -435,11 +1355,21 @@ int init_video_device(int module, int width, int height, int num_of_driverbuf)
 			DBGERROR("V4L2_CAP_STREAMING err\n");
 			DBGERROR("%s does not support streaming i/o\n",
 						 dev_name);
-			exit(EXIT_FAILURE);
+			return VIDEO_ERR_UNSUPPORTED;
 		}
 		break;
 	}
 	
+	probe_key(&probe, &cap, cap_fmt, width, height);
+	pthread_mutex_lock(&probe_lock);
+	cached = probe_find(&probe) >= 0;
+	pthread_mutex_unlock(&probe_lock);
+	ctx->timeline.cached = cached;
+	if (cached) {
+		DBGINFO("%s: probed before, skip enumeration\n", dev_name);
+		goto configure;
+	}
+
 	/* Select video input, video standard and tune here. */
 	CLEAR(cropcap);
 
@@ -487,12 +1417,22 @@ int init_video_device(int module, int width, int height, int num_of_driverbuf)
 	}
 
 	ffmt.index = 0;
+	ffmt.type = CAPTURE_BUF_TYPE;
 	while (ioctl(fd, VIDIOC_ENUM_FMT, &ffmt) >= 0) {
 		print_pixelformat("sensor frame format", ffmt.pixelformat);
 		ffmt.index++;
 	}
 
-	parm.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	/* UVC driver does not implement CROP */
+	crop.type = CAPTURE_BUF_TYPE;
+	if (ioctl(fd, VIDIOC_G_CROP, &crop) < 0) {
+		DBGERROR("VIDIOC_G_CROP failed\n");
+		return -1;
+	}
+	timeline_mark(ctx, "probe");
+
+configure:
+	parm.type = CAPTURE_BUF_TYPE;
 	parm.parm.capture.timeperframe.numerator = 1;
 	parm.parm.capture.timeperframe.denominator = g_camera_framerate;
 	parm.parm.capture.capturemode = g_capture_mode;
@@ -506,21 +1446,17 @@ int init_video_device(int module, int width, int height, int num_of_driverbuf)
 		DBGERROR("VIDIOC_S_INPUT failed\n");
 		return -1;
 	}
+	timeline_mark(ctx, "parm/input");
 
-	/* UVC driver does not implement CROP */
-	crop.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-	if (ioctl(fd, VIDIOC_G_CROP, &crop) < 0) {
-		DBGERROR("VIDIOC_G_CROP failed\n");
-		return -1;
-	}
-
-	crop.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	crop.type = CAPTURE_BUF_TYPE;
 	crop.c.width = width;
 	crop.c.height = height;
 	crop.c.top = top;
 	crop.c.left = left;
 	if (ioctl(fd, VIDIOC_S_CROP, &crop) < 0) {
 		DBGERROR("VIDIOC_S_CROP failed\n");
+		if (cached)
+			probe_update(&probe, 0);
 		return -1;
 	}
 
@@ -540,7 +1476,40 @@ int init_video_device(int module, int width, int height, int num_of_driverbuf)
 	}
 	
 
-	
+	
+#if defined(CAPTURE_MPLANE)
+	CLEAR(fmt);
+	fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+	fmt.fmt.pix_mp.pixelformat = cap_fmt;
+	fmt.fmt.pix_mp.width = width;
+	fmt.fmt.pix_mp.height = height;
+	fmt.fmt.pix_mp.field = V4L2_FIELD_NONE;
+
+	if (ioctl(fd, VIDIOC_S_FMT, &fmt) < 0) {
+		DBGERROR("set format failed\n");
+		if (cached)
+			probe_update(&probe, 0);
+		return -1;
+	}
+	{
+		int i;
+
+		for (i = 0; i < fmt.fmt.pix_mp.num_planes; i++) {
+			/* Buggy driver paranoia. */
+			if (fmt.fmt.pix_mp.plane_fmt[i].sizeimage == 0)
+				fmt.fmt.pix_mp.plane_fmt[i].sizeimage = get_size(cap_fmt, i, width, height);
+			DBGINFO("plane%d imgsize=%d\n", i, fmt.fmt.pix_mp.plane_fmt[i].sizeimage);
+		}
+		ctx->frame_size = 0;
+		for (i = 0; i < fmt.fmt.pix_mp.num_planes; i++)
+			ctx->frame_size += fmt.fmt.pix_mp.plane_fmt[i].sizeimage;
+	}
+	ctx->width = fmt.fmt.pix_mp.width;
+	ctx->height = fmt.fmt.pix_mp.height;
+	ctx->bytesperline = fmt.fmt.pix_mp.plane_fmt[0].bytesperline;
+	ctx->num_planes = fmt.fmt.pix_mp.num_planes;
+	timeline_mark(ctx, "format");
+#else
 	fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
 	fmt.fmt.pix.pixelformat = cap_fmt;
 	fmt.fmt.pix.width = width;
@@ -550,9 +1519,18 @@ int init_video_device(int module, int width, int height, int num_of_driverbuf)
 
 	if (ioctl(fd, VIDIOC_S_FMT, &fmt) < 0) {
 		DBGERROR("set format failed\n");
+		if (cached)
+			probe_update(&probe, 0);
 		return -1;
 	}
 	DBGINFO("imgsize=%d\n", fmt.fmt.pix.sizeimage);
+	/* Buggy driver paranoia. */
+	ctx->frame_size = fmt.fmt.pix.sizeimage ? fmt.fmt.pix.sizeimage : get_size(cap_fmt, 0, width, height);
+	ctx->width = fmt.fmt.pix.width;
+	ctx->height = fmt.fmt.pix.height;
+	ctx->bytesperline = fmt.fmt.pix.bytesperline;
+	timeline_mark(ctx, "format");
+#endif
 
 	/*
  	* Set rotation
@@ -575,7 +1553,7 @@ int init_video_device(int module, int width, int height, int num_of_driverbuf)
 	if (fmt.fmt.pix_mp.sizeimage < min)
 			fmt.fmt.pix_mp.sizeimage = min;
 	*/
-	switch (g_io) {
+	switch (ctx->io) {
 	/*case IO_METHOD_READ:
 		DEBUG_PRINT("IO_METHOD_READ\n");
 		//init_read(fmt.fmt.pix_mp.sizeimage);
@@ -583,15 +1561,22 @@ int init_video_device(int module, int width, int height, int num_of_driverbuf)
 	*/
 	case IO_METHOD_MMAP:
 		DBGPRINT("IO_METHOD_MMAP\n");
-		ret = init_mmap(module, num_of_driverbuf);
+		ret = init_mmap(ctx, num_of_driverbuf);
+		if (ret)
+			return ret;
 		break;
 	
 	case IO_METHOD_USERPTR:
 		DBGPRINT("IO_METHOD_USERPTR\n");
-		//	init_userp(fmt.fmt.pix_mp.sizeimage);
+		ret = init_userp(ctx, num_of_driverbuf, ctx->frame_size);
+		if (ret)
+			return ret;
 		break;
 	case IO_METHOD_DMABUF:
-		// Not support
+		DBGPRINT("IO_METHOD_DMABUF\n");
+		ret = init_dmabuf(ctx, num_of_driverbuf, ctx->frame_size);
+		if (ret)
+			return ret;
 		break;
 	}
 	/* Now I try to allocate memory for frames that slow file operation
@@ -602,6 +1587,10 @@ int init_video_device(int module, int width, int height, int num_of_driverbuf)
 			frame_buf[i] = (char *)malloc(width * height * 2);
 		}
 	}*/
+	prepare_buffers(ctx);
+	timeline_mark(ctx, "buffers");
+	if (!cached)
+		probe_update(&probe, 1);
 	
 	DBG_EXIT();
 
@@ -611,111 +1600,172 @@ int init_video_device(int module, int width, int height, int num_of_driverbuf)
 /**
  *  @brief  "C" start capture
  *  @param[in] module   video module
- *  @return none
+ *  @return \b zero for success
+ *          \b under zero VIDEO_ERR_xxx value indicated the error
  *
  *  @see   stop_capture
 */
-void start_video_capture(int module)
+int start_video_capture(int module)
 {
 	unsigned int i, n_buffers;
 	int fd;
 	enum v4l2_buf_type type;
+	struct video_context *ctx = get_context(module);
 
-	if (module == MODULE_RGB) {
-		fd = fd_rgb;
-		n_buffers = n_buffers_rgb;
-	}
-	else
-	if (module == MODULE_3DDEPTH) {
-		fd = fd_3d;
-		n_buffers = n_buffers_3d;
-	} else {
+	if (!ctx) {
 		DBGERROR("module is not correct value\n");
-		return;
+		return VIDEO_ERR_INVALID;
 	}
+	fd = ctx->fd;
+	n_buffers = ctx->n_buffers;
 
 	DBG_ENTER();
-	switch (g_io) {
-	case IO_METHOD_MMAP:
-#if defined(CAPTURE_MPLANE)	
-		for (i = 0; i < n_buffers; ++i) {
-			struct v4l2_buffer buf;
-
-			CLEAR(buf);
-			buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
-			buf.memory = V4L2_MEMORY_MMAP;
-			buf.index = i;
-
-			if (-1 == xioctl(fd, VIDIOC_QBUF, &buf)) {
-				errno_exit("VIDIOC_QBUF");
-			}
-		}
-		type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
-		if (-1 == xioctl(fd, VIDIOC_STREAMON, &type)) {
-			errno_exit("VIDIOC_STREAMON");
-		}
-#else
-		for (i = 0; i < n_buffers; ++i) {
-			struct v4l2_buffer buf;
-
-			CLEAR(buf);
-			buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-			buf.memory = V4L2_MEMORY_MMAP;
-			buf.index = i;
-
-			if (-1 == xioctl(fd, VIDIOC_QBUF, &buf)) {
-				DBGERROR("What error?\n")
-				errno_exit("VIDIOC_QBUF");
-			}
+	for (i = 0; i < n_buffers; ++i) {
+		if (qbuf_index(ctx, i)) {
+			errno_return("VIDIOC_QBUF");
 		}
-		type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-		DBGINFO("stream on\n");
-		if (-1 == xioctl(fd, VIDIOC_STREAMON, &type)) {
-			errno_exit("VIDIOC_STREAMON");	
-		}
-#endif
-		break;
-	
-	case IO_METHOD_USERPTR:
-		break;
-	case IO_METHOD_DMABUF:
-		break;
 	}
+	type = CAPTURE_BUF_TYPE;
+	DBGINFO("stream on\n");
+	if (-1 == xioctl(fd, VIDIOC_STREAMON, &type)) {
+		errno_return("VIDIOC_STREAMON");
+	}
+	ctx->failed_recoveries = 0;
+	ctx->last_frame_us = mono_us();
+	ctx->streaming = 1;
+	if (ctx->timing)
+		timeline_mark(ctx, "streamon");
 	DBG_EXIT();
+
+	return 0;
 }
 
 /**
  *  @brief  "C" stop capture
  *  @param[in] module   video module
- *  @return none
+ *  @return \b zero for success
+ *          \b under zero VIDEO_ERR_xxx value indicated the error
  *
  *  @see   start_capture
 */
-void stop_video_capture(int module)
+int stop_video_capture(int module)
 {
-	int fd;
+	int fd, i;
 	enum v4l2_buf_type type;
+	struct video_context *ctx = get_context(module);
 
-	if (module == MODULE_RGB) {
-		fd = fd_rgb;
-	}
-	else
-	if (module == MODULE_3DDEPTH) {
-		fd = fd_3d;
-	} else {
+	if (!ctx || ctx->fd < 0) {
 		DBGERROR("invalid module value\n");
-		return;
+		return VIDEO_ERR_INVALID;
 	}
+	fd = ctx->fd;
 
 	DBG_ENTER();
-#if defined(CAPTURE_MPLANE)	
-	type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
-#else
-	type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-#endif
+	/* a dequeue failing from now on is not a stall to recover from */
+	ctx->streaming = 0;
+	type = CAPTURE_BUF_TYPE;
 	if (-1 == xioctl(fd, VIDIOC_STREAMOFF, &type))
-		errno_exit("VIDIOC_STREAMOFF");
+		errno_return("VIDIOC_STREAMOFF");
+	/* STREAMOFF took every buffer back from the driver */
+	for (i = 0; i < ctx->n_buffers; i++)
+		ctx->buffers[i].queued = 0;
 	DBG_EXIT();
+
+	return 0;
+}
+
+/*
+ * Restart a stalled or failed stream. Buffers the application holds stay
+ * with it, the ones the driver had are queued again.
+ */
+static int recover_stream(struct video_context *ctx)
+{
+	enum v4l2_buf_type type = CAPTURE_BUF_TYPE;
+	unsigned long long start, took;
+	int i;
+
+	if (!ctx->streaming)
+		return VIDEO_ERR_INVALID;
+	if (ctx->failed_recoveries >= MAX_RECOVERY) {
+		DBGERROR("%s: no frame after %d restarts\n", ctx->dev_name, MAX_RECOVERY);
+		/* caller decides, the next call tries again */
+		ctx->failed_recoveries = 0;
+		ctx->last_frame_us = mono_us();
+		return VIDEO_ERR_TIMEOUT;
+	}
+	start = mono_us();
+	ctx->failed_recoveries++;
+	ctx->stats.recoveries++;
+	DBGERROR("%s: restart stream\n", ctx->dev_name);
+
+	if (-1 == xioctl(ctx->fd, VIDIOC_STREAMOFF, &type))
+		errno_return("VIDIOC_STREAMOFF");
+	for (i = 0; i < ctx->n_buffers; i++) {
+		if (!ctx->buffers[i].queued)
+			continue;
+		ctx->buffers[i].queued = 0;
+		if (qbuf_index(ctx, i))
+			errno_return("VIDIOC_QBUF");
+	}
+	if (-1 == xioctl(ctx->fd, VIDIOC_STREAMON, &type))
+		errno_return("VIDIOC_STREAMON");
+
+	ctx->last_frame_us = mono_us();
+	took = ctx->last_frame_us - start;
+	if (took > ctx->stats.recovery_us_max)
+		ctx->stats.recovery_us_max = took;
+
+	return 0;
+}
+
+static int stall_limit_us(struct video_context *ctx)
+{
+	if (ctx->stall_ms > 0)
+		return ctx->stall_ms * 1000;
+	return STALL_FRAMES * 1000000 / g_camera_framerate;
+}
+
+/**
+ *  @brief  "C" set the stall watchdog of a module
+ *  @param[in] module   video module
+ *  @param[in] ms       restart the stream after ms without a frame,
+ *                      0 for STALL_FRAMES frame periods, under zero for off
+ *  @return \b zero for success
+ *          \b under zero value indicated the error
+ *  @see   check_video_stall
+*/
+int set_video_watchdog(int module, int ms)
+{
+	struct video_context *ctx = get_context(module);
+
+	if (!ctx)
+		return VIDEO_ERR_INVALID;
+	ctx->stall_ms = ms;
+
+	return 0;
+}
+
+/**
+ *  @brief  "C" restart the stream if the watchdog expired
+ *  @param[in] module   video module
+ *  @return \b zero if the stream is fine or was restarted
+ *          \b under zero VIDEO_ERR_xxx value if restarting failed
+ *  @note   dequeue_and_capture checks by itself while it waits. Callers
+ *          that poll the fd themselves (set_video_wait) call this instead.
+*/
+int check_video_stall(int module)
+{
+	struct video_context *ctx = get_context(module);
+
+	if (!ctx)
+		return VIDEO_ERR_INVALID;
+	if (!ctx->streaming || ctx->stall_ms < 0)
+		return 0;
+	if (mono_us() - ctx->last_frame_us < stall_limit_us(ctx))
+		return 0;
+	ctx->stats.stalls++;
+
+	return recover_stream(ctx);
 }
 
 /**
@@ -728,47 +1778,59 @@ void stop_video_capture(int module)
 int uninit_video_device(int module)
 {
 	unsigned int i;
-	int n_buffers;
+	int n_buffers, memory;
 	struct buffer *buffers;
+	struct video_context *ctx = get_context(module);
 
-	if (module == MODULE_RGB) {
-		buffers = buffers_rgb;
-		n_buffers = n_buffers_rgb;
-	}
-	else
-	if (module == MODULE_3DDEPTH) {
-		buffers = buffers_3d;
-		n_buffers = n_buffers_3d;
-	} else
+	if (!ctx)
 		return -1;
+	buffers = ctx->buffers;
+	n_buffers = ctx->n_buffers;
+	memory = ctx->memory;
 
 	DBG_ENTER();
-	switch (g_io) {
+	switch (ctx->io) {
 	case IO_METHOD_MMAP:
 		for (i = 0; i < n_buffers; ++i) {
 #if defined(CAPTURE_MPLANE)
 			int j;
 
-			for (j=0; j< FMT_NUM_PLANES;j++) {
-				if (-1 == munmap(buffers[i].start[j], buffers[i].length[j]))
-					errno_exit("munmap");
+			for (j=0; j< buffers[i].num_planes;j++) {
+				if (-1 == munmap(buffers[i].planes[j].start, buffers[i].planes[j].length)) {
+					DBGERROR("munmap error %d, %s\n", errno, strerror(errno));
+				}
 			}
 #else
-			if (-1 == munmap(buffers->start, buffers->length)) {
-				errno_exit("munmap");	
+			if (-1 == munmap(buffers[i].start, buffers[i].length)) {
+				DBGERROR("munmap error %d, %s\n", errno, strerror(errno));
 			}
 #endif
 		}
 		free(buffers);
 		break;
 	case IO_METHOD_DMABUF:
+		for (i = 0; i < n_buffers; ++i) {
+			if (memory == V4L2_MEMORY_DMABUF) {
+				free_dmabuf(buffers[i].dmabuf_fd, buffers[i].start, buffers[i].length);
+			} else {
+				close(buffers[i].dmabuf_fd);
+				munmap(buffers[i].start, buffers[i].length);
+			}
+		}
+		free(buffers);
 		break;
 	case IO_METHOD_USERPTR:
-		for (i = 0; i < n_buffers; ++i)
-			free(buffers[i].start);
+		/* pool buffers belong to the application */
+		if (!ctx->pool.count) {
+			for (i = 0; i < n_buffers; ++i)
+				free(buffers[i].start);
+		}
 		free(buffers);
 		break;
 	}
+	ctx->buffers = NULL;
+	ctx->n_buffers = 0;
+	ctx->frame_size = 0;
 	DBG_EXIT();
 	/*{
 		int i;
@@ -779,58 +1841,137 @@ int uninit_video_device(int module)
 	return 0;
 }
 
+/**
+ *  @brief  "C" wait for a frame and dequeue it
+ *  @param[in]  module  video module
+ *  @param[out] buf     dequeued buffer, give it back with queue_capture
+ *  @param[out] data    copy of the frame, NULL for none
+ *  @return \b positive value for success
+ *          \b under zero VIDEO_ERR_xxx value indicated the error
+ *  @note   a stalled stream (see set_video_watchdog) or a failed dequeue
+ *          restarts the stream in place, counted in video_stats. Corrupt
+ *          frames are requeued and skipped.
+*/
 int dequeue_and_capture(int module, struct v4l2_buffer *buf, void *data)
 {
-	int              r;
-	int              fd;
+	int              r, ret;
+	int              fd, memory;
 	fd_set           fds;
 	struct timeval   tv;
-	struct buffer *buffers;
+	struct buffer *buffers, *buffer;
+	struct video_context *ctx = get_context(module);
+#if defined(CAPTURE_MPLANE)
+	struct v4l2_plane planes[VIDEO_MAX_PLANES];
+	int i;
+#endif
 
-	if (module == MODULE_RGB) {
-		fd = fd_rgb;
-		buffers = buffers_rgb;
-	}
-	else
-	if (module == MODULE_3DDEPTH) {
-		fd = fd_3d;
-		buffers = buffers_3d;
-	} else {
+	if (!ctx) {
 		DBGERROR("invalid module value\n");
-		return;
+		return -1;
 	}
+	fd = ctx->fd;
+	buffers = ctx->buffers;
+	memory = ctx->memory;
 
 	//DBG_ENTER();
-	do {
-		FD_ZERO(&fds);
-		FD_SET(fd, &fds);
-
-		/* Timeout. */
-		tv.tv_sec = 2;
-		tv.tv_usec = 0;
+	for (;;) {
+		r = 1;
+		if (!ctx->nowait) {
+			FD_ZERO(&fds);
+			FD_SET(fd, &fds);
+
+			/* Timeout, the stall watchdog. */
+			if (ctx->stall_ms < 0) {
+				tv.tv_sec = 2;
+				tv.tv_usec = 0;
+			} else {
+				tv.tv_sec = stall_limit_us(ctx) / 1000000;
+				tv.tv_usec = stall_limit_us(ctx) % 1000000;
+			}
 
-		r = select(fd + 1, &fds, NULL, NULL, &tv);
-	} while ( (r == 0) || ((r == -1) && (errno = EINTR)));
+			r = select(fd + 1, &fds, NULL, NULL, &tv);
+			if (r == -1 && errno == EINTR)
+				continue;
+			if (r == -1) {
+				errno_return("select");
+			}
+			if (r == 0) {
+				if (!ctx->streaming)
+					return VIDEO_ERR_INVALID;
+				ret = check_video_stall(module);
+				if (ret < 0)
+					return ret;
+				continue;
+			}
+		}
 
-	if (r == -1) {
-		perror("select");
-		return errno;
+		CLEAR(*buf);
+		buf->type = CAPTURE_BUF_TYPE;
+		buf->memory = memory;
+#if defined(CAPTURE_MPLANE)
+		CLEAR(planes);
+		buf->m.planes = planes;
+		buf->length = VIDEO_MAX_PLANES;
+#endif
+		
+		if (-1 == xioctl(fd, VIDIOC_DQBUF, buf)) {
+			ret = errno_to_error(errno);
+			/* stopped, or unplugged: nothing to recover */
+			if (!ctx->streaming || ret == VIDEO_ERR_NODEV) {
+				errno_return("VIDIOC_DQBUF");
+			}
+			DBGERROR("%s: VIDIOC_DQBUF error %d, %s\n", ctx->dev_name, errno, strerror(errno));
+			ctx->stats.io_errors++;
+			ret = recover_stream(ctx);
+			if (ret < 0)
+				return ret;
+			/* a polling caller gets called again when a frame is there */
+			if (ctx->nowait)
+				return VIDEO_ERR_IO;
+			continue;
+		}
+		//xioctl(fd, VIDIOC_DQBUF, buf);
+		buffers[buf->index].queued = 0;
+
+		if (buf->flags & V4L2_BUF_FLAG_ERROR) {
+			/* data is corrupt, the stream itself is fine */
+			ctx->stats.corrupt_frames++;
+			ctx->last_frame_us = mono_us();
+			if (qbuf_index(ctx, buf->index)) {
+				errno_return("VIDIOC_QBUF");
+			}
+			if (ctx->nowait)
+				return VIDEO_ERR_IO;
+			continue;
+		}
+		break;
 	}
+	ctx->failed_recoveries = 0;
+	ctx->last_frame_us = mono_us();
 
-	CLEAR(*buf);
-	buf->type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-	buf->memory = V4L2_MEMORY_MMAP;
-	
-	if (-1 == xioctl(fd, VIDIOC_DQBUF, buf)) {
-		DBGERROR("What error?\n")
-		errno_exit("VIDIOC_DQBUF");
+#if defined(CAPTURE_MPLANE)
+	/* keep the planes with the buffer so the caller can queue_capture() it back */
+	buffer = &buffers[buf->index];
+	memcpy(buffer->v4l2_planes, planes, sizeof(planes));
+	buf->m.planes = buffer->v4l2_planes;
+	buf->bytesused = 0;
+	for (i = 0; i < buffer->num_planes; i++) {
+		buffer->planes[i].bytesused = planes[i].bytesused;
+		/* Copy memory to data, planes back to back */
+		if (data != NULL)
+			memcpy((char *)data + buf->bytesused, buffer->planes[i].start, planes[i].bytesused);
+		buf->bytesused += planes[i].bytesused;
 	}
-	//xioctl(fd, VIDIOC_DQBUF, buf);
-
-
+#else
 	/* Copy memory to data */
-	if (data != NULL)
-		memcpy(data, buffers[buf->index].start, buf->bytesused);
+	if (data != NULL) {
+		buffer = &buffers[buf->index];
+		sync_buffer(ctx, buffer, DMA_BUF_SYNC_START);
+		memcpy(data, buffer->start, buf->bytesused);
+		sync_buffer(ctx, buffer, DMA_BUF_SYNC_END);
+	}
+#endif
+	update_stats(ctx, buf);
 
 	return r;
 }
@@ -838,56 +1979,272 @@ int dequeue_and_capture(int module, struct v4l2_buffer *buf, void *data)
 int queue_capture(int module, struct v4l2_buffer *buf)
 {
 	int fd;
+	struct buffer *buffers;
+	struct video_context *ctx = get_context(module);
 
-	if (module == MODULE_RGB) {
-		fd = fd_rgb;
-	}
-	else
-	if (module == MODULE_3DDEPTH) {
-		fd = fd_3d;
-	} else {
+	if (!ctx) {
 		DBGERROR("invalid module value\n");
-		return;
+		return VIDEO_ERR_INVALID;
 	}
+	fd = ctx->fd;
+	buffers = ctx->buffers;
+	buf->flags &= ~(V4L2_BUF_FLAG_NO_CACHE_INVALIDATE | V4L2_BUF_FLAG_NO_CACHE_CLEAN);
+	buf->flags |= ctx->qbuf_flags;
 	if (-1 == xioctl(fd, VIDIOC_QBUF, buf)) {
 		DBGERROR("What error?\n")
-		errno_exit("VIDIOC_QBUF");
+		errno_return("VIDIOC_QBUF");
 	}
 //	xioctl(fd, VIDIOC_QBUF, buf);
+	buffers[buf->index].queued = 1;
+
+	return 0;
 }
 
-#if defined(CAPTURE_MPLANE)
-static void process_image(char *ptr, const void *p1, int size1, const void *p2, int size2,const void *p3, int size3)
-{	
-	memcpy(ptr, p1, size1); ptr += size1;
-	memcpy(ptr, p2, size2); ptr += size2;
-	memcpy(ptr, p3, size3);
+/**
+ *  @brief  "C" requeue a dequeued buffer by index
+ *  @param[in] module   video module
+ *  @param[in] index    buffer index from dequeue_and_capture
+ *  @return \b zero for success
+ *          \b under zero value if buffer is already owned by the driver
+ *  @note   used when the buffer went through another queue (uvc gadget)
+ *          and the original v4l2_buffer is not at hand anymore.
+ *  @see    dequeue_and_capture, get_video_dmabuf
+*/
+int requeue_video_buffer(int module, int index)
+{
+	int n_buffers;
+	struct buffer *buffers;
+	struct video_context *ctx = get_context(module);
+
+	if (!ctx)
+		return -1;
+	buffers = ctx->buffers;
+	n_buffers = ctx->n_buffers;
+
+	if (index < 0 || index >= n_buffers || buffers[index].queued) {
+		DBGERROR("buffer %d is not dequeued\n", index);
+		return -1;
+	}
+
+	return qbuf_index(ctx, index);
+}
+
+/**
+ *  @brief  "C" get cpu address of a capture buffer
+ *  @param[in]  module  video module
+ *  @param[in]  index   buffer index
+ *  @param[out] start   mmap'd, pool or dma-buf mapping of the buffer
+ *  @param[out] length  size of the buffer
+ *  @return \b zero for success
+ *          \b under zero value indicated the error
+ *  @see    requeue_video_buffer
+*/
+int get_video_buffer(int module, int index, void **start, unsigned int *length)
+{
+	struct buffer *buffers;
+	int n_buffers;
+	struct video_context *ctx = get_context(module);
+
+	if (!ctx)
+		return -1;
+	buffers = ctx->buffers;
+	n_buffers = ctx->n_buffers;
+
+	if (index < 0 || index >= n_buffers)
+		return -1;
+	*start = buffers[index].start;
+	*length = buffers[index].length;
+
+	return 0;
+}
+
+/**
+ *  @brief  "C" get dma-buf of a capture buffer
+ *  @param[in]  module  video module
+ *  @param[in]  index   buffer index
+ *  @param[out] fd      dma-buf file descriptor, owned by video api
+ *  @param[out] length  size of the dma-buf
+ *  @return \b zero for success
+ *          \b under zero value if module was not set up for IO_METHOD_DMABUF
+ *  @see    set_video_io_method, requeue_video_buffer
+*/
+int get_video_dmabuf(int module, int index, int *fd, unsigned int *length)
+{
+	struct buffer *buffers;
+	int n_buffers;
+	struct video_context *ctx = get_context(module);
+
+	if (!ctx)
+		return -1;
+	buffers = ctx->buffers;
+	n_buffers = ctx->n_buffers;
+
+	if (index < 0 || index >= n_buffers || buffers[index].dmabuf_fd < 0)
+		return -1;
+	*fd = buffers[index].dmabuf_fd;
+	*length = buffers[index].length;
+
+	return 0;
+}
+
+/**
+ *  @brief  "C" tell which stages touch the pixels of a module
+ *  @param[in] module  video module
+ *  @param[in] access  VIDEO_CPU_NONE when frames only pass to other devices,
+ *                     or VIDEO_CPU_READ / VIDEO_CPU_WRITE / VIDEO_CPU_RW
+ *  @return \b zero for success
+ *          \b under zero value indicated the error
+ *  @note   call before init_video_device. The driver skips the cache
+ *          invalidate (no READ) and clean (no WRITE) of each buffer.
+ *          With VIDEO_CPU_NONE do not copy in dequeue_and_capture unless
+ *          buffers are dma-bufs, which are synced around the copy.
+ *  @see    begin_video_cpu_access
+*/
+int set_video_cpu_access(int module, int access)
+{
+	struct video_context *ctx = get_context(module);
+
+	if (!ctx || (access & ~VIDEO_CPU_RW))
+		return -1;
+	ctx->cpu_access = access;
+	ctx->qbuf_flags = 0;
+	if (!(access & VIDEO_CPU_READ))
+		ctx->qbuf_flags |= V4L2_BUF_FLAG_NO_CACHE_INVALIDATE;
+	if (!(access & VIDEO_CPU_WRITE))
+		ctx->qbuf_flags |= V4L2_BUF_FLAG_NO_CACHE_CLEAN;
+
+	return 0;
+}
+
+/**
+ *  @brief  "C" start cpu access to a dequeued buffer
+ *  @param[in] module  video module
+ *  @param[in] index   buffer index from a lease or dequeue_and_capture
+ *  @return \b zero for success
+ *          \b under zero value indicated the error
+ *  @note   needed for dma-buf backed buffers (IO_METHOD_DMABUF), a no-op
+ *          for the others. Pair with end_video_cpu_access.
+*/
+int begin_video_cpu_access(int module, int index)
+{
+	struct video_context *ctx = get_context(module);
+
+	if (!ctx || index < 0 || index >= ctx->n_buffers)
+		return VIDEO_ERR_INVALID;
+
+	return sync_buffer(ctx, &ctx->buffers[index], DMA_BUF_SYNC_START);
+}
+
+/**
+ *  @brief  "C" end cpu access to a dequeued buffer
+ *  @param[in] module  video module
+ *  @param[in] index   buffer index
+ *  @return \b zero for success
+ *          \b under zero value indicated the error
+ *  @see    begin_video_cpu_access
+*/
+int end_video_cpu_access(int module, int index)
+{
+	struct video_context *ctx = get_context(module);
+
+	if (!ctx || index < 0 || index >= ctx->n_buffers)
+		return VIDEO_ERR_INVALID;
+
+	return sync_buffer(ctx, &ctx->buffers[index], DMA_BUF_SYNC_END);
 }
+
+/**
+ *  @brief  "C" dequeue a frame without copy
+ *  @param[in]  module  video module
+ *  @param[out] lease   view of the driver buffer, valid until released
+ *  @return \b zero for success
+ *          \b under zero value indicated the error
+ *  @note   the buffer stays out of the driver queue until
+ *          release_video_lease, so hold only few leases at once.
+ *  @see    release_video_lease, dequeue_and_capture
+*/
+int dequeue_video_lease(int module, struct video_lease *lease)
+{
+	struct v4l2_buffer buf;
+	struct buffer *buffers;
+	struct video_context *ctx = get_context(module);
+	int ret;
+
+	if (!ctx)
+		return VIDEO_ERR_INVALID;
+
+	lease->index = -1;
+	ret = dequeue_and_capture(module, &buf, NULL);
+	if (ret < 0)
+		return ret;
+	buffers = ctx->buffers;
+
+	lease->module = module;
+	lease->index = buf.index;
+	lease->start = buffers[buf.index].start;
+	lease->bytesused = buf.bytesused;
+	lease->timestamp = buf.timestamp;
+	lease->sequence = buf.sequence;
+#if defined(CAPTURE_MPLANE)
+	{
+		int i;
+
+		lease->num_planes = buffers[buf.index].num_planes;
+		for (i = 0; i < lease->num_planes; i++) {
+			lease->planes[i].start = buffers[buf.index].planes[i].start;
+			lease->planes[i].bytesused = buffers[buf.index].planes[i].bytesused;
+		}
+	}
 #else
+	lease->num_planes = 1;
+	lease->planes[0].start = lease->start;
+	lease->planes[0].bytesused = lease->bytesused;
+#endif
+
+	return 0;
+}
+
+/**
+ *  @brief  "C" give a leased buffer back to the driver
+ *  @param[in]  lease  lease from dequeue_video_lease, cleared on return
+ *  @return \b zero for success
+ *          \b under zero value indicated the error
+ *  @see    dequeue_video_lease
+*/
+int release_video_lease(struct video_lease *lease)
+{
+	int ret;
+
+	if (lease->index < 0)
+		return -1;
+	ret = requeue_video_buffer(lease->module, lease->index);
+	lease->index = -1;
+	lease->start = NULL;
+
+	return ret;
+}
+
 static void process_image(char *ptr,  const void *p1, int size1)
 {	
 	memcpy(ptr, p1, size1);
 }
-#endif
 int read_frame(int module, void *ptr)
 {
 	struct v4l2_buffer buf;
-	struct buffer *buffer;
+	struct buffer *buffer, *buffers;
 	unsigned int i, n_buffers;
-	int fd;
+	int fd, memory;
+	struct video_context *ctx = get_context(module);
 
-	if (module == MODULE_RGB) {
-		n_buffers = n_buffers_rgb;
-		fd = fd_rgb;
-	} else
-	if (module == MODULE_3DDEPTH) {
-		n_buffers = n_buffers_3d;
-		fd = fd_3d;
-	} else
+	if (!ctx)
 		return -1;
+	n_buffers = ctx->n_buffers;
+	fd = ctx->fd;
+	buffers = ctx->buffers;
+	memory = ctx->memory;
 
 	DBG_ENTER();
-	switch (g_io) {
+	switch (ctx->io) {
 		//process_image(buffers[0].start[0], buffers[0].length[0]);
 		break;
 	
@@ -896,26 +2253,21 @@ int read_frame(int module, void *ptr)
 		{
 			struct v4l2_buffer buf;
 #if defined(CAPTURE_MPLANE)			
-			struct v4l2_plane planes[3];
+			struct v4l2_plane planes[VIDEO_MAX_PLANES];
 #endif
 			CLEAR(buf);
 #if defined(CAPTURE_MPLANE)
 			buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
-			buf.length		= FMT_NUM_PLANES;
+			buf.length		= VIDEO_MAX_PLANES;
 			//
-			memset(&planes[0], 0, sizeof(struct v4l2_plane) * 3);
+			memset(&planes[0], 0, sizeof(planes));
 			buf.m.planes = &planes[0];
 #else
 			buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;		
 #endif
 			
-			if (g_io == IO_METHOD_MMAP) {
-				buf.memory = V4L2_MEMORY_MMAP;
-				//DBG_PRINT("IO_METHOD_MMAP\n");
-			} else {
-				buf.memory = V4L2_MEMORY_DMABUF;
-				//DBG_PRINT("IO_METHOD_DMABUF\n");
-			}
+			/* DMABUF may still be MMAP memory when buffers were exported */
+			buf.memory = memory;
 		
 			if (-1 == xioctl(fd, VIDIOC_DQBUF, &buf)) {
 				//DBG_PRINT("DQ error\n");
@@ -929,26 +2281,27 @@ int read_frame(int module, void *ptr)
 						/* fall through */
 
 				default:
-						errno_exit("VIDIOC_DQBUF");
+						errno_return("VIDIOC_DQBUF");
 				}
 			}
 			//DBG_PRINT("index=%d\n", buf.index);
 			assert(buf.index < n_buffers);
 			//DBG_PRINT("IO_METHOD_MMAP/DMABUF VIDIOC_DQBUF done\n");
-			if (module == MODULE_RGB)
-				buffer = &buffers_rgb[buf.index];
-			else {
-				buffer = &buffers_3d[buf.index];
-			}
+			buffer = &buffers[buf.index];
+			update_stats(ctx, &buf);
 
 #if defined(CAPTURE_MPLANE)
-			/* we need number of planes buffer */
+			for (i = 0; i < buffer->num_planes; i++) {
+				process_image((char *)ptr, buffer->planes[i].start, planes[i].bytesused);
+				ptr = (char *)ptr + planes[i].bytesused;
+			}
 #else
 			process_image((char *)ptr, buffer->start, buffer->length);
 #endif
 
-			if (-1 == xioctl(fd, VIDIOC_QBUF, &buf))
-				errno_exit("VIDIOC_QBUF");
+			if (-1 == xioctl(fd, VIDIOC_QBUF, &buf)) {
+				errno_return("VIDIOC_QBUF");
+			}
 			//DBG_PRINT("O_METHOD_MMAP/DMABUF VIDIOC_QBUF done\n");
 		}
 		break;
@@ -956,7 +2309,10 @@ int read_frame(int module, void *ptr)
 	case IO_METHOD_USERPTR:
 		CLEAR(buf);
 #if defined(CAPTURE_MPLANE)
-		buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+		/* init_video_device refuses USERPTR for multi planar */
+		return -1;
+#else
+		buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
 		buf.memory = V4L2_MEMORY_USERPTR;
 
 		if (-1 == xioctl(fd, VIDIOC_DQBUF, &buf)) {
@@ -964,29 +2320,22 @@ int read_frame(int module, void *ptr)
 			case EAGAIN:
 					return 0;
 
-			case EIO:
-					/* Could ignore EIO, see spec. */
-
-					/* fall through */
-
 			default:
-					errno_exit("VIDIOC_DQBUF");
+					errno_return("VIDIOC_DQBUF");
 			}
 		}
 
 		for (i = 0; i < n_buffers; ++i)
-			if (buf.m.userptr == (unsigned long)buffers[i].start[0]
-				&& buf.length == buffers[i].length[0])
+			if (buf.m.userptr == (unsigned long)buffers[i].start)
 				break;
-#else
-		/* Not supported YET */
-#endif
 		assert(i < n_buffers);
 
-		//process_image((void *)buf.m.userptr, buf.bytesused);
+		process_image((char *)ptr, (void *)buf.m.userptr, buf.bytesused);
+#endif
 
-		if (-1 == xioctl(fd, VIDIOC_QBUF, &buf))
-			errno_exit("VIDIOC_QBUF");
+		if (-1 == xioctl(fd, VIDIOC_QBUF, &buf)) {
+			errno_return("VIDIOC_QBUF");
+		}
 		break;
 	}
 	DBG_EXIT();
@@ -995,16 +2344,13 @@ int read_frame(int module, void *ptr)
 
 int close_video_device(int module)
 {
-	int fd;
+	struct video_context *ctx = get_context(module);
 
-	if (module == MODULE_RGB)
-		fd = fd_rgb;
-	else if (module == MODULE_3DDEPTH)
-		fd = fd_3d;
-	else
+	if (!ctx)
 		return -1;
 
-	close(fd);
+	close(ctx->fd);
+	ctx->fd = -1;
 
 	return 0;
 }